@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Compares the allocator of two runtimes: reports the best rewrite throughput
+# of a few runs and, when `perf` is available, the cache misses of one run.
+#
+# Usage: HVM_BASELINE=/path/to/old/hvm ./alloc.sh [program:arg ...]
+#
+# Without HVM_BASELINE, only the current runtime is measured.
+
+cd "$(dirname "$0")" || exit 1
+. ./common.sh
+
+if [ "$#" -eq 0 ]; then
+  set -- ListFold:4 TreeSum:20
+fi
+
+mkdir -p "~alloc"
+
+# Prints the cache misses of one run, or "-" without perf
+misses() {
+  local bin="$1" arg="$2"
+  if command -v perf > /dev/null; then
+    perf stat -x, -e cache-misses "${bin}" "${arg}" 2>&1 > /dev/null | awk -F, '/cache-misses/ { print $1 }'
+  else
+    echo "-"
+  fi
+}
+
+labels=(current)
+binaries=("${HVM}")
+if [ -n "${HVM_BASELINE}" ]; then
+  labels+=(baseline)
+  binaries+=("${HVM_BASELINE}")
+fi
+
+printf "%-16s%-10s%12s%16s\n" "program" "runtime" "MR/s" "cache-misses"
+for spec in "$@"; do
+  program="${spec%%:*}"
+  arg="${spec#*:}"
+  for i in "${!labels[@]}"; do
+    bin="~alloc/${labels[$i]}.${program}"
+    printf "%-16s%-10s" "${program} ${arg}" "${labels[$i]}"
+    { generate "${binaries[$i]}" "${program}" && build "${program}/main.c" "${bin}"; } || { echo "build failed"; continue; }
+    printf "%12s%16s\n" "$(rewrites "${bin}" "${arg}")" "$(misses "${bin}" "${arg}")"
+  done
+done
@@ -0,0 +1,28 @@
+# Helpers shared by the benchmark scripts, which source this file from the
+# bench directory. HVM, CC and RUNS can be overridden from the environment.
+
+HVM="${HVM:-hvm}"
+CC="${CC:-clang}"
+RUNS="${RUNS:-5}"
+
+# Generates `program/main.c` with the given hvm binary and `hvm c` flags
+generate() {
+  local hvm="$1" program="$2"
+  shift 2
+  "${hvm}" compile "${program}/main.hvm" "$@" > /dev/null
+}
+
+# Builds the C file `source` into `out`, with the given extra C flags
+build() {
+  local source="$1" out="$2"
+  shift 2
+  "${CC}" -O2 "$@" "${source}" -o "${out}" -lpthread
+}
+
+# Prints the best MR/s of RUNS runs
+rewrites() {
+  local bin="$1" arg="$2"
+  for _ in $(seq "${RUNS}"); do
+    "${bin}" "${arg}" 2>&1 > /dev/null | sed -n 's/^Rewrites: .*(\(.*\) MR\/s).*/\1/p'
+  done | sort -n | tail -n 1
+}
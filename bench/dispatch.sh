@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Compares the two ways of compiling rules: as cases of the switches inlined in
+# reduce() (the default) and as C functions called through a table indexed by
+# function id (`hvm c --fn-table`). Reports how long the C compiler took on
+# each, and the best rewrite throughput of a few runs.
+#
+# Usage: ./dispatch.sh [program:arg ...]
+
+cd "$(dirname "$0")" || exit 1
+. ./common.sh
+
+if [ "$#" -eq 0 ]; then
+  set -- TreeSum:20 QuickSort:8 ListFold:4 RedBlack:10 LambdaArithmetic:20
+fi
+
+mkdir -p "~dispatch"
+
+# Builds `program` with the given `hvm c` flags, into `~dispatch/label.program`,
+# and prints how long the C compiler took, in seconds
+build_timed() {
+  local label="$1" program="$2" flags="$3" start end
+  generate "${HVM}" "${program}" ${flags} || return 1
+  start="$(date +%s%N)"
+  build "${program}/main.c" "~dispatch/${label}.${program}" || return 1
+  end="$(date +%s%N)"
+  awk -v ns="$((end - start))" 'BEGIN { printf "%.2fs\n", ns / 1e9 }'
+}
+
+printf "%-22s%12s%12s%12s%12s\n" "program" "switch cc" "table cc" "switch MR/s" "table MR/s"
+for spec in "$@"; do
+  program="${spec%%:*}"
+  arg="${spec#*:}"
+  printf "%-22s" "${program} ${arg}"
+  times=()
+  rates=()
+  for label in switch table; do
+    flags=""
+    [ "${label}" == "table" ] && flags="--fn-table"
+    time="$(build_timed "${label}" "${program}" "${flags}")" || { times+=(failed); rates+=(-); continue; }
+    times+=("${time}")
+    rates+=("$(rewrites "~dispatch/${label}.${program}" "${arg}")")
+  done
+  printf "%12s%12s%12s%12s\n" "${times[@]}" "${rates[@]}"
+done
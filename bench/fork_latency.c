@@ -0,0 +1,38 @@
+// Measures the cost of handing a normalization pass to the worker threads and
+// collecting their results. Built by fork_latency.sh, which includes a program
+// compiled with -DHVM_LIBRARY, whose Main takes a number. The workers are
+// started once, and each call normalizes a term small enough that its time is
+// dominated by the handoffs of normal()'s passes.
+
+#include HVM_PROGRAM
+
+u64 now_nsec(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+  u64 calls = argc > 1 ? strtoull(argv[1], 0, 10) : 10000;
+  u32 arg = argc > 2 ? (u32)strtoul(argv[2], 0, 10) : 1;
+
+  hvm_init();
+  u64 main_id = hvm_id("Main");
+  u64 result = 0;
+  u64 start = 0;
+  // The first tenth of the calls warms up the heap and the caches
+  for (u64 i = 0; i < calls + calls / 10; ++i) {
+    if (i == calls / 10) {
+      start = now_nsec();
+    }
+    Lnk args[1] = {hvm_u32(arg)};
+    u64 host = hvm_normal(hvm_call(main_id, 1, args));
+    result = get_val(hvm_get(host));
+    hvm_reset();
+  }
+  u64 nsec = now_nsec() - start;
+  hvm_free();
+
+  fprintf(stdout, "%10.2fus (result: %"PRIu64")\n", (double)nsec / 1000 / (double)calls, result);
+  return 0;
+}
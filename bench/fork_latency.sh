@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# Measures the cost of handing work to and from the worker threads. Builds a
+# small TreeSum as a library (see `-DHVM_LIBRARY` in the runtime) with an
+# increasing number of workers (possibly many more than cores), and reports the
+# average time of a normal() call in one process, whose workers are started
+# once. With cheap handoffs, oversubscription should cost little over the
+# single-worker build.
+#
+# Usage: ./fork_latency.sh [depth] [workers ...]
+#
+# Set HVM_BASELINE to another `hvm` binary to compare both side by side.
+
+cd "$(dirname "$0")" || exit 1
+. ./common.sh
+
+CALLS="${CALLS:-10000}"
+DEPTH="${1:-1}"
+shift
+if [ "$#" -eq 0 ]; then
+  set -- 1 2 4 8 16 32 64
+fi
+
+mkdir -p "~fork_latency"
+
+# Prints the average time of a call
+measure() {
+  local bin="$1"
+  "${bin}" "${CALLS}" "${DEPTH}" | awk '{ print $1 }'
+}
+
+labels=(current)
+binaries=("${HVM}")
+if [ -n "${HVM_BASELINE}" ]; then
+  labels+=(baseline)
+  binaries+=("${HVM_BASELINE}")
+fi
+
+echo "Cores: $(getconf _NPROCESSORS_ONLN), TreeSum ${DEPTH}, ${CALLS} calls"
+printf "%-10s" "workers"
+for label in "${labels[@]}"; do
+  printf "%14s" "${label}"
+done
+echo
+
+for workers in "$@"; do
+  printf "%-10s" "${workers}"
+  for i in "${!labels[@]}"; do
+    bin="~fork_latency/${labels[$i]}.${workers}"
+    { generate "${binaries[$i]}" TreeSum && build fork_latency.c "${bin}" -DHVM_LIBRARY -DMAX_WORKERS="${workers}" -DHVM_PROGRAM="\"TreeSum/main.c\"" 2> /dev/null; } \
+      || { printf "%14s" "build failed"; continue; }
+    printf "%14s" "$(measure "${bin}")"
+  done
+  echo
+done
@@ -0,0 +1,51 @@
+// Measures the throughput of many small calls to a compiled program, with its
+// worker threads spawned and joined by each call, as ffi_normal() does, and
+// kept alive between calls by the library API. Built by library.sh, which
+// includes a program compiled with -DHVM_LIBRARY, whose Main takes a number.
+
+#include HVM_PROGRAM
+
+u64 now_usec(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (u64)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+void report(const char* label, u64 calls, u64 usec, u64 result) {
+  fprintf(stdout, "%-6s %10.0f calls/s %10.2fus/call (result: %"PRIu64")\n", label, (double)calls * 1000000 / (double)usec, (double)usec / (double)calls, result);
+}
+
+int main(int argc, char* argv[]) {
+  u64 calls = argc > 1 ? strtoull(argv[1], 0, 10) : 10000;
+  u32 arg = argc > 2 ? (u32)strtoul(argv[2], 0, 10) : 8;
+
+  // Spawns and joins the threads on every call
+  u64 result = 0;
+  u64 start = now_usec();
+  heap_alloc();
+  for (u64 i = 0; i < calls; ++i) {
+    heap_used = 0;
+    u64 host = heap_take(2);
+    heap_node[host + 0] = Cal(1, _MAIN_, host + 1);
+    heap_node[host + 1] = U_32(arg);
+    ffi_normal((u8*)heap_node, heap_used, host);
+    result = get_val(heap_node[host]);
+  }
+  heap_free();
+  report("spawn", calls, now_usec() - start, result);
+
+  // Starts the runtime once
+  start = now_usec();
+  hvm_init();
+  u64 main_id = hvm_id("Main");
+  for (u64 i = 0; i < calls; ++i) {
+    Lnk args[1] = {hvm_u32(arg)};
+    u64 host = hvm_normal(hvm_call(main_id, 1, args));
+    result = get_val(hvm_get(host));
+    hvm_reset();
+  }
+  hvm_free();
+  report("pool", calls, now_usec() - start, result);
+
+  return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# Measures the throughput of many small calls to a program built as a library
+# (see `-DHVM_LIBRARY` in the runtime), with threads spawned by each call, as
+# before, and with a worker pool started once.
+#
+# Usage: ./library.sh [program:arg] [calls] [workers ...]
+
+cd "$(dirname "$0")" || exit 1
+. ./common.sh
+
+SPEC="${1:-TreeSum:8}"
+CALLS="${2:-10000}"
+shift $(( $# < 2 ? $# : 2 ))
+if [ "$#" -eq 0 ]; then
+  set -- 1 4 16
+fi
+
+program="${SPEC%%:*}"
+arg="${SPEC#*:}"
+
+mkdir -p "~library"
+generate "${HVM}" "${program}" || exit 1
+
+echo "Cores: $(getconf _NPROCESSORS_ONLN), ${program} ${arg}, ${CALLS} calls"
+for workers in "$@"; do
+  bin="~library/${program}.${workers}"
+  build library.c "${bin}" -DHVM_LIBRARY -DMAX_WORKERS="${workers}" -DHVM_PROGRAM="\"${program}/main.c\"" || continue
+  echo "-- ${workers} workers"
+  "${bin}" "${CALLS}" "${arg}"
+done
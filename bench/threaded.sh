@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Compares the two ways reduce() dispatches on the phase and tag of a term: a
+# jump table of label addresses (the default with GCC and Clang) and a plain
+# switch (`-DNO_REDUCE_THREADED`). Reports the best rewrite throughput of a few
+# runs and, when `perf` is available, the branch misses and instructions of
+# one run.
+#
+# Usage: ./threaded.sh [program:arg ...]
+
+cd "$(dirname "$0")" || exit 1
+. ./common.sh
+
+if [ "$#" -eq 0 ]; then
+  set -- TreeSum:20 QuickSort:8 ListFold:4 RedBlack:10 LambdaArithmetic:20 Fibonacci:30
+fi
+
+mkdir -p "~threaded"
+
+# Prints the branch misses and instructions of one run, or "- -" without perf
+counters() {
+  local bin="$1" arg="$2"
+  if command -v perf > /dev/null; then
+    perf stat -x, -e branch-misses,instructions "${bin}" "${arg}" 2>&1 > /dev/null \
+      | awk -F, '/branch-misses/ { m = $1 } /instructions/ { i = $1 } END { print m, i }'
+  else
+    echo "- -"
+  fi
+}
+
+printf "%-24s%-10s%12s%16s%16s\n" "program" "dispatch" "MR/s" "branch-misses" "instructions"
+for spec in "$@"; do
+  program="${spec%%:*}"
+  arg="${spec#*:}"
+  generate "${HVM}" "${program}" || continue
+  for label in threaded switch; do
+    flags=""
+    [ "${label}" == "switch" ] && flags="-DNO_REDUCE_THREADED"
+    bin="~threaded/${label}.${program}"
+    build "${program}/main.c" "${bin}" ${flags} || continue
+    read -r misses instructions <<< "$(counters "${bin}" "${arg}")"
+    printf "%-24s%-10s%12s%16s%16s\n" "${program} ${arg}" "${label}" "$(rewrites "${bin}" "${arg}")" "${misses}" "${instructions}"
+  done
+done
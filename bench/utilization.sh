@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Measures how busy the cores stay while the compiled runtime normalizes
+# unbalanced programs. Utilization is CPU time over wall time times cores.
+#
+# Usage: ./utilization.sh [program:arg ...]
+#
+# Set HVM_BASELINE to another `hvm` binary (for example, one built from a
+# revision with the old fork/join split) to compare both side by side.
+
+cd "$(dirname "$0")" || exit 1
+RUNS="${RUNS:-3}"
+. ./common.sh
+
+CORES="$(getconf _NPROCESSORS_ONLN)"
+
+if [ "$#" -eq 0 ]; then
+  set -- QuickSort:4 QuickSort:8 RedBlack:10 RedBlack:20
+fi
+
+mkdir -p "~utilization"
+
+# Prints "wall_seconds utilization" for the best of RUNS runs
+measure() {
+  local bin="$1" arg="$2" best=
+  for _ in $(seq "${RUNS}"); do
+    local times
+    times="$( { TIMEFORMAT='%R %U %S'; time "${bin}" "${arg}" > /dev/null 2>&1; } 2>&1 )"
+    best="$(printf "%s\n%s\n" "${best}" "${times}" | awk 'NF == 3' | sort -n | head -n 1)"
+  done
+  echo "${best}" | awk -v cores="${CORES}" '{ printf "%8.3fs %6.1f%%\n", $1, 100 * ($2 + $3) / ($1 * cores) }'
+}
+
+labels=(current)
+binaries=("${HVM}")
+if [ -n "${HVM_BASELINE}" ]; then
+  labels+=(baseline)
+  binaries+=("${HVM_BASELINE}")
+fi
+
+echo "Cores: ${CORES}"
+printf "%-16s" "program"
+for label in "${labels[@]}"; do
+  printf "%20s" "${label} (wall, util)"
+done
+echo
+
+for spec in "$@"; do
+  program="${spec%%:*}"
+  arg="${spec#*:}"
+  printf "%-16s" "${program} ${arg}"
+  for i in "${!labels[@]}"; do
+    bin="~utilization/${labels[$i]}.${program}"
+    { generate "${binaries[$i]}" "${program}" && build "${program}/main.c" "${bin}"; } || { printf "%20s" "build failed"; continue; }
+    printf "%20s" "$(measure "${bin}" "${arg}")"
+  done
+  echo
+done
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Measures the cost of wide links (`hvm c --wide`): builds each program with
+# both layouts and reports the best rewrite throughput of a few runs. Both use
+# the same heap size, so only the encoding differs.
+#
+# Usage: ./wide.sh [program:arg ...]
+
+cd "$(dirname "$0")" || exit 1
+. ./common.sh
+
+HEAP="${HEAP:-8 * U64_PER_GB * sizeof(u64)}"
+
+if [ "$#" -eq 0 ]; then
+  set -- TreeSum:20 QuickSort:8 ListFold:4 RedBlack:10
+fi
+
+mkdir -p "~wide"
+
+printf "%-16s%12s%12s\n" "program" "narrow" "wide"
+for spec in "$@"; do
+  program="${spec%%:*}"
+  arg="${spec#*:}"
+  printf "%-16s" "${program} ${arg}"
+  for label in narrow wide; do
+    flags=""
+    [ "${label}" == "wide" ] && flags="--wide"
+    bin="~wide/${label}.${program}"
+    { generate "${HVM}" "${program}" ${flags} && build "${program}/main.c" "${bin}" -DHEAP_SIZE="(${HEAP})"; } || { printf "%12s" "failed"; continue; }
+    printf "%12s" "$(rewrites "${bin}" "${arg}")"
+  done
+  echo
+done
@@ -1,5 +1,5 @@
 // Moving Lambolt Terms to/from runtime, and building dynamic functions.
-// TODO: "dups" still needs to be moved out on alloc_body etc.
+// TODO: "dups" still needs to be moved out on build_body etc.
 
 use crate::language as lang;
 use crate::readback as rd;
@@ -18,6 +18,8 @@ pub enum DynTerm {
   Cal { func: u64, args: Vec<DynTerm> },
   Ctr { func: u64, args: Vec<DynTerm> },
   U32 { numb: u32 },
+  F32 { numb: f32 },
+  U60 { numb: u64 },
   Op2 { oper: u64, val0: Box<DynTerm>, val1: Box<DynTerm> },
 }
 
@@ -96,6 +98,14 @@ pub fn build_dynfun(
               *redex = true;
               cond.push(rt::U_32(*numb as u64));
             }
+            lang::Term::F32 { numb } => {
+              *redex = true;
+              cond.push(rt::F_32(*numb));
+            }
+            lang::Term::U60 { numb } => {
+              *redex = true;
+              cond.push(rt::U_60(*numb));
+            }
             lang::Term::Var { name } => {
               cond.push(0);
               vars.push(DynVar { param: i as u64, field: None, erase: name == "*" });
@@ -118,6 +128,103 @@ pub fn build_dynfun(
   DynFun { redex, rules: dynrules }
 }
 
+// A decision tree over the conditions of a function's rules, which are tested
+// in order. A `Test` reads an argument once, and branches on its constructor id
+// or number (kept as its whole link, as numbers are unboxed) to the rules that
+// accept it. The rules that accept anything there are also in `other`, which is
+// where every branch goes if it fails. Rules that appear in several branches
+// are emitted once, and jumped to, by the compiler.
+#[derive(Debug)]
+pub enum Match {
+  Rule(usize),
+  Fail,
+  Test { arg: u64, ctrs: Vec<(u64, Match)>, nums: Vec<(u64, Match)>, other: Box<Match> },
+}
+
+// Builds the decision tree of `rules` (indices on `conds`). `known` marks the
+// arguments whose conditions were already tested, on the way to this node.
+pub fn build_match(conds: &[Vec<rt::Lnk>], rules: &[usize], known: &mut Vec<bool>) -> Match {
+  let first = match rules.first() {
+    Some(first) => *first,
+    None => return Match::Fail,
+  };
+  // Tests the leftmost argument the first rule still needs
+  let arg = match (0..known.len()).find(|i| !known[*i] && conds[first][*i] != 0) {
+    Some(arg) => arg,
+    None => return Match::Rule(first),
+  };
+  let mut keys: Vec<rt::Lnk> = Vec::new();
+  for rule in rules {
+    let cond = conds[*rule][arg];
+    if cond != 0 && !keys.contains(&cond) {
+      keys.push(cond);
+    }
+  }
+  let mut ctrs = Vec::new();
+  let mut nums = Vec::new();
+  for key in keys {
+    let sub: Vec<usize> = rules
+      .iter()
+      .copied()
+      .filter(|rule| conds[*rule][arg] == key || conds[*rule][arg] == 0)
+      .collect();
+    known[arg] = true;
+    let tree = build_match(conds, &sub, known);
+    known[arg] = false;
+    if rt::get_tag(key) == rt::CTR {
+      ctrs.push((rt::get_ext(key), tree));
+    } else {
+      nums.push((key, tree));
+    }
+  }
+  let others: Vec<usize> = rules.iter().copied().filter(|rule| conds[*rule][arg] == 0).collect();
+  let other = Box::new(build_match(conds, &others, known));
+  Match::Test { arg: arg as u64, ctrs, nums, other }
+}
+
+// Marks the rules a decision tree can jump to. The others are shadowed by the
+// rules before them.
+pub fn match_reached(tree: &Match, reached: &mut Vec<bool>) {
+  match tree {
+    Match::Rule(rule) => {
+      reached[*rule] = true;
+    }
+    Match::Fail => {}
+    Match::Test { arg: _, ctrs, nums, other } => {
+      for (_, tree) in ctrs.iter().chain(nums.iter()) {
+        match_reached(tree, reached);
+      }
+      match_reached(other, reached);
+    }
+  }
+}
+
+// Walks a decision tree on the arguments of `term`, returning the rule to apply
+fn find_rule(mem: &rt::Worker, term: rt::Lnk, tree: &Match) -> Option<usize> {
+  let mut tree = tree;
+  loop {
+    match tree {
+      Match::Rule(rule) => return Some(*rule),
+      Match::Fail => return None,
+      Match::Test { arg, ctrs, nums, other } => {
+        let arg = rt::ask_arg(mem, term, *arg);
+        let case = if rt::get_tag(arg) == rt::CTR {
+          let ext = rt::get_ext(arg);
+          ctrs.iter().find(|(key, _)| *key == ext)
+        } else {
+          nums.iter().find(|(key, _)| *key == arg)
+        };
+        // A rule that matches `other` is also on every case, so, if a case
+        // fails, so does `other`
+        tree = match case {
+          Some((_, case)) => case,
+          None => other,
+        };
+      }
+    }
+  }
+}
+
 fn get_var(mem: &rt::Worker, term: rt::Lnk, var: &DynVar) -> rt::Lnk {
   let DynVar { param, field, erase: _ } = var;
   match field {
@@ -184,70 +291,64 @@ fn build_runtime_function(
     }
   }
 
+  // Lowers the rules: their conditions to a decision tree, and their bodies to
+  // codes, so that the rewriter does no work a rule doesn't need
+  let conds: Vec<Vec<rt::Lnk>> = dynfun.rules.iter().map(|rule| rule.cond.clone()).collect();
+  let tree = build_match(
+    &conds,
+    &(0..conds.len()).collect::<Vec<usize>>(),
+    &mut vec![false; dynfun.redex.len()],
+  );
+  let rules: Vec<DynCode> = dynfun
+    .rules
+    .into_iter()
+    .map(|rule| DynCode {
+      code: build_code(&rule.body, &rule.vars),
+      vars: rule.vars,
+      free: rule.free,
+    })
+    .collect();
+  let redex = stricts.clone();
+
   let rewriter: rt::Rewriter = Box::new(move |mem, host, term| {
-    // For each argument, if it is a redex and a PAR, apply the cal_par rule
-    for (i, redex) in dynfun.redex.iter().enumerate() {
-      let i = i as u64;
-      if *redex && rt::get_tag(rt::ask_arg(mem, term, i)) == rt::PAR {
-        rt::cal_par(mem, host, term, rt::ask_arg(mem, term, i), i);
+    // For each strict argument, if it is a PAR, apply the cal_par rule
+    for i in &redex {
+      let arg = rt::ask_arg(mem, term, *i);
+      if rt::get_tag(arg) == rt::PAR {
+        rt::cal_par(mem, host, term, arg, *i);
         return true;
       }
     }
 
-    // For each rule condition vector
-    for dynrule in &dynfun.rules {
-      // Check if the rule matches
-      let mut matched = true;
-
-      // Tests each rule condition (ex: `get_tag(args[0]) == SUCC`)
-      for (i, cond) in dynrule.cond.iter().enumerate() {
-        let i = i as u64;
-        match rt::get_tag(*cond) {
-          rt::U32 => {
-            //println!("Didn't match because of U32. i={} {} {}", i, rt::get_val(rt::ask_arg(mem, term, i)), rt::get_val(*cond));
-            let same_tag = rt::get_tag(rt::ask_arg(mem, term, i)) == rt::U32;
-            let same_val = rt::get_val(rt::ask_arg(mem, term, i)) == rt::get_val(*cond);
-            matched = matched && same_tag && same_val;
-          }
-          rt::CTR => {
-            //println!("Didn't match because of CTR. i={} {} {}", i, rt::get_tag(rt::ask_arg(mem, term, i)), rt::get_val(*cond));
-            let same_tag = rt::get_tag(rt::ask_arg(mem, term, i)) == rt::CTR;
-            let same_ext = rt::get_ext(rt::ask_arg(mem, term, i)) == rt::get_ext(*cond);
-            matched = matched && same_tag && same_ext;
-          }
-          _ => {}
-        }
-      }
-
-      // If all conditions are satisfied, the rule matched, so we must apply it
-      if matched {
-        // Increments the gas count
-        rt::inc_cost(mem);
+    // Finds the first rule whose conditions hold (ex: `args[0]` is a `SUCC`)
+    let rule = match find_rule(mem, term, &tree) {
+      Some(rule) => &rules[rule],
+      None => return false,
+    };
 
-        // Builds the right-hand side term (ex: `(Succ (Add a b))`)
-        let done = alloc_body(mem, term, &dynrule.body, &dynrule.vars);
+    // Increments the gas count
+    rt::inc_cost(mem);
 
-        // Links the host location to it
-        rt::link(mem, host, done);
+    // Builds the right-hand side term (ex: `(Succ (Add a b))`)
+    let done = run_code(mem, term, &rule.code, &rule.vars);
 
-        // Clears the matched ctrs (the `(Succ ...)` and the `(Add ...)` ctrs)
-        rt::clear(mem, rt::get_loc(term, 0), dynfun.redex.len() as u64);
-        for (i, arity) in &dynrule.free {
-          let i = *i as u64;
-          rt::clear(mem, rt::get_loc(rt::ask_arg(mem, term, i), 0), *arity);
-        }
+    // Links the host location to it
+    rt::link(mem, host, done);
 
-        // Collects unused variables (none in this example)
-        for dynvar @ DynVar { param: _, field: _, erase } in dynrule.vars.iter() {
-          if *erase {
-            rt::collect(mem, get_var(mem, term, dynvar));
-          }
-        }
-
-        return true;
+    // Collects unused variables (none in this example)
+    for dynvar @ DynVar { param: _, field: _, erase } in rule.vars.iter() {
+      if *erase {
+        rt::collect(mem, get_var(mem, term, dynvar));
       }
     }
-    false
+
+    // Clears the matched ctrs (the `(Succ ...)` and the `(Add ...)` ctrs)
+    for (i, arity) in &rule.free {
+      rt::clear(mem, rt::get_loc(rt::ask_arg(mem, term, *i), 0), *arity);
+    }
+    rt::clear(mem, rt::get_loc(term, 0), arity);
+
+    true
   });
 
   rt::Function { arity, stricts, rewriter }
@@ -333,6 +434,8 @@ fn term_to_dynterm(comp: &rb::RuleBook, term: &lang::Term, free_vars: u64) -> Dy
         }
       }
       lang::Term::U32 { numb } => DynTerm::U32 { numb: *numb },
+      lang::Term::F32 { numb } => DynTerm::F32 { numb: *numb },
+      lang::Term::U60 { numb } => DynTerm::U60 { numb: *numb },
       lang::Term::Op2 { oper, val0, val1 } => {
         let oper = convert_oper(oper);
         let val0 = Box::new(convert_term(val0, comp, depth + 0, vars));
@@ -439,6 +542,8 @@ fn build_body(dups_count: &mut DupsCount, term: &DynTerm, free_vars: u64) -> Bod
         }
       }
       DynTerm::U32 { numb } => Elem::Fix { value: rt::U_32(*numb as u64) },
+      DynTerm::F32 { numb } => Elem::Fix { value: rt::F_32(*numb) },
+      DynTerm::U60 { numb } => Elem::Fix { value: rt::U_60(*numb) },
       DynTerm::Op2 { oper, val0, val1 } => {
         let targ = nodes.len() as u64;
         nodes.push(vec![Elem::Fix { value: 0 }; 2]);
@@ -456,45 +561,107 @@ fn build_body(dups_count: &mut DupsCount, term: &DynTerm, free_vars: u64) -> Bod
   (elem, nodes)
 }
 
-static mut ALLOC_BODY_WORKSPACE: &mut [u64] = &mut [0; 256 * 256 * 256]; // to avoid dynamic allocations
-fn alloc_body(mem: &mut rt::Worker, term: rt::Lnk, body: &Body, vars: &[DynVar]) -> rt::Lnk {
-  unsafe {
-    let (elem, nodes) = body;
-    let hosts = &mut ALLOC_BODY_WORKSPACE;
-    nodes.iter().enumerate().for_each(|(i, node)| {
-      hosts[i] = rt::alloc(mem, node.len() as u64);
-    });
-    nodes.iter().enumerate().for_each(|(i, node)| {
-      let host = hosts[i] as usize;
-      node.iter().enumerate().for_each(|(j, elem)| match elem {
-        Elem::Fix { value } => {
-          mem.node[host + j] = *value;
-        }
-        Elem::Ext { index } => {
-          rt::link(mem, (host + j) as u64, get_var(mem, term, &vars[*index as usize]));
-        }
-        Elem::Loc { value, targ, slot } => {
-          mem.node[host + j] = value + hosts[*targ as usize] + slot;
+// The body of a rule, lowered to the instructions the interpreter runs on each
+// rewrite. Its nodes are allocated first, then each instruction fills one field
+// of one of them. A `Loc` has its slot already added to its value, and an `Arg`
+// or a `Field` reads the matched term directly, instead of going by a DynVar.
+#[derive(Debug)]
+pub enum Instr {
+  Fix { node: u64, slot: u64, value: u64 },
+  Loc { node: u64, slot: u64, value: u64, targ: u64 },
+  Arg { node: u64, slot: u64, param: u64 },
+  Field { node: u64, slot: u64, param: u64, field: u64 },
+}
+
+#[derive(Debug)]
+pub struct Code {
+  pub sizes: Vec<u64>,    // The size of each node
+  pub instrs: Vec<Instr>, // The instructions that fill them
+  pub done: Elem,         // The link to the body's root
+}
+
+// A rule, as the interpreter's rewriters apply it
+struct DynCode {
+  code: Code,
+  vars: Vec<DynVar>,
+  free: Vec<(u64, u64)>,
+}
+
+fn build_code(body: &Body, vars: &[DynVar]) -> Code {
+  let (done, nodes) = body;
+  let sizes = nodes.iter().map(|node| node.len() as u64).collect();
+  let mut instrs = Vec::new();
+  for (node, elems) in nodes.iter().enumerate() {
+    let node = node as u64;
+    for (slot, elem) in elems.iter().enumerate() {
+      let slot = slot as u64;
+      instrs.push(match *elem {
+        Elem::Fix { value } => Instr::Fix { node, slot, value },
+        Elem::Loc { value, targ, slot: targ_slot } => {
+          Instr::Loc { node, slot, value: value + targ_slot, targ }
         }
+        Elem::Ext { index } => match vars[index as usize] {
+          DynVar { param, field: Some(field), erase: _ } => {
+            Instr::Field { node, slot, param, field }
+          }
+          DynVar { param, field: None, erase: _ } => Instr::Arg { node, slot, param },
+        },
       });
-    });
-    match elem {
-      Elem::Fix { value } => *value,
-      Elem::Ext { index } => get_var(mem, term, &vars[*index as usize]),
-      Elem::Loc { value, targ, slot } => value + hosts[*targ as usize] + slot,
     }
   }
+  let done = match *done {
+    Elem::Loc { value, targ, slot } => Elem::Loc { value: value + slot, targ, slot: 0 },
+    done => done,
+  };
+  Code { sizes, instrs, done }
+}
+
+// Runs the code of a body, whose variables are on `term`, and returns its root
+fn run_code(mem: &mut rt::Worker, term: rt::Lnk, code: &Code, vars: &[DynVar]) -> rt::Lnk {
+  // The hosts of the body's nodes go in the worker's scratch space, to avoid
+  // dynamic allocations
+  let mut hosts = std::mem::take(&mut mem.work);
+  if hosts.len() < code.sizes.len() {
+    hosts.resize(code.sizes.len(), 0);
+  }
+  for (host, size) in hosts.iter_mut().zip(code.sizes.iter()) {
+    *host = rt::alloc(mem, *size);
+  }
+  for instr in &code.instrs {
+    match *instr {
+      Instr::Fix { node, slot, value } => {
+        rt::put_lnk(mem, hosts[node as usize] + slot, value);
+      }
+      Instr::Loc { node, slot, value, targ } => {
+        rt::put_lnk(mem, hosts[node as usize] + slot, value + hosts[targ as usize]);
+      }
+      Instr::Arg { node, slot, param } => {
+        rt::link(mem, hosts[node as usize] + slot, rt::ask_arg(mem, term, param));
+      }
+      Instr::Field { node, slot, param, field } => {
+        let arg = rt::ask_arg(mem, rt::ask_arg(mem, term, param), field);
+        rt::link(mem, hosts[node as usize] + slot, arg);
+      }
+    }
+  }
+  let done = match code.done {
+    Elem::Fix { value } => value,
+    Elem::Loc { value, targ, slot: _ } => value + hosts[targ as usize],
+    Elem::Ext { index } => get_var(mem, term, &vars[index as usize]),
+  };
+  mem.work = hosts;
+  done
 }
 
 fn alloc_closed_dynterm(dups_count: &mut DupsCount, mem: &mut rt::Worker, term: &DynTerm) -> u64 {
   let host = rt::alloc(mem, 1);
   let body = build_body(dups_count, term, 0);
-  let term = alloc_body(mem, 0, &body, &[]);
+  let term = run_code(mem, 0, &build_code(&body, &[]), &[]);
   rt::link(mem, host, term);
   host
 }
 
-fn alloc_term(
+pub fn alloc_term(
   dups_count: &mut DupsCount,
   mem: &mut rt::Worker,
   comp: &rb::RuleBook,
@@ -503,8 +670,13 @@ fn alloc_term(
   alloc_closed_dynterm(dups_count, mem, &term_to_dynterm(comp, term, 0))
 }
 
-// Evaluates a Lambolt term to normal form
-pub fn eval_code(call: &lang::Term, code: &str, debug: bool) -> (Box<lang::Term>, u64, u64, u64) {
+// Evaluates a Lambolt term to normal form, with `threads` workers
+pub fn eval_code(
+  call: &lang::Term,
+  code: &str,
+  debug: bool,
+  threads: usize,
+) -> (Box<lang::Term>, u64, u64, u64) {
   // Creates a new Runtime worker
   let mut worker = rt::new_worker();
 
@@ -522,7 +694,7 @@ pub fn eval_code(call: &lang::Term, code: &str, debug: bool) -> (Box<lang::Term>
 
   // Normalizes it
   let init = Instant::now();
-  rt::normal(&mut worker, host, &funs, Some(&book.id_to_name), debug);
+  rt::normal_par(&mut worker, host, &funs, threads, Some(&book.id_to_name), debug);
   let time = init.elapsed().as_millis() as u64;
 
   // Reads it back to a Lambolt string
@@ -8,8 +8,14 @@ use crate::language as lang;
 use crate::rulebook as rb;
 use crate::runtime as rt;
 
-pub fn compile_code_and_save(code: &str, file_name: &str, parallel: bool) -> std::io::Result<()> {
-  let as_clang = compile_code(code, parallel);
+pub fn compile_code_and_save(
+  code: &str,
+  file_name: &str,
+  parallel: bool,
+  wide: bool,
+  table: bool,
+) -> std::io::Result<()> {
+  let as_clang = compile_code(code, parallel, wide, table);
   let mut file = std::fs::OpenOptions::new()
     .read(true)
     .write(true)
@@ -20,11 +26,11 @@ pub fn compile_code_and_save(code: &str, file_name: &str, parallel: bool) -> std
   Ok(())
 }
 
-fn compile_code(code: &str, parallel: bool) -> String {
+fn compile_code(code: &str, parallel: bool, wide: bool, table: bool) -> String {
   let file = lang::read_file(code);
   let book = rb::gen_rulebook(&file);
   let (_, mut dups_count) = bd::build_runtime_functions(&book);
-  compile_book(&mut dups_count, &book, parallel)
+  compile_book(&mut dups_count, &book, parallel, wide, table)
 }
 
 fn compile_name(name: &str) -> String {
@@ -36,17 +42,34 @@ fn compile_name(name: &str) -> String {
   format!("_{}_", name.to_uppercase())
 }
 
-fn compile_book(dups_count: &mut bd::DupsCount, comp: &rb::RuleBook, parallel: bool) -> String {
+pub fn compile_book(
+  dups_count: &mut bd::DupsCount,
+  comp: &rb::RuleBook,
+  parallel: bool,
+  wide: bool,
+  table: bool,
+) -> String {
   let mut dups = 0;
   let mut c_ids = String::new();
   let mut inits = String::new();
   let mut codes = String::new();
+  let mut funcs = String::new();
+  let mut init_table = String::new();
+  let mut rules_table = String::new();
   let mut id2nm = String::new();
-  for (id, name) in &comp.id_to_name {
+  let mut id2ar = String::new();
+  // Goes by id and by name, so that a program always compiles to the same C
+  let mut names: Vec<(&u64, &String)> = comp.id_to_name.iter().collect();
+  names.sort();
+  for (id, name) in names {
     line(&mut id2nm, 1, &format!(r#"id_to_name_data[{}] = "{}";"#, id, name));
+    line(&mut id2ar, 1, &compile_arity(comp, *id, name));
   }
-  for (name, (_arity, rules)) in &comp.func_rules {
-    let (init, code) = compile_func(dups_count, comp, rules, 7, &mut dups);
+  let mut func_rules: Vec<_> = comp.func_rules.iter().collect();
+  func_rules.sort_by(|a, b| a.0.cmp(b.0));
+  for (name, (_arity, rules)) in func_rules {
+    let tab = if table { 1 } else { 6 };
+    let (init, code) = compile_func(dups_count, comp, name, rules, tab, table, &mut dups);
 
     line(
       &mut c_ids,
@@ -54,28 +77,202 @@ fn compile_book(dups_count: &mut bd::DupsCount, comp: &rb::RuleBook, parallel: b
       &format!("#define {} ({})", &compile_name(name), comp.name_to_id.get(name).unwrap_or(&0)),
     );
 
-    line(&mut inits, 6, &format!("case {}: {{", &compile_name(name)));
-    inits.push_str(&init);
-    line(&mut inits, 6, "};");
+    if table {
+      // Each step of the function's rules becomes a C function of its own
+      compile_table_func(&mut funcs, name, Some((&init, &code)));
+      compile_table_entries(&mut init_table, &mut rules_table, name);
+    } else {
+      line(&mut inits, 5, &format!("case {}: {{", &compile_name(name)));
+      inits.push_str(&init);
+      line(&mut inits, 5, "};");
+
+      line(&mut codes, 5, &format!("case {}: {{", &compile_name(name)));
+      codes.push_str(&code);
+      line(&mut codes, 6, "break;");
+      line(&mut codes, 5, "};");
+    }
+  }
+
+  // Tables of the functions above, by function id
+  if table {
+    compile_tables(&mut funcs, comp, &init_table, &rules_table);
+  }
+
+  // Wide links only have 16 bits for dup colors
+  if wide && dups > 0x10000 {
+    panic!("Too many dups ({}) for --wide, which supports up to 65536.", dups);
+  }
+
+  c_runtime_template(
+    &c_ids,
+    &inits,
+    &codes,
+    &funcs,
+    &id2nm,
+    &id2ar,
+    comp.id_to_name.len() as u64,
+    rb::fingerprint(comp),
+    parallel,
+    wide,
+    table,
+  )
+}
+
+// The entry of a name in the table of arities, which inputs are checked against
+fn compile_arity(comp: &rb::RuleBook, id: u64, name: &str) -> String {
+  match comp.ctr_arity.get(name) {
+    Some(Some(arity)) => format!("[{}] = {},", id, arity),
+    _ => format!("[{}] = ARITY_ANY,", id),
+  }
+}
+
+// The C functions of a function's rules, with `--fn-table`. Without a body,
+// only their prototypes.
+fn compile_table_func(funcs: &mut String, name: &str, body: Option<(&str, &str)>) {
+  let func = compile_name(name).to_lowercase();
+  let args = "Worker* mem, Stk* stack, u64 base, u64 slen, u64 host, u64 init, Lnk term";
+  if let Some((init, code)) = body {
+    line(funcs, 0, &format!("u64 {}init({}) {{", func, args));
+    funcs.push_str(init);
+    line(funcs, 1, "return REDUCE_STOP;");
+    line(funcs, 0, "}");
+    line(funcs, 0, "");
+    line(funcs, 0, &format!("u64 {}rules({}) {{", func, args));
+    funcs.push_str(code);
+    line(funcs, 1, "return REDUCE_STOP;");
+    line(funcs, 0, "}");
+    line(funcs, 0, "");
+  } else {
+    line(funcs, 0, &format!("u64 {}init({});", func, args));
+    line(funcs, 0, &format!("u64 {}rules({});", func, args));
+  }
+}
+
+fn compile_table_entries(init_table: &mut String, rules_table: &mut String, name: &str) {
+  let func = compile_name(name).to_lowercase();
+  line(init_table, 1, &format!("[{}] = {}init,", compile_name(name), func));
+  line(rules_table, 1, &format!("[{}] = {}rules,", compile_name(name), func));
+}
+
+fn compile_tables(funcs: &mut String, comp: &rb::RuleBook, init_table: &str, rules_table: &str) {
+  line(funcs, 0, &format!("#define FN_TABLE_SIZE ({})", comp.id_to_name.len()));
+  line(funcs, 0, "Rules fn_table_init[FN_TABLE_SIZE] = {");
+  funcs.push_str(init_table);
+  line(funcs, 0, "};");
+  line(funcs, 0, "Rules fn_table_rules[FN_TABLE_SIZE] = {");
+  funcs.push_str(rules_table);
+  line(funcs, 0, "};");
+}
+
+// A program compiled to separate C files: the runtime, with reduce() and the
+// tables of the rule functions, and a unit per function, with its rules. Built
+// apart and linked together, they make the same program as `hvm c --fn-table`,
+// but a change to a function only changes its own unit (and, if it adds names
+// or functions, the runtime), so the rest can be reused from a previous build.
+pub struct Split {
+  pub runtime: String,
+  pub units: Vec<String>,
+}
+
+pub fn compile_split(
+  dups_count: &mut bd::DupsCount,
+  comp: &rb::RuleBook,
+  parallel: bool,
+  wide: bool,
+) -> Split {
+  let mut dups = 0;
+  let mut c_ids = String::new();
+  let mut funcs = String::new();
+  let mut init_table = String::new();
+  let mut rules_table = String::new();
+  let mut id2nm = String::new();
+  let mut id2ar = String::new();
+  let mut names: Vec<(&u64, &String)> = comp.id_to_name.iter().collect();
+  names.sort();
+  let mut ids = std::collections::HashMap::new();
+  for (id, name) in names {
+    line(&mut id2nm, 1, &format!(r#"id_to_name_data[{}] = "{}";"#, id, name));
+    line(&mut id2ar, 1, &compile_arity(comp, *id, name));
+    ids.insert(compile_name(name), *id);
+  }
+
+  // A unit is the runtime up to GENERATED_UNIT_END, with only the ids its
+  // rules use, so that new names elsewhere don't change it
+  let prelude = c_runtime_template("", "", "", "", "", "", 0, 0, parallel, wide, true);
+  let prelude = &prelude[..prelude.find("//GENERATED_UNIT_END//").unwrap()];
+  let (head, tail) = prelude.split_at(prelude.find("//GENERATED_CONSTRUCTOR_IDS_END//").unwrap());
+  let name_re = Regex::new(r"_[A-Z0-9_]*[A-Z0-9]_").unwrap();
+
+  let mut units = Vec::new();
+  let mut func_rules: Vec<_> = comp.func_rules.iter().collect();
+  func_rules.sort_by(|a, b| a.0.cmp(b.0));
+  for (name, (_arity, rules)) in func_rules {
+    let (init, code) = compile_func(dups_count, comp, name, rules, 1, true, &mut dups);
+    line(
+      &mut c_ids,
+      0,
+      &format!("#define {} ({})", &compile_name(name), comp.name_to_id.get(name).unwrap_or(&0)),
+    );
+    compile_table_func(&mut funcs, name, None);
+    compile_table_entries(&mut init_table, &mut rules_table, name);
+
+    let mut body = String::new();
+    compile_table_func(&mut body, name, Some((&init, &code)));
+    let mut used: Vec<&str> = name_re.find_iter(&body).map(|m| m.as_str()).collect();
+    used.sort_unstable();
+    used.dedup();
+    let mut unit = format!("#define HVM_UNIT\n{}", head);
+    for used in used {
+      if let Some(id) = ids.get(used) {
+        line(&mut unit, 0, &format!("#define {} ({})", used, id));
+      }
+    }
+    unit.push_str(tail);
+    unit.push_str("\n");
+    unit.push_str(&body);
+    units.push(unit);
+  }
+  compile_tables(&mut funcs, comp, &init_table, &rules_table);
 
-    line(&mut codes, 6, &format!("case {}: {{", &compile_name(name)));
-    codes.push_str(&code);
-    line(&mut codes, 7, "break;");
-    line(&mut codes, 6, "};");
+  if wide && dups > 0x10000 {
+    panic!("Too many dups ({}) for --wide, which supports up to 65536.", dups);
   }
 
-  c_runtime_template(&c_ids, &inits, &codes, &id2nm, comp.id_to_name.len() as u64, parallel)
+  // Split builds are libraries, which have no main() to save or load snapshots,
+  // so the runtime goes without the fingerprint, which any edit would change
+  let runtime = c_runtime_template(
+    &c_ids,
+    "",
+    "",
+    &funcs,
+    &id2nm,
+    &id2ar,
+    comp.id_to_name.len() as u64,
+    0,
+    parallel,
+    wide,
+    true,
+  );
+  Split { runtime, units }
 }
 
 fn compile_func(
   dups_count: &mut bd::DupsCount,
   comp: &rb::RuleBook,
+  name: &str,
   rules: &[lang::Rule],
   tab: u64,
+  table: bool,
   dups: &mut u64,
 ) -> (String, String) {
   let dynfun = bd::build_dynfun(dups_count, comp, rules);
 
+  // Inlined in reduce(), the code goes on reducing with `continue`. In its own
+  // function, it returns the next host and init flag instead, packed as in the
+  // reduction stack.
+  let next = if table { "return (init << 63) | host;" } else { "continue;" };
+  let stop = if table { "return REDUCE_STOP;" } else { "break;" };
+
   let mut init = String::new();
   let mut code = String::new();
 
@@ -94,60 +291,78 @@ fn compile_func(
   if stricts.is_empty() {
     line(&mut init, tab + 1, "init = 0;");
   } else {
-    line(&mut init, tab + 1, "stk_push(&stack, host);");
+    // With split budget left, strict arguments are reduced in parallel
+    if stricts.len() >= 2 {
+      let args = stricts.iter().map(|s| s.to_string()).collect::<Vec<String>>().join(", ");
+      line(&mut init, tab + 1, "if (slen > 1 && stack->size == base) {");
+      line(&mut init, tab + 2, &format!("u64 args[] = {{{}}};", args));
+      line(
+        &mut init,
+        tab + 2,
+        &format!("reduce_strict(mem, term, args, {}, slen);", stricts.len()),
+      );
+      line(&mut init, tab + 2, "init = 0;");
+      line(&mut init, tab + 2, next);
+      line(&mut init, tab + 1, "}");
+    }
+    line(&mut init, tab + 1, "reduce_push(stack, host);");
     for (i, strict) in stricts.iter().enumerate() {
       if i < stricts.len() - 1 {
         line(
           &mut init,
           tab + 1,
-          &format!("stk_push(&stack, get_loc(term, {}) | 0x80000000);", strict),
+          &format!("reduce_push(stack, get_loc(term, {}) | REDUCE_INIT);", strict),
         );
       } else {
         line(&mut init, tab + 1, &format!("host = get_loc(term, {});", strict));
       }
     }
   }
-  line(&mut init, tab + 1, "continue;");
+  line(&mut init, tab + 1, next);
   line(&mut init, tab + 0, "}");
 
+  // Loads each strict arg once, for the tests below
+  for (i, is_redex) in dynfun.redex.iter().enumerate() {
+    if *is_redex {
+      line(&mut code, tab + 0, &format!("u64 arg_{} = ask_arg(mem, term, {});", i, i));
+    }
+  }
+
   // Applies the cal_par rule to superposed args
   for (i, is_redex) in dynfun.redex.iter().enumerate() {
     if *is_redex {
-      line(&mut code, tab + 0, &format!("if (get_tag(ask_arg(mem,term,{})) == PAR) {{", i));
-      line(
-        &mut code,
-        tab + 1,
-        &format!("cal_par(mem, host, term, ask_arg(mem, term, {}), {});", i, i),
-      );
-      line(&mut code, tab + 1, "continue;");
+      line(&mut code, tab + 0, &format!("if (get_tag(arg_{}) == PAR) {{", i));
+      line(&mut code, tab + 1, &format!("cal_par(mem, host, term, arg_{}, {});", i, i));
+      line(&mut code, tab + 1, next);
       line(&mut code, tab + 0, "}");
     }
   }
 
-  // For each rule condition vector
-  for dynrule in &dynfun.rules {
-    let mut matched: Vec<String> = Vec::new();
-
-    // Tests each rule condition (ex: `get_tag(args[0]) == SUCC`)
-    for (i, cond) in dynrule.cond.iter().enumerate() {
-      let i = i as u64;
-      if rt::get_tag(*cond) == rt::U32 {
-        let same_tag = format!("get_tag(ask_arg(mem, term, {})) == U32", i);
-        let same_val = format!("get_val(ask_arg(mem, term, {})) == {}u", i, rt::get_val(*cond));
-        matched.push(format!("({} && {})", same_tag, same_val));
-      }
-      if rt::get_tag(*cond) == rt::CTR {
-        let some_tag = format!("get_tag(ask_arg(mem, term, {})) == CTR", i);
-        let some_ext = format!("get_ext(ask_arg(mem, term, {})) == {}u", i, rt::get_ext(*cond));
-        matched.push(format!("({} && {})", some_tag, some_ext));
-      }
-    }
+  // Jumps to the first rule whose conditions hold (ex: `args[0]` is a `SUCC`),
+  // or leaves the term as is, if none does
+  let conds: Vec<Vec<rt::Lnk>> = dynfun.rules.iter().map(|rule| rule.cond.clone()).collect();
+  let labels: Vec<String> =
+    (0..conds.len()).map(|i| format!("{}rule_{}", compile_name(name).to_lowercase(), i)).collect();
+  let tree = bd::build_match(
+    &conds,
+    &(0..conds.len()).collect::<Vec<usize>>(),
+    &mut vec![false; dynfun.redex.len()],
+  );
+  if !compile_match(&mut code, tab, &tree, &labels) {
+    line(&mut code, tab + 0, stop);
+  }
+  let mut reached = vec![false; conds.len()];
+  bd::match_reached(&tree, &mut reached);
 
-    let conds = if matched.is_empty() { String::from("1") } else { matched.join(" && ") };
-    line(&mut code, tab + 0, &format!("if ({}) {{", conds));
+  // For each rule that can match
+  for (i, (dynrule, label)) in dynfun.rules.iter().zip(labels.iter()).enumerate() {
+    if !reached[i] {
+      continue;
+    }
+    line(&mut code, tab + 0, &format!("{}: {{", label));
 
     // Increments the gas count
-    line(&mut code, tab + 1, "inc_cost(mem);");
+    line(&mut code, tab + 1, &format!("inc_rule(mem, {}, {});", compile_name(name), i));
 
     // Builds the right-hand side term (ex: `(Succ (Add a b))`)
     //let done = compile_func_rule_body(&mut code, tab + 1, &dynrule.body, &dynrule.vars);
@@ -155,10 +370,17 @@ fn compile_func(
     line(&mut code, tab + 1, &format!("u64 done = {};", done));
 
     // Links the host location to it
-    line(&mut code, tab + 1, "link(mem, host, done);");
+    line(&mut code, tab + 1, "link_lnk(mem, host, done);");
 
-    // Clears the matched ctrs (the `(Succ ...)` and the `(Add ...)` ctrs)
-    line(&mut code, tab + 1, &format!("clear(mem, get_loc(term, 0), {});", dynfun.redex.len()));
+    // Collects unused variables (none in this example)
+    for dynvar @ bd::DynVar { param: _, field: _, erase } in dynrule.vars.iter() {
+      if *erase {
+        line(&mut code, tab + 1, &format!("collect(mem, {});", get_var(dynvar)));
+      }
+    }
+
+    // Clears the matched ctrs (the `(Succ ...)` and the `(Add ...)` ctrs). This
+    // comes last, since clear() reuses the freed nodes to store the free lists.
     for (i, arity) in &dynrule.free {
       let i = *i as u64;
       line(
@@ -167,16 +389,10 @@ fn compile_func(
         &format!("clear(mem, get_loc(ask_arg(mem, term, {}), 0), {});", i, arity),
       );
     }
-
-    // Collects unused variables (none in this example)
-    for dynvar @ bd::DynVar { param: _, field: _, erase } in dynrule.vars.iter() {
-      if *erase {
-        line(&mut code, tab + 1, &format!("collect(mem, {});", get_var(dynvar)));
-      }
-    }
+    line(&mut code, tab + 1, &format!("clear(mem, get_loc(term, 0), {});", dynfun.redex.len()));
 
     line(&mut code, tab + 1, "init = 1;");
-    line(&mut code, tab + 1, "continue;");
+    line(&mut code, tab + 1, next);
 
     line(&mut code, tab + 0, "}");
   }
@@ -184,6 +400,60 @@ fn compile_func(
   (init, code)
 }
 
+// Emits a decision tree, as nested switches on the `arg_N` loaded by
+// compile_func, jumping to the rule labels. Returns true if it always jumps.
+fn compile_match(code: &mut String, tab: u64, tree: &bd::Match, labels: &[String]) -> bool {
+  match tree {
+    bd::Match::Rule(rule) => {
+      line(code, tab, &format!("goto {};", labels[*rule]));
+      true
+    }
+    bd::Match::Fail => false,
+    bd::Match::Test { arg, ctrs, nums, other } => {
+      let mut groups =
+        vec![("CTR", "get_ext", ctrs.iter().map(|(key, tree)| (*key, tree)).collect())];
+      // A U32 or an F32 is in the link's val, while a U60 needs its whole 60 bits
+      let kinds =
+        [(rt::U32, "U32", "get_val"), (rt::F32, "F32", "get_val"), (rt::U60, "U60", "get_num")];
+      for (tag, name, get) in kinds {
+        let cases: Vec<(u64, &bd::Match)> = nums
+          .iter()
+          .filter(|(key, _)| rt::get_tag(*key) == tag)
+          .map(|(key, tree)| {
+            (if tag == rt::U60 { rt::get_num(*key) } else { rt::get_val(*key) }, tree)
+          })
+          .collect();
+        groups.push((name, get, cases));
+      }
+      let mut first = true;
+      for (tag, get, cases) in groups.iter().filter(|(_, _, cases)| !cases.is_empty()) {
+        let sufx = if *get == "get_num" { "ull" } else { "u" };
+        let cond = format!("get_tag(arg_{}) == {}", arg, tag);
+        line(code, tab, &format!("{}if ({}) {{", if first { "" } else { "} else " }, cond));
+        first = false;
+        if cases.len() == 1 {
+          let (key, tree) = &cases[0];
+          line(code, tab + 1, &format!("if ({}(arg_{}) == {}{}) {{", get, arg, key, sufx));
+          compile_match(code, tab + 2, tree, labels);
+          line(code, tab + 1, "}");
+        } else {
+          line(code, tab + 1, &format!("switch ({}(arg_{})) {{", get, arg));
+          for (key, tree) in cases.iter() {
+            line(code, tab + 2, &format!("case {}{}: {{", key, sufx));
+            if !compile_match(code, tab + 3, tree, labels) {
+              line(code, tab + 3, "break;");
+            }
+            line(code, tab + 2, "}");
+          }
+          line(code, tab + 1, "}");
+        }
+      }
+      line(code, tab, "}");
+      compile_match(code, tab, other, labels)
+    }
+  }
+}
+
 fn compile_func_rule_term(
   code: &mut String,
   tab: u64,
@@ -223,8 +493,8 @@ fn compile_func_rule_term(
         line(code, tab, &format!("u64 {};", dup0));
         line(code, tab, &format!("u64 {};", dup1));
         if INLINE_NUMBERS {
-          line(code, tab + 0, &format!("if (get_tag({}) == U32) {{", copy));
-          line(code, tab + 1, "inc_cost(mem);");
+          line(code, tab + 0, &format!("if (is_num({})) {{", copy));
+          line(code, tab + 1, "inc_cost(mem, PROF_DUP_NUM);");
           line(code, tab + 1, &format!("{} = {};", dup0, copy));
           line(code, tab + 1, &format!("{} = {};", dup1, copy));
           line(code, tab + 0, "} else {");
@@ -236,12 +506,12 @@ fn compile_func_rule_term(
         line(code, tab + 1, &format!("u64 {} = alloc(mem, 3);", name));
         line(code, tab + 1, &format!("u64 {} = {};", coln, colx));
         if eras.0 {
-          line(code, tab + 1, &format!("link(mem, {} + 0, Era());", name));
+          line(code, tab + 1, &format!("link_lnk(mem, {} + 0, Era());", name));
         }
         if eras.1 {
-          line(code, tab + 1, &format!("link(mem, {} + 1, Era());", name));
+          line(code, tab + 1, &format!("link_lnk(mem, {} + 1, Era());", name));
         }
-        line(code, tab + 1, &format!("link(mem, {} + 2, {});", name, copy));
+        line(code, tab + 1, &format!("link_lnk(mem, {} + 2, {});", name, copy));
         line(code, tab + 1, &format!("{} = Dp0({}, {});", dup0, colx, name));
         line(code, tab + 1, &format!("{} = Dp1({}, {});", dup1, colx, name));
         if INLINE_NUMBERS {
@@ -268,9 +538,9 @@ fn compile_func_rule_term(
         let body = go(code, tab, body, vars, nams, dups);
         vars.pop();
         if *eras {
-          line(code, tab, &format!("link(mem, {} + 0, Era());", name));
+          line(code, tab, &format!("link_lnk(mem, {} + 0, Era());", name));
         }
-        line(code, tab, &format!("link(mem, {} + 1, {});", name, body));
+        line(code, tab, &format!("link_lnk(mem, {} + 1, {});", name, body));
         format!("Lam({})", name)
       }
       bd::DynTerm::App { func, argm } => {
@@ -278,8 +548,8 @@ fn compile_func_rule_term(
         let func = go(code, tab, func, vars, nams, dups);
         let argm = go(code, tab, argm, vars, nams, dups);
         line(code, tab, &format!("u64 {} = alloc(mem, 2);", name));
-        line(code, tab, &format!("link(mem, {} + 0, {});", name, func));
-        line(code, tab, &format!("link(mem, {} + 1, {});", name, argm));
+        line(code, tab, &format!("link_lnk(mem, {} + 0, {});", name, func));
+        line(code, tab, &format!("link_lnk(mem, {} + 1, {});", name, argm));
         format!("App({})", name)
       }
       bd::DynTerm::Ctr { func, args } => {
@@ -288,7 +558,7 @@ fn compile_func_rule_term(
         let name = fresh(nams, "ctr");
         line(code, tab, &format!("u64 {} = alloc(mem, {});", name, ctr_args.len()));
         for (i, arg) in ctr_args.iter().enumerate() {
-          line(code, tab, &format!("link(mem, {} + {}, {});", name, i, arg));
+          line(code, tab, &format!("link_lnk(mem, {} + {}, {});", name, i, arg));
         }
         format!("Ctr({}, {}, {})", ctr_args.len(), func, name)
       }
@@ -298,16 +568,23 @@ fn compile_func_rule_term(
         let name = fresh(nams, "cal");
         line(code, tab, &format!("u64 {} = alloc(mem, {});", name, cal_args.len()));
         for (i, arg) in cal_args.iter().enumerate() {
-          line(code, tab, &format!("link(mem, {} + {}, {});", name, i, arg));
+          line(code, tab, &format!("link_lnk(mem, {} + {}, {});", name, i, arg));
         }
         format!("Cal({}, {}, {})", cal_args.len(), func, name)
       }
       bd::DynTerm::U32 { numb } => {
         format!("U_32({})", numb)
       }
+      bd::DynTerm::F32 { numb } => {
+        format!("F_32({:?}f)", numb)
+      }
+      bd::DynTerm::U60 { numb } => {
+        format!("U_60({}ull)", numb)
+      }
       bd::DynTerm::Op2 { oper, val0, val1 } => {
         let retx = fresh(nams, "ret");
         let name = fresh(nams, "op2");
+        let lits = [literal(val0), literal(val1)];
         let val0 = go(code, tab, val0, vars, nams, dups);
         let val1 = go(code, tab, val1, vars, nams, dups);
         line(code, tab + 0, &format!("u64 {};", retx));
@@ -339,12 +616,59 @@ fn compile_func_rule_term(
             rt::NEQ => line(code, tab + 1, &format!("{} = U_32({} != {} ? 1 : 0);", retx, a, b)),
             _ => line(code, tab + 1, &format!("{} = ?;", retx)),
           }
-          line(code, tab + 1, "inc_cost(mem);");
+          line(code, tab + 1, "inc_cost(mem, PROF_OP2_U32);");
+          // Two U60s or two F32s are also operated inline. Mixed operands are left
+          // to the OP2 rule: calling op2_num() here would slow down every rule. A
+          // branch that a literal operand can't take isn't emitted.
+          let symb = match *oper {
+            rt::ADD => "+",
+            rt::SUB => "-",
+            rt::MUL => "*",
+            rt::DIV => "/",
+            rt::MOD => "%",
+            rt::AND => "&",
+            rt::OR => "|",
+            rt::XOR => "^",
+            rt::SHL => "<<",
+            rt::SHR => ">>",
+            rt::LTN => "<",
+            rt::LTE => "<=",
+            rt::EQL => "==",
+            rt::GTE => ">=",
+            rt::GTN => ">",
+            rt::NEQ => "!=",
+            _ => "?",
+          };
+          let cmp = *oper >= rt::LTN;
+          let a = format!("get_num({})", val0);
+          let b = format!("get_num({})", val1);
+          let u60 = match *oper {
+            _ if cmp => format!("U_32({} {} {} ? 1 : 0)", a, symb, b),
+            rt::SHL | rt::SHR => format!("U_60({} {} ({} & 63))", a, symb, b),
+            _ => format!("U_60({} {} {})", a, symb, b),
+          };
+          let a = format!("get_f32({})", val0);
+          let b = format!("get_f32({})", val1);
+          let f32 = match *oper {
+            _ if cmp => Some(format!("U_32({} {} {} ? 1 : 0)", a, symb, b)),
+            rt::ADD | rt::SUB | rt::MUL | rt::DIV => Some(format!("F_32({} {} {})", a, symb, b)),
+            rt::MOD => Some(format!("F_32(f32_mod({}, {}))", a, b)),
+            _ => None,
+          };
+          for (tag, done) in [("U60", Some(u60)), ("F32", f32)] {
+            let fits = lits.iter().all(|lit| lit.map_or(true, |lit| lit == tag));
+            if let (Some(done), true) = (done, fits) {
+              let cond = format!("get_tag({}) == {} && get_tag({}) == {}", val0, tag, val1, tag);
+              line(code, tab + 0, &format!("}} else if ({}) {{", cond));
+              line(code, tab + 1, &format!("{} = {};", retx, done));
+              line(code, tab + 1, "inc_cost(mem, PROF_OP2_NUM);");
+            }
+          }
           line(code, tab + 0, "} else {");
         }
         line(code, tab + 1, &format!("u64 {} = alloc(mem, 2);", name));
-        line(code, tab + 1, &format!("link(mem, {} + 0, {});", name, val0));
-        line(code, tab + 1, &format!("link(mem, {} + 1, {});", name, val1));
+        line(code, tab + 1, &format!("link_lnk(mem, {} + 0, {});", name, val0));
+        line(code, tab + 1, &format!("link_lnk(mem, {} + 1, {});", name, val1));
         let oper_name = match *oper {
           rt::ADD => "ADD",
           rt::SUB => "SUB",
@@ -372,6 +696,14 @@ fn compile_func_rule_term(
       }
     }
   }
+  fn literal(term: &bd::DynTerm) -> Option<&'static str> {
+    match term {
+      bd::DynTerm::U32 { .. } => Some("U32"),
+      bd::DynTerm::F32 { .. } => Some("F32"),
+      bd::DynTerm::U60 { .. } => Some("U60"),
+      _ => None,
+    }
+  }
   fn fresh(nams: &mut u64, name: &str) -> String {
     let name = format!("{}_{}", name, nams);
     *nams += 1;
@@ -418,7 +750,7 @@ fn compile_func_rule_body(
           line(
             code,
             tab + 0,
-            &format!("link(mem, loc_{} + {}, {});", i, j, get_var(&vars[*index as usize])),
+            &format!("link_lnk(mem, loc_{} + {}, {});", i, j, get_var(&vars[*index as usize])),
           );
           //line(code, tab + 0, &format!("u64 lnk = {};", get_var(&vars[*index as usize])));
           //line(code, tab + 0, &format!("u64 tag = get_tag(lnk);"));
@@ -476,24 +808,35 @@ fn line(code: &mut String, tab: u64, line: &str) {
 const REPLACEMENT_TOKEN_PATTERN: &str =
   r"(?s)(?:/\*! *(\w+?) *!\*/)|(?:/\*! *(\w+?) *\*/.+?/\* *(\w+?) *!\*/)";
 
+#[allow(clippy::too_many_arguments)]
 fn c_runtime_template(
   c_ids: &str,
   inits: &str,
   codes: &str,
+  funcs: &str,
   id2nm: &str,
+  id2ar: &str,
   names_count: u64,
+  book_hash: u64,
   parallel: bool,
+  wide: bool,
+  table: bool,
 ) -> String {
   const C_RUNTIME_TEMPLATE: &str = include_str!("runtime.c");
   // Instantiate the template with the given sections' content
 
   const C_PARALLEL_FLAG_TAG: &str = "GENERATED_PARALLEL_FLAG";
+  const C_WIDE_FLAG_TAG: &str = "GENERATED_WIDE_FLAG";
+  const C_TABLE_FLAG_TAG: &str = "GENERATED_TABLE_FLAG";
   const C_NUM_THREADS_TAG: &str = "GENERATED_NUM_THREADS";
   const C_CONSTRUCTOR_IDS_TAG: &str = "GENERATED_CONSTRUCTOR_IDS";
   const C_REWRITE_RULES_STEP_0_TAG: &str = "GENERATED_REWRITE_RULES_STEP_0";
   const C_REWRITE_RULES_STEP_1_TAG: &str = "GENERATED_REWRITE_RULES_STEP_1";
+  const C_REWRITE_RULES_FUNCS_TAG: &str = "GENERATED_REWRITE_RULES_FUNCS";
   const C_NAME_COUNT_TAG: &str = "GENERATED_NAME_COUNT";
   const C_ID_TO_NAME_DATA_TAG: &str = "GENERATED_ID_TO_NAME_DATA";
+  const C_ID_TO_ARITY_DATA_TAG: &str = "GENERATED_ID_TO_ARITY_DATA";
+  const C_BOOK_HASH_TAG: &str = "GENERATED_BOOK_HASH";
 
   // TODO: Sanity checks: all tokens we're looking for must be present in the
   // `runtime.c` file.
@@ -517,16 +860,24 @@ fn c_runtime_template(
     };
 
     let parallel_flag = if parallel { "#define PARALLEL" } else { "" };
+    let wide_flag = if wide { "#define WIDE_LNK" } else { "" };
+    let table_flag = if table { "#define FN_TABLE" } else { "" };
     let num_threads = &num_cpus::get().to_string();
     let names_count = &names_count.to_string();
+    let book_hash = &format!("0x{:016x}", book_hash);
     match tag {
       C_PARALLEL_FLAG_TAG => parallel_flag,
+      C_WIDE_FLAG_TAG => wide_flag,
+      C_TABLE_FLAG_TAG => table_flag,
       C_NUM_THREADS_TAG => num_threads,
       C_CONSTRUCTOR_IDS_TAG => c_ids,
       C_REWRITE_RULES_STEP_0_TAG => inits,
       C_REWRITE_RULES_STEP_1_TAG => codes,
+      C_REWRITE_RULES_FUNCS_TAG => funcs,
       C_NAME_COUNT_TAG => names_count,
       C_ID_TO_NAME_DATA_TAG => id2nm,
+      C_ID_TO_ARITY_DATA_TAG => id2ar,
+      C_BOOK_HASH_TAG => book_hash,
       _ => panic!("Unknown replacement tag."),
     }
     .to_string()
@@ -534,3 +885,98 @@ fn c_runtime_template(
 
   (*result).to_string()
 }
+
+#[cfg(test)]
+mod tests {
+  use crate::builder::{build_match, build_runtime_functions, Match};
+  use crate::language as lang;
+  use crate::rulebook as rb;
+  use crate::runtime as rt;
+
+  // Finds the rule a decision tree picks for some arguments
+  fn run_match(tree: &Match, args: &[rt::Lnk]) -> Option<usize> {
+    match tree {
+      Match::Rule(rule) => Some(*rule),
+      Match::Fail => None,
+      Match::Test { arg, ctrs, nums, other } => {
+        let arg = args[*arg as usize];
+        let cases = if rt::get_tag(arg) == rt::CTR { ctrs } else { nums };
+        let key = if rt::get_tag(arg) == rt::CTR { rt::get_ext(arg) } else { arg };
+        let found =
+          cases.iter().find(|(case, _)| *case == key).and_then(|(_, tree)| run_match(tree, args));
+        found.or_else(|| run_match(other, args))
+      }
+    }
+  }
+
+  #[test]
+  fn test_match_picks_first_rule() {
+    // Conditions of 5 rules on 3 args, where 0 accepts anything
+    let ctr = |id| rt::Ctr(2, id, 0);
+    let num = rt::U_32;
+    let conds = vec![
+      vec![ctr(1), 0, num(0)],
+      vec![0, ctr(2), 0],
+      vec![ctr(1), ctr(3), num(1)],
+      vec![num(7), 0, 0],
+      vec![0, 0, num(1)],
+    ];
+    let tree = build_match(&conds, &[0, 1, 2, 3, 4], &mut vec![false; 3]);
+    let values = [ctr(1), ctr(2), ctr(3), num(0), num(1), num(7), rt::U_60(1), rt::F_32(1.0)];
+    for a in values {
+      for b in values {
+        for c in values {
+          let args = [a, b, c];
+          let expected = conds.iter().position(|cond| {
+            cond.iter().zip(args.iter()).all(|(cond, arg)| *cond == 0 || cond == arg)
+          });
+          assert_eq!(run_match(&tree, &args), expected, "args: {:?}", args);
+        }
+      }
+    }
+  }
+
+  #[test]
+  fn test_arity_table() {
+    let code = "
+      (Len Nil) = 0
+      (Len (Cons x xs)) = (+ 1 (Len xs))
+      (Pick (Box x)) = x
+      (Pick (Box x y)) = y
+      (Main) = (Len (Cons 1 Nil))
+    ";
+    let book = rb::gen_rulebook(&lang::read_file(code));
+    let arity = |name: &str| book.ctr_arity[name];
+    assert_eq!(arity("Cons"), Some(2));
+    assert_eq!(arity("Nil"), Some(0));
+    assert_eq!(arity("Len"), Some(1));
+    assert_eq!(arity("Box"), None);
+    let (_, mut dups_count) = build_runtime_functions(&book);
+    let c_code = super::compile_book(&mut dups_count, &book, false, false, false);
+    let entry = |name: &str| format!("[{}] = ", book.name_to_id[name]);
+    assert!(c_code.contains(&format!("{}2,", entry("Cons"))));
+    assert!(c_code.contains(&format!("{}ARITY_ANY,", entry("Box"))));
+  }
+
+  fn split(code: &str) -> super::Split {
+    let book = rb::gen_rulebook(&lang::read_file(code));
+    let (_, mut dups_count) = build_runtime_functions(&book);
+    super::compile_split(&mut dups_count, &book, false, false)
+  }
+
+  #[test]
+  fn test_split_changes_only_edited_unit() {
+    let code = "
+      (Id x) = x
+      (Len Nil) = 0
+      (Len (Cons x xs)) = (+ 1 (Len xs))
+      (Main) = (Len (Cons (Id 1) Nil))
+    ";
+    let old = split(code);
+    let new = split(&code.replace("(+ 1 (Len xs))", "(+ (Len xs) 1)"));
+    assert_eq!(old.runtime, new.runtime);
+    assert_eq!(old.units.len(), 3);
+    let changed: Vec<usize> = (0..3).filter(|i| old.units[*i] != new.units[*i]).collect();
+    assert_eq!(changed, vec![1]);
+  }
+}
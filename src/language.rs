@@ -1,4 +1,5 @@
 use crate::parser;
+use crate::runtime as rt;
 use std::fmt;
 
 // Types
@@ -16,6 +17,8 @@ pub enum Term {
   App { func: BTerm, argm: BTerm },
   Ctr { name: String, args: Vec<BTerm> },
   U32 { numb: u32 },
+  F32 { numb: f32 },
+  U60 { numb: u64 },
   Op2 { oper: Oper, val0: BTerm, val1: BTerm },
 }
 
@@ -132,11 +135,25 @@ impl fmt::Display for Term {
         }
       }
       Self::U32 { numb } => write!(f, "{}", numb),
+      Self::F32 { numb } => write!(f, "{}", show_f32(*numb)),
+      Self::U60 { numb } => write!(f, "{}u", numb),
       Self::Op2 { oper, val0, val1 } => write!(f, "({} {} {})", oper, val0, val1),
     }
   }
 }
 
+// Shows a float as the shortest literal that reads back to it. NaN and the
+// infinities have no literals, so they're shown as the divisions that make them.
+pub fn show_f32(numb: f32) -> String {
+  if numb.is_nan() {
+    "(/ 0.0 0.0)".to_string()
+  } else if numb.is_infinite() {
+    format!("(/ {:?} 0.0)", numb.signum())
+  } else {
+    format!("{:?}", numb)
+  }
+}
+
 // Rule
 // ----
 
@@ -266,18 +283,37 @@ pub fn parse_ctr(state: parser::State) -> parser::Answer<Option<BTerm>> {
   )
 }
 
-pub fn parse_u32(state: parser::State) -> parser::Answer<Option<BTerm>> {
+// Parses a number: `12` is a U32, `12u` a U60, and a literal with a point or an
+// exponent, like `1.5` or `-2e3`, is an F32.
+pub fn parse_num(state: parser::State) -> parser::Answer<Option<BTerm>> {
   parser::guard(
     Box::new(|state| {
       let (state, head) = parser::get_char(state)?;
-      Ok((state, ('0'..='9').contains(&head)))
+      let next = parser::head(state).unwrap_or('\0');
+      Ok((state, head.is_ascii_digit() || (head == '-' && next.is_ascii_digit())))
     }),
     Box::new(|state| {
-      let (state, numb) = parser::name1(state)?;
-      if !numb.is_empty() {
-        Ok((state, Box::new(Term::U32 { numb: numb.parse::<u32>().unwrap() })))
+      let mut text = String::new();
+      let mut next = state;
+      while let Some(got) = parser::head(next) {
+        let sign = (got == '-' || got == '+') && (text.is_empty() || text.ends_with(['e', 'E']));
+        if got.is_ascii_alphanumeric() || got == '.' || got == '_' || sign {
+          text.push(got);
+          next = parser::tail(next);
+        } else {
+          break;
+        }
+      }
+      let numb = if let Some(numb) = text.strip_suffix('u') {
+        numb.parse::<u64>().ok().filter(|numb| *numb <= rt::NUM_MASK).map(|numb| Term::U60 { numb })
+      } else if text.contains(['.', 'e', 'E']) {
+        text.parse::<f32>().ok().filter(|numb| numb.is_finite()).map(|numb| Term::F32 { numb })
       } else {
-        Ok((state, Box::new(Term::U32 { numb: 0 })))
+        text.parse::<u32>().ok().map(|numb| Term::U32 { numb })
+      };
+      match numb {
+        Some(numb) => Ok((next, Box::new(numb))),
+        None => parser::expected("number", text.len(), state),
       }
     }),
     state,
@@ -423,7 +459,7 @@ pub fn parse_term(state: parser::State) -> parser::Answer<BTerm> {
       Box::new(parse_ctr),
       Box::new(parse_op2),
       Box::new(parse_app),
-      Box::new(parse_u32),
+      Box::new(parse_num),
       Box::new(parse_str_sugar),
       Box::new(parse_lst_sugar),
       Box::new(parse_var),
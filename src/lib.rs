@@ -5,6 +5,7 @@
 pub mod builder;
 pub mod compiler;
 pub mod language;
+pub mod native;
 pub mod parser;
 pub mod readback;
 pub mod rulebook;
@@ -22,6 +23,7 @@ pub fn make_call(func: &str, args: &[&str]) -> language::Term {
 mod tests {
   use crate::eval_code;
   use crate::make_call;
+  use crate::native::eval_code_native;
 
   #[test]
   fn test() {
@@ -32,8 +34,77 @@ mod tests {
     (Main) = (Fn 20)
     ";
 
-    let (norm, _cost, _size, _time) = eval_code(&make_call("Main", &[]), code, false);
+    let (norm, _cost, _size, _time) = eval_code(&make_call("Main", &[]), code, false, 1);
     let norm = norm.to_string();
     assert_eq!(norm, "6765");
   }
+
+  #[test]
+  fn numbers() {
+    let code = "
+    (Fn 0u) = 0u
+    (Fn 1u) = 1u
+    (Fn n) = (+ (Fn (- n 1u)) (Fn (- n 2u)))
+    (Half 0.5) = 1
+    (Half x) = 0
+    (Main) = [(+ 4294967295 1) (+ 4294967295u 1) (Fn 20u) (/ 1.0 4.0) (% -7.5 2.0) (| 3.9 0) (Half (/ 1.0 2.0)) (- 0.0 1e20)]
+    ";
+
+    let (norm, _cost, _size, _time) = eval_code(&make_call("Main", &[]), code, false, 1);
+    let norm = norm.to_string();
+    let list = "(Cons 0 (Cons 4294967296u (Cons 6765u (Cons 0.25 (Cons -1.5 (Cons 3 (Cons 1 (Cons -1e20 (Nil)))))))))";
+    assert_eq!(norm, list);
+  }
+
+  #[test]
+  fn parallel() {
+    let code = "
+    (Fn 0) = 0
+    (Fn 1) = 1
+    (Fn n) = (+ (Fn (- n 1)) (Fn (- n 2)))
+    (Gen 0) = (Leaf 1)
+    (Gen n) = (Node (Gen (- n 1)) (Gen (- n 1)))
+    (Sum (Leaf x)) = x
+    (Sum (Node a b)) = (+ (Sum a) (Sum b))
+    (Dup x) = (Pair x x)
+    (Main) = [(Fn 20) (Sum (Gen 12)) (Dup (Gen 2)) λx (Fn 10)]
+    ";
+
+    let list = "(Cons 6765 (Cons 4096 (Cons (Pair (Node (Node (Leaf 1) (Leaf 1)) (Node (Leaf 1) (Leaf 1))) (Node (Node (Leaf 1) (Leaf 1)) (Node (Leaf 1) (Leaf 1)))) (Cons λ_ 55 (Nil)))))";
+    for threads in [1, 2, 4] {
+      let (norm, _cost, _size, _time) = eval_code(&make_call("Main", &[]), code, false, threads);
+      assert_eq!(norm.to_string(), list);
+    }
+  }
+
+  #[test]
+  fn native() {
+    let code = "
+    (Fn 0) = 0
+    (Fn 1) = 1
+    (Fn n) = (+ (Fn (- n 1)) (Fn (- n 2)))
+    (Map f (Nil)) = (Nil)
+    (Map f (Cons x xs)) = (Cons (f x) (Map f xs))
+    (Main n) = [(Fn n) (Map λx (* x 2) [1 2 3]) λx λy (Pair y x) 2.5]
+    ";
+
+    let list = "(Cons 6765 (Cons (Cons 2 (Cons 4 (Cons 6 (Nil)))) (Cons λx1 λx2 (Pair x2 x1) (Cons 2.5 (Nil)))))";
+    let call = make_call("Main", &["20"]);
+    let (norm, _cost, _size, _time) = eval_code(&call, code, false, 1);
+    assert_eq!(norm.to_string(), list);
+
+    // Needs a C compiler, and builds in a cache of its own
+    let cc = std::env::var("CC").unwrap_or_else(|_| "cc".to_string());
+    if std::process::Command::new(&cc).arg("--version").output().is_err() {
+      eprintln!("Skipping the native test: no C compiler '{}'.", cc);
+      return;
+    }
+    let cache = std::env::temp_dir().join(format!("hvm-test-cache-{}", std::process::id()));
+    std::env::set_var("HVM_CACHE", &cache);
+    for threads in [1, 2] {
+      let (norm, _cost, _size, _time) = eval_code_native(&call, code, threads).unwrap();
+      assert_eq!(norm.to_string(), list);
+    }
+    std::fs::remove_dir_all(&cache).unwrap();
+  }
 }
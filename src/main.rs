@@ -1,6 +1,7 @@
 mod builder;
 mod compiler;
 mod language;
+mod native;
 mod parser;
 mod readback;
 mod rulebook;
@@ -33,18 +34,24 @@ fn run_cli() -> std::io::Result<()> {
 
   if matches!(cmd, "d" | "debug") && args.len() >= 3 {
     let file = &hvm(&args[2]);
-    return run_code(&load_file_code(file), true);
+    return run_code(&load_file_code(file), true, 1, false);
   }
 
   if matches!(cmd, "r" | "run") && args.len() >= 3 {
     let file = &hvm(&args[2]);
-    return run_code(&load_file_code(file), false);
+    let single = args[3..].iter().any(|flag| flag == "--single-thread");
+    let native = args[3..].iter().any(|flag| flag == "--native");
+    let threads = if single { 1 } else { num_cpus::get() };
+    return run_code(&load_file_code(file), false, threads, native);
   }
 
   if matches!(cmd, "c" | "compile") && args.len() >= 3 {
     let file = &hvm(&args[2]);
-    let parallel = !(args.len() >= 4 && args[3] == "--single-thread");
-    return compile_code(&load_file_code(file), file, parallel);
+    let flags = &args[3..];
+    let parallel = !flags.iter().any(|flag| flag == "--single-thread");
+    let wide = flags.iter().any(|flag| flag == "--wide");
+    let table = flags.iter().any(|flag| flag == "--fn-table");
+    return compile_code(&load_file_code(file), file, parallel, wide, table);
   }
 
   println!("Invalid arguments: {:?}.", args);
@@ -57,7 +64,12 @@ fn show_help() {
   println!();
   println!("To run a file, interpreted:");
   println!();
-  println!("  hvm r file.hvm");
+  println!("  hvm r file.hvm [--single-thread] [--native]");
+  println!();
+  println!("  Normalizes with one thread per core, unless --single-thread is given.");
+  println!("  --native: runs the compiled C instead, built with $CC (or cc) as a");
+  println!("  library, whose objects are cached per function in $HVM_CACHE (or");
+  println!("  ~/.cache/hvm), so only the functions that changed are compiled again.");
   println!();
   println!("To run a file in debug mode:");
   println!();
@@ -65,7 +77,17 @@ fn show_help() {
   println!();
   println!("To compile a file to C:");
   println!();
-  println!("  hvm c file.hvm [--single-thread]");
+  println!("  hvm c file.hvm [--single-thread] [--wide] [--fn-table]");
+  println!();
+  println!("  --wide: supports heaps over 2^32 words, with up to 2^16 dup colors.");
+  println!("  --fn-table: compiles each function's rules to their own C functions.");
+  println!();
+  println!("Compiled programs accept --output=bin, to print the normal form in binary,");
+  println!("--save=FILE, to snapshot the heap holding it, and --load=FILE, to apply a");
+  println!("snapshot's normal form to the arguments instead of calling Main. An");
+  println!("argument @FILE (or @- for stdin) loads a text or binary term as input.");
+  println!("With --batch=FILE (or --batch=- for stdin), each line of FILE holds the");
+  println!("arguments of a call to Main, and the calls run in parallel.");
   println!();
   println!("This is a PROTOTYPE. Report bugs on https://github.com/Kindelia/HVM/issues!");
   println!();
@@ -74,26 +96,48 @@ fn show_help() {
 fn make_call() -> language::Term {
   let pars = &std::env::args().collect::<Vec<String>>()[3..];
   let name = "Main".to_string();
-  let args = pars.iter().map(|par| language::read_term(par)).collect();
+  let pars = pars.iter().filter(|par| !par.starts_with("--"));
+  let args = pars.map(|par| language::read_term(par)).collect();
   language::Term::Ctr { name, args }
 }
 
-fn run_code(code: &str, debug: bool) -> std::io::Result<()> {
+fn run_code(code: &str, debug: bool, threads: usize, native: bool) -> std::io::Result<()> {
   println!("Reducing.");
-  let (norm, cost, size, time) = builder::eval_code(&make_call(), code, debug);
+  let (norm, cost, size, time) = if native {
+    native::eval_code_native(&make_call(), code, threads)?
+  } else {
+    builder::eval_code(&make_call(), code, debug, threads)
+  };
   println!("Rewrites: {} ({:.2} MR/s)", cost, (cost as f64) / (time as f64) / 1000.0);
   println!("Mem.Size: {}", size);
+  if let Some(rss) = peak_rss() {
+    println!("Peak RSS: {} MB", rss / (1024 * 1024));
+  }
   println!();
   println!("{}", norm);
   Ok(())
 }
 
-fn compile_code(code: &str, name: &str, parallel: bool) -> std::io::Result<()> {
+// Peak resident memory of this process, in bytes, where the OS reports it
+fn peak_rss() -> Option<u64> {
+  let status = std::fs::read_to_string("/proc/self/status").ok()?;
+  let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+  let kb = line.split_whitespace().nth(1)?.parse::<u64>().ok()?;
+  Some(kb * 1024)
+}
+
+fn compile_code(
+  code: &str,
+  name: &str,
+  parallel: bool,
+  wide: bool,
+  table: bool,
+) -> std::io::Result<()> {
   if !name.ends_with(".hvm") {
     panic!("Input file must end with .hvm.");
   }
   let name = format!("{}.c", &name[0..name.len() - 4]);
-  compiler::compile_code_and_save(code, &name, parallel)?;
+  compiler::compile_code_and_save(code, &name, parallel, wide, table)?;
   println!("Compiled to '{}'.", name);
   Ok(())
 }
@@ -151,14 +195,14 @@ fn run_example() -> std::io::Result<()> {
   ";
 
   // Compiles to C and saves as 'main.c'
-  compiler::compile_code_and_save(code, "main.c", true)?;
+  compiler::compile_code_and_save(code, "main.c", true, false, false)?;
   println!("Compiled to 'main.c'.");
 
   // Evaluates with interpreter
 
   println!("Reducing with interpreter.");
   let call = language::Term::Ctr { name: "Main".to_string(), args: Vec::new() };
-  let (norm, cost, size, time) = builder::eval_code(&call, code, false);
+  let (norm, cost, size, time) = builder::eval_code(&call, code, false, 1);
   println!("Rewrites: {} ({:.2} MR/s)", cost, (cost as f64) / (time as f64) / 1000.0);
   println!("Mem.Size: {}", size);
   println!();
@@ -0,0 +1,401 @@
+// Running programs at C speed, without leaving hvm. The program is compiled as
+// `hvm c --fn-table` would, but split in a C file per function plus one for the
+// runtime (see compile_split), which are built to objects with -DHVM_LIBRARY,
+// so there is no main(), and linked to a shared library, loaded with dlopen.
+// Objects and libraries are cached by the SHA-256 of what they were built from,
+// compiler version included, so after a change, only the units that changed are
+// compiled again. Cache entries unused for a month are deleted. The main
+// term is built by the Rust side, copied into the library's heap and normalized
+// by its ffi_normal(). The heap is then copied back, and the normal form is read
+// by readback.rs, as in the interpreter.
+
+use crate::builder as bd;
+use crate::compiler;
+use crate::language as lang;
+use crate::readback as rd;
+use crate::rulebook as rb;
+use crate::runtime as rt;
+use std::ffi::{CStr, CString};
+use std::fs::File;
+use std::io::{Error, ErrorKind};
+use std::os::raw::{c_char, c_int, c_void};
+use std::path::{Path, PathBuf};
+use std::process::{Child, Command, Stdio};
+use std::time::{Duration, Instant, SystemTime};
+
+#[link(name = "dl")]
+extern "C" {
+  fn dlopen(filename: *const c_char, flag: c_int) -> *mut c_void;
+  fn dlsym(handle: *mut c_void, symbol: *const c_char) -> *mut c_void;
+  fn dlclose(handle: *mut c_void) -> c_int;
+  fn dlerror() -> *mut c_char;
+}
+
+const RTLD_NOW: c_int = 2;
+
+// The flags every object and library is built with, besides $CFLAGS. They are
+// part of the cache keys, along with the compiler and its version. On ELF, the
+// library must bind to its own functions, or any that share a name with one of
+// libc's would resolve to libc's, loaded before it.
+const OBJECT_FLAGS: [&str; 4] = ["-O2", "-fPIC", "-DHVM_LIBRARY", "-c"];
+#[cfg(not(target_os = "macos"))]
+const LIBRARY_FLAGS: [&str; 3] = ["-shared", "-Wl,-Bsymbolic", "-lpthread"];
+#[cfg(target_os = "macos")]
+const LIBRARY_FLAGS: [&str; 2] = ["-shared", "-lpthread"];
+
+// Cache entries not used for this long are deleted, when a library is built
+const CACHE_MAX_AGE: Duration = Duration::from_secs(30 * 24 * 60 * 60);
+
+// A loaded library. It is unloaded on drop, so the pointers it gave must not
+// outlive it.
+struct Library {
+  handle: *mut c_void,
+}
+
+impl Library {
+  fn open(path: &Path) -> std::io::Result<Library> {
+    let name = CString::new(path.to_string_lossy().as_bytes()).map_err(invalid)?;
+    let handle = unsafe { dlopen(name.as_ptr(), RTLD_NOW) };
+    if handle.is_null() {
+      return Err(Error::new(ErrorKind::Other, last_dl_error()));
+    }
+    Ok(Library { handle })
+  }
+
+  // The address of a function or global of the library
+  fn symbol(&self, name: &str) -> std::io::Result<*mut c_void> {
+    let cname = CString::new(name).map_err(invalid)?;
+    let addr = unsafe { dlsym(self.handle, cname.as_ptr()) };
+    if addr.is_null() {
+      return Err(Error::new(ErrorKind::Other, format!("Missing symbol '{}'.", name)));
+    }
+    Ok(addr)
+  }
+}
+
+impl Drop for Library {
+  fn drop(&mut self) {
+    unsafe {
+      dlclose(self.handle);
+    }
+  }
+}
+
+fn last_dl_error() -> String {
+  let error = unsafe { dlerror() };
+  if error.is_null() {
+    "Unknown dlopen error.".to_string()
+  } else {
+    unsafe { CStr::from_ptr(error) }.to_string_lossy().into_owned()
+  }
+}
+
+fn invalid<E: std::error::Error + Send + Sync + 'static>(error: E) -> Error {
+  Error::new(ErrorKind::InvalidInput, error)
+}
+
+// Where libraries are cached: $HVM_CACHE, or an `hvm` dir in the user's cache
+fn cache_dir() -> PathBuf {
+  if let Some(dir) = std::env::var_os("HVM_CACHE") {
+    return PathBuf::from(dir);
+  }
+  if let Some(dir) = std::env::var_os("XDG_CACHE_HOME") {
+    return PathBuf::from(dir).join("hvm");
+  }
+  if let Some(dir) = std::env::var_os("HOME") {
+    return PathBuf::from(dir).join(".cache").join("hvm");
+  }
+  std::env::temp_dir().join("hvm")
+}
+
+// The SHA-256 of the given parts, each prefixed by its length, in hex. Unlike
+// std's hashers, it is the same on every build of hvm, so the cache survives
+// upgrades of the Rust toolchain.
+fn cache_key(parts: &[&[u8]]) -> String {
+  let mut data = Vec::new();
+  for part in parts {
+    data.extend_from_slice(&(part.len() as u64).to_le_bytes());
+    data.extend_from_slice(part);
+  }
+  sha256(&data).iter().map(|byte| format!("{:02x}", byte)).collect()
+}
+
+const SHA256_K: [u32; 64] = [
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+];
+
+// SHA-256 (FIPS 180-4), to not depend on a crate for the cache keys
+fn sha256(data: &[u8]) -> [u8; 32] {
+  let mut hash: [u32; 8] = [
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  ];
+  let mut message = data.to_vec();
+  message.push(0x80);
+  while message.len() % 64 != 56 {
+    message.push(0);
+  }
+  message.extend_from_slice(&((data.len() as u64) * 8).to_be_bytes());
+  for block in message.chunks(64) {
+    let mut w = [0u32; 64];
+    for i in 0..16 {
+      w[i] =
+        u32::from_be_bytes([block[i * 4], block[i * 4 + 1], block[i * 4 + 2], block[i * 4 + 3]]);
+    }
+    for i in 16..64 {
+      let s0 = w[i - 15].rotate_right(7) ^ w[i - 15].rotate_right(18) ^ (w[i - 15] >> 3);
+      let s1 = w[i - 2].rotate_right(17) ^ w[i - 2].rotate_right(19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16].wrapping_add(s0).wrapping_add(w[i - 7]).wrapping_add(s1);
+    }
+    let [mut a, mut b, mut c, mut d, mut e, mut f, mut g, mut h] = hash;
+    for i in 0..64 {
+      let s1 = e.rotate_right(6) ^ e.rotate_right(11) ^ e.rotate_right(25);
+      let ch = (e & f) ^ (!e & g);
+      let t1 = h.wrapping_add(s1).wrapping_add(ch).wrapping_add(SHA256_K[i]).wrapping_add(w[i]);
+      let s0 = a.rotate_right(2) ^ a.rotate_right(13) ^ a.rotate_right(22);
+      let maj = (a & b) ^ (a & c) ^ (b & c);
+      let t2 = s0.wrapping_add(maj);
+      h = g;
+      g = f;
+      f = e;
+      e = d.wrapping_add(t1);
+      d = c;
+      c = b;
+      b = a;
+      a = t1.wrapping_add(t2);
+    }
+    for (word, add) in hash.iter_mut().zip([a, b, c, d, e, f, g, h]) {
+      *word = word.wrapping_add(add);
+    }
+  }
+  let mut out = [0u8; 32];
+  for (i, word) in hash.iter().enumerate() {
+    out[i * 4..i * 4 + 4].copy_from_slice(&word.to_be_bytes());
+  }
+  out
+}
+
+// What `cc --version` prints, so that upgrading the compiler rebuilds the cache
+fn cc_version(cc: &str) -> std::io::Result<Vec<u8>> {
+  let output =
+    Command::new(cc).arg("--version").stderr(Stdio::null()).output().map_err(|error| {
+      Error::new(error.kind(), format!("Can't run the C compiler '{}': {}.", cc, error))
+    })?;
+  Ok(output.stdout)
+}
+
+// Marks a cache entry as used now, so it isn't pruned
+fn touch(path: &Path) {
+  if let Ok(file) = File::options().append(true).open(path) {
+    let _ = file.set_modified(SystemTime::now());
+  }
+}
+
+// Deletes the entries of the cache not used for CACHE_MAX_AGE, including files
+// left by interrupted builds. Only files named by a cache key are considered,
+// as $HVM_CACHE may hold others.
+fn prune_cache(dir: &Path) {
+  let entries = match std::fs::read_dir(dir) {
+    Ok(entries) => entries,
+    Err(_) => return,
+  };
+  let now = SystemTime::now();
+  for entry in entries.flatten() {
+    let name = entry.file_name();
+    let name = name.to_string_lossy();
+    let is_entry = name.len() > 65
+      && name.as_bytes()[64] == b'.'
+      && name[..64].bytes().all(|byte| byte.is_ascii_hexdigit());
+    let age = entry.metadata().and_then(|meta| meta.modified()).ok();
+    let age = age.and_then(|time| now.duration_since(time).ok());
+    if is_entry && age.map_or(false, |age| age > CACHE_MAX_AGE) {
+      let _ = std::fs::remove_file(entry.path());
+    }
+  }
+}
+
+// Waits for a compiler run, turning its failure into an error with its output
+fn finish_cc(cc: &str, child: std::io::Result<Child>) -> std::io::Result<()> {
+  let output = child.and_then(|child| child.wait_with_output()).map_err(|error| {
+    Error::new(error.kind(), format!("Can't run the C compiler '{}': {}.", cc, error))
+  })?;
+  if !output.status.success() {
+    let error = String::from_utf8_lossy(&output.stderr);
+    return Err(Error::new(ErrorKind::Other, format!("C compilation failed:\n{}", error)));
+  }
+  Ok(())
+}
+
+// Builds the library of a split program with $CC (or cc), unless it is cached,
+// and returns its path. The objects missing from the cache are compiled first,
+// as many at once as there are cores. Each build goes to a file of its own,
+// then is renamed in place, so concurrent runs never use a partial one. Building
+// a library also prunes the cache.
+pub fn build_library(split: &compiler::Split) -> std::io::Result<PathBuf> {
+  let cc = std::env::var("CC").unwrap_or_else(|_| "cc".to_string());
+  let cflags = std::env::var("CFLAGS").unwrap_or_default();
+  let version = cc_version(&cc)?;
+  let dir = cache_dir();
+  let pid = std::process::id();
+  std::fs::create_dir_all(&dir)?;
+
+  let sources = std::iter::once(&split.runtime).chain(split.units.iter());
+  let toolchain = [cc.as_bytes(), &version, cflags.as_bytes()];
+  let key = |head: Vec<&[u8]>, flags: &[&str]| {
+    let flags = flags.iter().map(|flag| flag.as_bytes());
+    cache_key(&head.into_iter().chain(toolchain).chain(flags).collect::<Vec<_>>())
+  };
+  let objects: Vec<(String, &String)> =
+    sources.map(|code| (key(vec![code.as_bytes()], &OBJECT_FLAGS), code)).collect();
+  let keys = objects.iter().map(|(key, _)| key.as_bytes()).collect();
+  let library = dir.join(format!("{}.so", key(keys, &LIBRARY_FLAGS)));
+  if library.exists() {
+    touch(&library);
+    return Ok(library);
+  }
+  prune_cache(&dir);
+
+  // Compiles the missing objects
+  let missing: Vec<&(String, &String)> = objects
+    .iter()
+    .filter(|(key, _)| {
+      let object = dir.join(format!("{}.o", key));
+      touch(&object);
+      !object.exists()
+    })
+    .collect();
+  for batch in missing.chunks(num_cpus::get().max(1)) {
+    let mut runs = Vec::new();
+    for (key, code) in batch {
+      let c_file = dir.join(format!("{}.{}.c", key, pid));
+      let temp = dir.join(format!("{}.{}.tmp", key, pid));
+      std::fs::write(&c_file, code)?;
+      let child = Command::new(&cc)
+        .args(OBJECT_FLAGS)
+        .args(cflags.split_whitespace())
+        .arg(&c_file)
+        .arg("-o")
+        .arg(&temp)
+        .stdout(Stdio::piped())
+        .stderr(Stdio::piped())
+        .spawn();
+      runs.push((key, c_file, temp, child));
+    }
+    let mut result = Ok(());
+    for (key, c_file, temp, child) in runs {
+      let done = finish_cc(&cc, child);
+      let _ = std::fs::remove_file(&c_file);
+      match done {
+        Ok(()) => std::fs::rename(&temp, dir.join(format!("{}.o", key)))?,
+        Err(error) => {
+          let _ = std::fs::remove_file(&temp);
+          result = result.and(Err(error));
+        }
+      }
+    }
+    result?;
+  }
+
+  // Links them
+  let temp = dir.join(format!("{}.{}.tmp", library.file_stem().unwrap().to_string_lossy(), pid));
+  let child = Command::new(&cc)
+    .args(cflags.split_whitespace())
+    .args(objects.iter().map(|(key, _)| dir.join(format!("{}.o", key))))
+    .arg("-o")
+    .arg(&temp)
+    .args(LIBRARY_FLAGS)
+    .stdout(Stdio::piped())
+    .stderr(Stdio::piped())
+    .spawn();
+  if let Err(error) = finish_cc(&cc, child) {
+    let _ = std::fs::remove_file(&temp);
+    return Err(error);
+  }
+  std::fs::rename(&temp, &library)?;
+  Ok(library)
+}
+
+// Evaluates a Lambolt term to normal form natively. With one thread, the C is
+// built with --single-thread; otherwise, it uses a worker per core.
+pub fn eval_code_native(
+  call: &lang::Term,
+  code: &str,
+  threads: usize,
+) -> std::io::Result<(Box<lang::Term>, u64, u64, u64)> {
+  // Compiles the rulebook, then builds the main term, with dup colors past
+  // those of the compiled rules
+  let file = lang::read_file(code);
+  let book = rb::gen_rulebook(&file);
+  let (_, mut dups_count) = bd::build_runtime_functions(&book);
+  let split = compiler::compile_split(&mut dups_count, &book, threads > 1, false);
+  let mut worker = rt::new_worker();
+  let host = bd::alloc_term(&mut dups_count, &mut worker, &book, call);
+
+  // Builds and loads the library
+  let library = Library::open(&build_library(&split)?)?;
+
+  unsafe {
+    let heap_alloc: extern "C" fn() -> *mut u64 =
+      std::mem::transmute(library.symbol("heap_alloc")?);
+    let heap_take: extern "C" fn(u64) -> u64 = std::mem::transmute(library.symbol("heap_take")?);
+    let heap_free: extern "C" fn() = std::mem::transmute(library.symbol("heap_free")?);
+    let ffi_normal: extern "C" fn(*mut u8, u64, u64) =
+      std::mem::transmute(library.symbol("ffi_normal")?);
+    let heap_used = library.symbol("heap_used")? as *const u64;
+    let ffi_cost = library.symbol("ffi_cost")? as *const u64;
+    let ffi_size = library.symbol("ffi_size")? as *const u64;
+
+    // Copies the main term to the library's heap. The layouts of the Rust and
+    // C heaps are the same, so its links are valid there as they are. Only the
+    // words in use are, so that Mem.Size compares with the interpreter's.
+    rt::heap_return(&mut worker);
+    let size = rt::heap_used(&worker);
+    let node = heap_alloc();
+    heap_take(size);
+    for loc in 0..size {
+      *node.add(loc as usize) = rt::ask_lnk(&worker, loc);
+    }
+    drop(worker);
+
+    // Normalizes it
+    let init = Instant::now();
+    ffi_normal(node as *mut u8, size, host);
+    let time = init.elapsed().as_millis() as u64;
+
+    // Built with -DPROFILE in $CFLAGS, the library also reports where the
+    // rewrites went
+    if let Ok(ffi_profile) = library.symbol("ffi_profile") {
+      let ffi_profile: extern "C" fn() = std::mem::transmute(ffi_profile);
+      ffi_profile();
+    }
+
+    // Copies the heap back, and reads the normal form from it
+    let back = rt::new_worker_with(std::slice::from_raw_parts(node, *heap_used as usize).to_vec());
+    let (cost, size) = (*ffi_cost, *ffi_size);
+    heap_free();
+    let norm = rd::as_term(&back, &Some(book), host);
+
+    Ok((norm, cost, size, time))
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  #[test]
+  fn sha256_vectors() {
+    let hex =
+      |data: &[u8]| sha256(data).iter().map(|byte| format!("{:02x}", byte)).collect::<String>();
+    assert_eq!(hex(b""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    assert_eq!(hex(b"abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    let long = b"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    assert_eq!(hex(long), "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  }
+}
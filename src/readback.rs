@@ -60,7 +60,7 @@ pub fn as_code(mem: &Worker, comp: &Option<rb::RuleBook>, host: u64) -> String {
         name(ctx, arg0, depth + 1);
         name(ctx, arg1, depth + 1);
       }
-      rt::U32 => {}
+      rt::U32 | rt::F32 | rt::U60 => {}
       rt::CTR | rt::CAL => {
         let arity = rt::get_ari(term);
         for i in 0..arity {
@@ -200,6 +200,10 @@ pub fn as_code(mem: &Worker, comp: &Option<rb::RuleBook>, host: u64) -> String {
       rt::U32 => {
         format!("{}", rt::get_val(term))
       }
+      rt::F32 => lang::show_f32(rt::get_f32(term)),
+      rt::U60 => {
+        format!("{}u", rt::get_num(term))
+      }
       rt::CTR | rt::CAL => {
         let func = rt::get_ext(term);
         let arit = rt::get_ari(term);
@@ -249,3 +253,179 @@ pub fn as_code(mem: &Worker, comp: &Option<rb::RuleBook>, host: u64) -> String {
 pub fn as_term(mem: &Worker, comp: &Option<rb::RuleBook>, host: u64) -> Box<lang::Term> {
   lang::read_term(&as_code(mem, comp, host))
 }
+
+/// Decodes a normal form written by a compiled program run with `--output=bin`.
+/// Variables are named as in its text output. Superpositions have no Term, so
+/// they are reported as errors.
+#[allow(dead_code)] // only used by library consumers
+pub fn from_bin(bytes: &[u8]) -> Result<Box<lang::Term>, String> {
+  struct Input<'a> {
+    bytes: &'a [u8],
+    index: usize,
+  }
+
+  impl<'a> Input<'a> {
+    fn take(&mut self, size: usize) -> Result<&'a [u8], String> {
+      let got = self
+        .bytes
+        .get(self.index..self.index + size)
+        .ok_or_else(|| format!("Unexpected end of input at byte {}.", self.index))?;
+      self.index += size;
+      Ok(got)
+    }
+    fn int(&mut self, size: usize) -> Result<u64, String> {
+      Ok(self.take(size)?.iter().rev().fold(0, |val, byte| (val << 8) | *byte as u64))
+    }
+  }
+
+  // A node whose arguments are still being read
+  enum Node {
+    Lam { name: String },
+    App,
+    Op2 { oper: lang::Oper },
+    Ctr { name: String, arity: usize },
+  }
+
+  fn oper(code: u64) -> Result<lang::Oper, String> {
+    match code {
+      rt::ADD => Ok(lang::Oper::Add),
+      rt::SUB => Ok(lang::Oper::Sub),
+      rt::MUL => Ok(lang::Oper::Mul),
+      rt::DIV => Ok(lang::Oper::Div),
+      rt::MOD => Ok(lang::Oper::Mod),
+      rt::AND => Ok(lang::Oper::And),
+      rt::OR => Ok(lang::Oper::Or),
+      rt::XOR => Ok(lang::Oper::Xor),
+      rt::SHL => Ok(lang::Oper::Shl),
+      rt::SHR => Ok(lang::Oper::Shr),
+      rt::LTN => Ok(lang::Oper::Ltn),
+      rt::LTE => Ok(lang::Oper::Lte),
+      rt::EQL => Ok(lang::Oper::Eql),
+      rt::GTE => Ok(lang::Oper::Gte),
+      rt::GTN => Ok(lang::Oper::Gtn),
+      rt::NEQ => Ok(lang::Oper::Neq),
+      _ => Err(format!("Unknown operator: {}.", code)),
+    }
+  }
+
+  fn var_name(index: u64) -> String {
+    format!("x{}", index)
+  }
+
+  let mut input = Input { bytes, index: 0 };
+  if input.take(4)? != b"HVMB" {
+    return Err("Not a binary normal form.".to_string());
+  }
+  let version = input.int(1)?;
+  if version != 1 {
+    return Err(format!("Unsupported binary normal form version: {}.", version));
+  }
+  let mut names = Vec::new();
+  for _ in 0..input.int(8)? {
+    let size = input.int(4)? as usize;
+    names.push(String::from_utf8_lossy(input.take(size)?).to_string());
+  }
+
+  // Nodes are in prefix order. Each one waits on the stack until its arguments
+  // are read, so deep terms don't recurse.
+  let mut stack: Vec<(Node, Vec<lang::BTerm>)> = Vec::new();
+  loop {
+    let mut term = match input.int(1)? {
+      rt::LAM => {
+        let index = input.int(8)?;
+        let name = if index == u64::MAX { "_".to_string() } else { var_name(index) };
+        stack.push((Node::Lam { name }, Vec::new()));
+        continue;
+      }
+      rt::APP => {
+        stack.push((Node::App, Vec::new()));
+        continue;
+      }
+      rt::OP2 => {
+        let oper = oper(input.int(1)?)?;
+        stack.push((Node::Op2 { oper }, Vec::new()));
+        continue;
+      }
+      rt::CTR => {
+        let id = input.int(4)?;
+        let arity = input.int(1)? as usize;
+        let name = match names.get(id as usize) {
+          Some(name) if !name.is_empty() => name.clone(),
+          _ => format!("${}", id),
+        };
+        if arity > 0 {
+          stack.push((Node::Ctr { name, arity }, Vec::new()));
+          continue;
+        }
+        Box::new(lang::Term::Ctr { name, args: Vec::new() })
+      }
+      rt::U32 => Box::new(lang::Term::U32 { numb: input.int(4)? as u32 }),
+      rt::F32 => Box::new(lang::Term::F32 { numb: f32::from_bits(input.int(4)? as u32) }),
+      rt::U60 => Box::new(lang::Term::U60 { numb: input.int(8)? }),
+      rt::VAR => Box::new(lang::Term::Var { name: var_name(input.int(8)?) }),
+      rt::PAR => return Err("Can't decode a superposition.".to_string()),
+      _ => return Err(format!("Unknown node at byte {}.", input.index - 1)),
+    };
+    // Completes the nodes that were only waiting for this term
+    loop {
+      let (node, args) = match stack.last_mut() {
+        Some(top) => top,
+        None => return Ok(term),
+      };
+      args.push(term);
+      let arity = match node {
+        Node::Lam { .. } => 1,
+        Node::App | Node::Op2 { .. } => 2,
+        Node::Ctr { arity, .. } => *arity,
+      };
+      if args.len() < arity {
+        break;
+      }
+      let (node, mut args) = stack.pop().unwrap();
+      term = match node {
+        Node::Lam { name } => Box::new(lang::Term::Lam { name, body: args.pop().unwrap() }),
+        Node::App => {
+          let argm = args.pop().unwrap();
+          let func = args.pop().unwrap();
+          Box::new(lang::Term::App { func, argm })
+        }
+        Node::Op2 { oper } => {
+          let val1 = args.pop().unwrap();
+          let val0 = args.pop().unwrap();
+          Box::new(lang::Term::Op2 { oper, val0, val1 })
+        }
+        Node::Ctr { name, .. } => Box::new(lang::Term::Ctr { name, args }),
+      };
+    }
+  }
+}
+
+#[cfg(test)]
+mod tests {
+  use super::from_bin;
+
+  #[test]
+  fn decodes_binary_normal_form() {
+    // Names: 0 = "Cons", 1 = "Nil", 2 has none
+    let mut bytes = b"HVMB\x01".to_vec();
+    bytes.extend([3, 0, 0, 0, 0, 0, 0, 0]);
+    bytes.extend([4, 0, 0, 0]);
+    bytes.extend(b"Cons");
+    bytes.extend([3, 0, 0, 0]);
+    bytes.extend(b"Nil");
+    bytes.extend([0, 0, 0, 0]);
+    // (Cons λx0 (+ x0 7) (Cons ($2) (Nil)))
+    bytes.extend([0x8, 0, 0, 0, 0, 2]);
+    bytes.extend([0x5, 0, 0, 0, 0, 0, 0, 0, 0]);
+    bytes.extend([0xA, 0x0]);
+    bytes.extend([0x2, 0, 0, 0, 0, 0, 0, 0, 0]);
+    bytes.extend([0xB, 7, 0, 0, 0]);
+    bytes.extend([0x8, 0, 0, 0, 0, 2]);
+    bytes.extend([0x8, 2, 0, 0, 0, 0]);
+    bytes.extend([0x8, 1, 0, 0, 0, 0]);
+    let term = from_bin(&bytes).unwrap();
+    assert_eq!(term.to_string(), "(Cons λx0 (+ x0 7) (Cons ($2) (Nil)))");
+    assert!(from_bin(&bytes[..bytes.len() - 1]).is_err());
+    assert!(from_bin(b"HVMB\x02").is_err());
+  }
+}
@@ -17,6 +17,7 @@ pub struct RuleBook {
   pub id_to_name: HashMap<u64, String>,
   pub name_to_id: HashMap<String, u64>,
   pub ctr_is_cal: HashMap<String, bool>,
+  pub ctr_arity: HashMap<String, Option<usize>>,
 }
 
 pub fn gen_rulebook(file: &lang::File) -> RuleBook {
@@ -99,6 +100,47 @@ pub fn gen_rulebook(file: &lang::File) -> RuleBook {
     is_call
   }
 
+  // Finds the arity each constructor and function is used with, in patterns and
+  // bodies. A name used with several arities has none.
+  pub type ArityTable = HashMap<String, Option<usize>>;
+  pub fn gen_ctr_arity(rules: &[lang::Rule]) -> ArityTable {
+    fn find_arities(term: &lang::Term, table: &mut ArityTable) {
+      match term {
+        lang::Term::Dup { expr, body, .. } | lang::Term::Let { expr, body, .. } => {
+          find_arities(expr, table);
+          find_arities(body, table);
+        }
+        lang::Term::Lam { body, .. } => {
+          find_arities(body, table);
+        }
+        lang::Term::App { func, argm, .. } => {
+          find_arities(func, table);
+          find_arities(argm, table);
+        }
+        lang::Term::Op2 { val0, val1, .. } => {
+          find_arities(val0, table);
+          find_arities(val1, table);
+        }
+        lang::Term::Ctr { name, args } => {
+          let arity = table.entry(name.clone()).or_insert(Some(args.len()));
+          if *arity != Some(args.len()) {
+            *arity = None;
+          }
+          for arg in args {
+            find_arities(arg, table);
+          }
+        }
+        _ => (),
+      }
+    }
+    let mut table = HashMap::new();
+    for rule in rules {
+      find_arities(&rule.lhs, &mut table);
+      find_arities(&rule.rhs, &mut table);
+    }
+    table
+  }
+
   // Groups rules by name. For example:
   //   (add (succ a) (succ b)) = (succ (succ (add a b)))
   //   (add (succ a) (zero)  ) = (succ a)
@@ -130,7 +172,36 @@ pub fn gen_rulebook(file: &lang::File) -> RuleBook {
   let name_to_id = gen_name_to_id(&flat_rules);
   let id_to_name = invert(&name_to_id);
   let ctr_is_cal = gen_ctr_is_cal(&flat_rules);
-  RuleBook { func_rules, name_to_id, id_to_name, ctr_is_cal }
+  let ctr_arity = gen_ctr_arity(&flat_rules);
+  RuleBook { func_rules, name_to_id, id_to_name, ctr_is_cal, ctr_arity }
+}
+
+// A fingerprint of a rulebook: the FNV-1a hash of its names, by id, and of its
+// rules, by function. Snapshots carry the one of the program that saved them,
+// since their heaps are only meaningful to it. Unlike std's hashers, it is the
+// same on every build of hvm.
+pub fn fingerprint(book: &RuleBook) -> u64 {
+  let mut hash: u64 = 0xcbf29ce484222325;
+  let mut feed = |text: &str| {
+    for byte in text.bytes().chain(std::iter::once(0)) {
+      hash = (hash ^ byte as u64).wrapping_mul(0x100000001b3);
+    }
+  };
+  let mut names: Vec<(&u64, &String)> = book.id_to_name.iter().collect();
+  names.sort();
+  for (id, name) in names {
+    feed(&id.to_string());
+    feed(name);
+  }
+  let mut func_rules: Vec<_> = book.func_rules.iter().collect();
+  func_rules.sort_by(|a, b| a.0.cmp(b.0));
+  for (name, (_arity, rules)) in func_rules {
+    feed(name);
+    for rule in rules {
+      feed(&rule.to_string());
+    }
+  }
+  hash
 }
 
 // Sanitize
@@ -178,7 +249,7 @@ pub fn sanitize_rule(rule: &lang::Rule) -> Result<lang::Rule, String> {
               }
             }
           }
-          lang::Term::U32 { .. } => {}
+          lang::Term::U32 { .. } | lang::Term::F32 { .. } | lang::Term::U60 { .. } => {}
           _ => {
             return Err("Invalid left-hand side".to_owned());
           }
@@ -297,6 +368,14 @@ pub fn sanitize_rule(rule: &lang::Rule) -> Result<lang::Rule, String> {
         let term = lang::Term::U32 { numb: *numb };
         Box::new(term)
       }
+      lang::Term::F32 { numb } => {
+        let term = lang::Term::F32 { numb: *numb };
+        Box::new(term)
+      }
+      lang::Term::U60 { numb } => {
+        let term = lang::Term::U60 { numb: *numb };
+        Box::new(term)
+      }
     };
 
     Ok(term)
@@ -558,7 +637,17 @@ pub fn flatten(rules: &[lang::Rule]) -> Vec<lang::Rule> {
   }
 
   fn is_tested(term: &lang::Term) -> bool {
-    matches!(term, lang::Term::Ctr { .. } | lang::Term::U32 { .. })
+    matches!(term, lang::Term::Ctr { .. }) || number(term).is_some()
+  }
+
+  // The type and bits of a number pattern, so patterns can be compared
+  fn number(term: &lang::Term) -> Option<(u8, u64)> {
+    match term {
+      lang::Term::U32 { numb } => Some((0, *numb as u64)),
+      lang::Term::F32 { numb } => Some((1, numb.to_bits() as u64)),
+      lang::Term::U60 { numb } => Some((2, *numb)),
+      _ => None,
+    }
   }
 
   // Checks true if every time that `a` matches, `b` will match too
@@ -576,7 +665,7 @@ pub fn flatten(rules: &[lang::Rule]) -> Vec<lang::Rule> {
                 return false;
               }
             }
-            lang::Term::U32 { .. } => {
+            lang::Term::U32 { .. } | lang::Term::F32 { .. } | lang::Term::U60 { .. } => {
               return false;
             }
             lang::Term::Var { .. } => {
@@ -594,9 +683,10 @@ pub fn flatten(rules: &[lang::Rule]) -> Vec<lang::Rule> {
             }
             _ => {}
           },
-          lang::Term::U32 { numb: a_arg_numb } => match **b_arg {
-            lang::Term::U32 { numb: b_arg_numb } => {
-              if a_arg_numb != b_arg_numb {
+          lang::Term::U32 { .. } | lang::Term::F32 { .. } | lang::Term::U60 { .. } => match **b_arg
+          {
+            lang::Term::U32 { .. } | lang::Term::F32 { .. } | lang::Term::U60 { .. } => {
+              if number(a_arg) != number(b_arg) {
                 return false;
               }
             }
@@ -638,7 +728,7 @@ pub fn flatten(rules: &[lang::Rule]) -> Vec<lang::Rule> {
                         new_arg_args.push(Box::new(lang::Term::Var { name: var_name.clone() }));
                         new_rhs_args.push(Box::new(lang::Term::Var { name: var_name.clone() }));
                       }
-                      lang::Term::U32 { .. } => {
+                      lang::Term::U32 { .. } | lang::Term::F32 { .. } | lang::Term::U60 { .. } => {
                         let var_name = format!(".{}", fresh(name_count));
                         new_arg_args.push(Box::new(lang::Term::Var { name: var_name.clone() }));
                         new_rhs_args.push(Box::new(lang::Term::Var { name: var_name.clone() }));
@@ -683,7 +773,7 @@ pub fn flatten(rules: &[lang::Rule]) -> Vec<lang::Rule> {
                           other_new_lhs_args.push(other_field.clone());
                         }
                       }
-                      lang::Term::U32 { .. } => {}
+                      lang::Term::U32 { .. } | lang::Term::F32 { .. } | lang::Term::U60 { .. } => {}
                       lang::Term::Var { .. } => {
                         other_new_lhs_args.push(other_arg.clone());
                       }
@@ -714,8 +804,9 @@ pub fn flatten(rules: &[lang::Rule]) -> Vec<lang::Rule> {
     new_rules
   }
 
-  // Groups rules by function name
-  let mut groups: HashMap<String, Vec<lang::Rule>> = HashMap::new();
+  // Groups rules by function name. A BTreeMap keeps the order of the groups,
+  // and so the names and ids of the split rules, the same on every run.
+  let mut groups: BTreeMap<String, Vec<lang::Rule>> = BTreeMap::new();
   for rule in rules {
     if let lang::Term::Ctr { ref name, .. } = *rule.lhs {
       if let Some(group) = groups.get_mut(name) {
@@ -8,17 +8,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 /*! GENERATED_PARALLEL_FLAG !*/
+/*! GENERATED_WIDE_FLAG !*/
+/*! GENERATED_TABLE_FLAG !*/
 
 #ifdef PARALLEL
 #include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #endif
 
 #define LIKELY(x) __builtin_expect((x), 1)
 #define UNLIKELY(x) __builtin_expect((x), 0)
+#define COLD __attribute__((noinline, cold))
+
+// Split builds compile the rules of each function in a unit of their own (see
+// compile_split in compiler.rs), made of this file up to GENERATED_UNIT_END,
+// with HVM_UNIT defined. There, the helpers rules call are LOCAL copies, so
+// that they can still be inlined, and the SHARED globals are the runtime's.
+#ifdef HVM_UNIT
+#define LOCAL static
+#define SHARED extern
+#else
+#define LOCAL
+#define SHARED
+#endif
 
 // Types
 // -----
@@ -26,6 +51,7 @@
 typedef uint8_t u8;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef int64_t i64;
 
 #ifdef PARALLEL
 typedef pthread_t Thd;
@@ -38,27 +64,89 @@ typedef pthread_t Thd;
 #define U64_PER_MB (0x20000)
 #define U64_PER_GB (0x8000000)
 
-// HVM pointers can address a 2^32 space of 64-bit elements, so, when the
-// program starts, we pre-alloc the maximum addressable heap, 32 GB. This will
-// be replaced by a proper arena allocator soon (see the Issues)!
+// HVM pointers can address a 2^32 space of 64-bit elements, or 2^40 with
+// WIDE_LNK. When the program starts, we reserve address space for a heap of
+// 8 GB (64 GB with WIDE_LNK), but memory is only committed as it's used, this
+// many words at a time.
+#ifndef HEAP_SIZE
+#ifdef WIDE_LNK
+#define HEAP_SIZE ((u64) 64 * U64_PER_GB * sizeof(u64))
+#else
 #define HEAP_SIZE (8 * U64_PER_GB * sizeof(u64))
+#endif
+#endif
+#define COMMIT_CHUNK (64 * U64_PER_MB)
+
+// When a worker takes a new chunk while holding at least this many free words,
+// it returns the pages entirely covered by its free blocks to the OS.
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (16 * U64_PER_MB)
+#endif
+#define PAGE_WORDS (0x200)
 
+// Marks the end of a free list
+#define FREE_NONE ((u64) -1)
+
+// The worker count defaults to the cores of the compiling machine, but can be
+// overridden when building the C file, e.g., `clang -DMAX_WORKERS=64 ...`.
 #ifdef PARALLEL
+#ifndef MAX_WORKERS
 #define MAX_WORKERS (/*! GENERATED_NUM_THREADS */ 1 /* GENERATED_NUM_THREADS !*/)
+#endif
 #else
+#undef MAX_WORKERS
 #define MAX_WORKERS (1)
 #endif
 
 #define MAX_DYNFUNS (65536)
 #define MAX_ARITY (16)
 
-// Each worker has a fraction of the total.
-#define MEM_SPACE (HEAP_SIZE/sizeof(u64)/MAX_WORKERS)
+// Workers share the heap, taking chunks of this many words at a time from it
+#define ALLOC_CHUNK (U64_PER_MB)
 #define NORMAL_SEEN_MCAP (HEAP_SIZE/sizeof(u64)/(sizeof(u64)*8))
 
 // Max different colors we're able to readback
 #define DIRS_MCAP (0x10000)
 
+// Max entries of each worker's reduction stack. Its address space is reserved
+// once, and pages are only committed as deep terms touch them. Override with
+// `-DREDUCE_STACK_MCAP=...` if a program overflows it.
+#ifndef REDUCE_STACK_MCAP
+#define REDUCE_STACK_MCAP (0x4000000)
+#endif
+
+// Capacity of each worker's task deque. If it is full, tasks run inline.
+#define DEQ_MCAP (0x10000)
+
+// How many times a waiting thread polls before yielding, and how many times it
+// yields before parking. Short waits never enter the kernel. When there are more
+// workers than cores, waiting threads don't poll, since they would only hold the
+// core that the thread they wait for needs (see workers_start()).
+#define SPIN_LIMIT (0x400)
+#define YIELD_LIMIT (0x10)
+
+// How many leaves the first normal() pass may split numeric trees into, per
+// worker. More leaves give idle workers more tasks to steal.
+#define NORMAL_SPLIT_FACTOR (8)
+
+// The kinds of rewrites. Built with `-DPROFILE`, workers count the rewrites of
+// each kind, and of each rule of each function, as well as their allocations of
+// each size, for prof_report().
+#define PROF_CAL_RULE  (0x0)
+#define PROF_CAL_PAR   (0x1)
+#define PROF_APP_LAM   (0x2)
+#define PROF_APP_PAR   (0x3)
+#define PROF_DUP_LAM   (0x4)
+#define PROF_DUP_PAR   (0x5)
+#define PROF_DUP_SUP   (0x6)
+#define PROF_DUP_NUM   (0x7)
+#define PROF_DUP_CTR   (0x8)
+#define PROF_OP2_U32   (0x9)
+#define PROF_OP2_NUM   (0xA)
+#define PROF_OP2_SUP_0 (0xB)
+#define PROF_OP2_SUP_1 (0xC)
+#define PROF_KINDS     (0xD)
+
 // Terms
 // -----
 // HVM's runtime stores terms in a 64-bit memory. Each element is a Link, which
@@ -66,14 +154,37 @@ typedef pthread_t Thd;
 // variant, and possibly a position on the memory. So, for example, `Lnk ptr =
 // APP * TAG | 137` creates a pointer to an app node stored on position 137.
 // Some links deal with variables: DP0, DP1, VAR, ARG and ERA.  The OP2 link
-// represents a numeric operation, and U32 and F32 links represent unboxed nums.
+// represents a numeric operation, and U32, F32 and U60 links represent unboxed
+// numbers. A U60 uses all the 60 bits below the tag.
+//
+// By default, a Link has a 4-bit tag, a 4-bit arity, a 24-bit ext (constructor
+// id, dup color or operator) and a 32-bit val (position or number). With
+// WIDE_LNK (`hvm c --wide`), ext shrinks to 16 bits and val grows to 40 bits,
+// so heaps can grow past 2^32 words, at the cost of fewer dup colors.
 
 typedef u64 Lnk;
 
 #define VAL ((u64) 1)
+#ifdef WIDE_LNK
+#define EXT ((u64) 0x10000000000)
+#define EXT_MASK ((u64) 0xFFFF)
+#define VAL_MASK ((u64) 0xFFFFFFFFFF)
+#else
 #define EXT ((u64) 0x100000000)
+#define EXT_MASK ((u64) 0xFFFFFF)
+#define VAL_MASK ((u64) 0xFFFFFFFF)
+#endif
 #define ARI ((u64) 0x100000000000000)
 #define TAG ((u64) 0x1000000000000000)
+#define NUM_MASK ((u64) 0xFFFFFFFFFFFFFFF)
+
+// reduce() marks stack entries that must be reduced (rather than rewritten)
+// with this bit, which no heap position uses
+#define REDUCE_INIT ((u64) 0x8000000000000000)
+
+// Returned by a function's rules, when compiled to their own C functions, if
+// they didn't rewrite the term. Otherwise, they return a stack entry to visit.
+#define REDUCE_STOP ((u64) -1)
 
 #define DP0 (0x0) // points to the dup node that binds this variable (left side)
 #define DP1 (0x1) // points to the dup node that binds this variable (right side)
@@ -88,6 +199,7 @@ typedef u64 Lnk;
 #define OP2 (0xA) // arity = 2
 #define U32 (0xB) // arity = 0 (unboxed)
 #define F32 (0xC) // arity = 0 (unboxed)
+#define U60 (0xD) // arity = 0 (unboxed)
 #define NIL (0xF) // not used
 
 #define ADD (0x0)
@@ -129,22 +241,46 @@ typedef struct {
   u64  mcap;
 } Stk;
 
+typedef struct {
+  u64* keys;
+  u64* vals;
+  u64  size;
+  u64  mcap;
+} Map;
+
+#ifdef PARALLEL
+typedef struct {
+  _Atomic(i64)  top;
+  _Atomic(i64)  bot;
+  _Atomic(u64)* data;
+} Deq;
+#endif
+
 typedef struct {
   u64  tid;
   Lnk* node;
   u64  size;
-  Stk  free[MAX_ARITY];
+  u64  next;
+  u64  last;
+  u64  trim;
+  u64  zero;
+  u64  free[MAX_ARITY];
+  u64  freed;
   u64  cost;
+  Stk  stack;
 
-  #ifdef PARALLEL
-  u64             has_work;
-  pthread_mutex_t has_work_mutex;
-  pthread_cond_t  has_work_signal;
+  #ifdef PROFILE
+  u64  prof_kind[PROF_KINDS];
+  u64  prof_alloc[MAX_ARITY];
+  u64  prof_reuse[MAX_ARITY];
+  Map  prof_rule;
+  #endif
 
-  u64             has_result;
-  pthread_mutex_t has_result_mutex;
-  pthread_cond_t  has_result_signal;
+  #ifdef PARALLEL
+  _Atomic(u32) has_work;
+  _Atomic(u32) has_result;
 
+  Deq  deque;
   Thd  thread;
   #endif
 } Worker;
@@ -152,17 +288,30 @@ typedef struct {
 // Globals
 // -------
 
-Worker workers[MAX_WORKERS];
+SHARED Worker workers[MAX_WORKERS];
+
+// The shared heap, how many words of it were taken by workers so far, and how
+// many are committed. Growing the committed part is guarded by `heap_lock`.
+SHARED Lnk* heap_node;
+SHARED u64  heap_used;
+SHARED u64  heap_done;
+SHARED u8   heap_lock;
+
+// The bitmap of heap locations normal() already visited, reserved alongside
+// the heap, and how many heap words were in use when its last pass ended. Only
+// the bits of those words can be set, so only they are cleared between passes.
+SHARED u64* normal_seen_data;
+SHARED u64  normal_seen_used;
 
 // Array
 // -----
 // Some array utils
 
-void array_write(Arr* arr, u64 idx, u64 value) {
+LOCAL void array_write(Arr* arr, u64 idx, u64 value) {
   arr->data[idx] = value;
 }
 
-u64 array_read(Arr* arr, u64 idx) {
+LOCAL u64 array_read(Arr* arr, u64 idx) {
   return arr->data[idx];
 }
 
@@ -170,28 +319,39 @@ u64 array_read(Arr* arr, u64 idx) {
 // -----
 // Some stack utils.
 
+#ifdef HVM_UNIT
+extern u64 stk_growth_factor;
+#else
 u64 stk_growth_factor = 16;
+#endif
 
-void stk_init(Stk* stack) {
+// How many times a stack buffer was malloc'd or realloc'd. Only reported with
+// `-DALLOC_STATS`.
+SHARED u64 stk_allocs;
+
+LOCAL void stk_init(Stk* stack) {
   stack->size = 0;
   stack->mcap = stk_growth_factor;
   stack->data = malloc(stack->mcap * sizeof(u64));
   assert(stack->data);
+  __atomic_fetch_add(&stk_allocs, 1, __ATOMIC_RELAXED);
 }
 
-void stk_free(Stk* stack) {
+LOCAL void stk_free(Stk* stack) {
   free(stack->data);
 }
 
-void stk_push(Stk* stack, u64 val) {
+LOCAL void stk_push(Stk* stack, u64 val) {
   if (UNLIKELY(stack->size == stack->mcap)) {
     stack->mcap = stack->mcap * stk_growth_factor;
     stack->data = realloc(stack->data, stack->mcap * sizeof(u64));
+    assert(stack->data);
+    __atomic_fetch_add(&stk_allocs, 1, __ATOMIC_RELAXED);
   }
   stack->data[stack->size++] = val;
 }
 
-u64 stk_pop(Stk* stack) {
+LOCAL u64 stk_pop(Stk* stack) {
   if (LIKELY(stack->size > 0)) {
     // TODO: shrink? -- impacts performance considerably
     //if (stack->size == stack->mcap / stk_growth_factor) {
@@ -205,7 +365,7 @@ u64 stk_pop(Stk* stack) {
   }
 }
 
-u64 stk_find(Stk* stk, u64 val) {
+LOCAL u64 stk_find(Stk* stk, u64 val) {
   for (u64 i = 0; i < stk->size; ++i) {
     if (stk->data[i] == val) {
       return i;
@@ -214,126 +374,569 @@ u64 stk_find(Stk* stk, u64 val) {
   return -1;
 }
 
+#ifndef HVM_UNIT
+
+// Map
+// ---
+// A hash map from u64 to u64, with open addressing and linear probing. Its
+// capacity is a power of two, and it grows when half full.
+
+#define MAP_NONE ((u64) -1) // marks empty slots, so it can't be used as a key
+
+LOCAL void map_init(Map* map) {
+  map->size = 0;
+  map->mcap = 16;
+  map->keys = malloc(map->mcap * sizeof(u64));
+  map->vals = malloc(map->mcap * sizeof(u64));
+  assert(map->keys && map->vals);
+  memset(map->keys, 0xFF, map->mcap * sizeof(u64));
+}
+
+LOCAL void map_free(Map* map) {
+  free(map->keys);
+  free(map->vals);
+}
+
+LOCAL u64 map_slot(Map* map, u64 key) {
+  u64 hash = key * 0x9E3779B97F4A7C15;
+  u64 slot = (hash ^ (hash >> 32)) & (map->mcap - 1);
+  while (map->keys[slot] != MAP_NONE && map->keys[slot] != key) {
+    slot = (slot + 1) & (map->mcap - 1);
+  }
+  return slot;
+}
+
+// Returns the value of `key`, or -1 if it isn't set
+LOCAL u64 map_get(Map* map, u64 key) {
+  u64 slot = map_slot(map, key);
+  return map->keys[slot] == key ? map->vals[slot] : -1;
+}
+
+LOCAL void map_set(Map* map, u64 key, u64 val) {
+  if (UNLIKELY(map->size * 2 >= map->mcap)) {
+    Map old = *map;
+    map->size = 0;
+    map->mcap = old.mcap * 2;
+    map->keys = malloc(map->mcap * sizeof(u64));
+    map->vals = malloc(map->mcap * sizeof(u64));
+    assert(map->keys && map->vals);
+    memset(map->keys, 0xFF, map->mcap * sizeof(u64));
+    for (u64 i = 0; i < old.mcap; ++i) {
+      if (old.keys[i] != MAP_NONE) {
+        map_set(map, old.keys[i], old.vals[i]);
+      }
+    }
+    map_free(&old);
+  }
+  u64 slot = map_slot(map, key);
+  if (map->keys[slot] == MAP_NONE) {
+    map->keys[slot] = key;
+    map->size++;
+  }
+  map->vals[slot] = val;
+}
+
+#endif // HVM_UNIT
+
+// Deque
+// -----
+// A Chase-Lev work-stealing deque of normalization tasks. The owner pushes and
+// takes from the bottom; idle workers steal from the top. Based on "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (Lê et al., 2013).
+
+#if defined(PARALLEL) && !defined(HVM_UNIT)
+
+LOCAL void deq_init(Deq* deq) {
+  atomic_init(&deq->top, 0);
+  atomic_init(&deq->bot, 0);
+  deq->data = malloc(DEQ_MCAP * sizeof(_Atomic(u64)));
+  assert(deq->data);
+}
+
+LOCAL void deq_free(Deq* deq) {
+  free(deq->data);
+}
+
+// Pushes a task. Returns 0 if the deque is full. Owner only.
+LOCAL u8 deq_push(Deq* deq, u64 task) {
+  i64 b = atomic_load_explicit(&deq->bot, memory_order_relaxed);
+  i64 t = atomic_load_explicit(&deq->top, memory_order_acquire);
+  if (UNLIKELY(b - t >= DEQ_MCAP)) {
+    return 0;
+  }
+  atomic_store_explicit(&deq->data[b % DEQ_MCAP], task, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deq->bot, b + 1, memory_order_relaxed);
+  return 1;
+}
+
+// Takes the most recently pushed task, or -1 if empty. Owner only.
+LOCAL u64 deq_take(Deq* deq) {
+  i64 b = atomic_load_explicit(&deq->bot, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deq->bot, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  i64 t = atomic_load_explicit(&deq->top, memory_order_relaxed);
+  if (t > b) {
+    atomic_store_explicit(&deq->bot, b + 1, memory_order_relaxed);
+    return -1;
+  }
+  u64 task = atomic_load_explicit(&deq->data[b % DEQ_MCAP], memory_order_relaxed);
+  if (t == b) {
+    if (!atomic_compare_exchange_strong_explicit(&deq->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+      task = -1;
+    }
+    atomic_store_explicit(&deq->bot, b + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+// Steals the oldest task, or -1 if empty or if another thief won the race.
+LOCAL u64 deq_steal(Deq* deq) {
+  i64 t = atomic_load_explicit(&deq->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  i64 b = atomic_load_explicit(&deq->bot, memory_order_acquire);
+  if (t >= b) {
+    return -1;
+  }
+  u64 task = atomic_load_explicit(&deq->data[t % DEQ_MCAP], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deq->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return -1;
+  }
+  return task;
+}
+
+#endif
+
+// Mailbox
+// -------
+// Atomic message slots with a single sender and a single receiver, used to
+// hand work to the worker threads and to get their results back. A receiver
+// spins, then yields, and only parks (on a futex, on Linux) after a while.
+
+#if defined(PARALLEL) && !defined(HVM_UNIT)
+
+#define MAIL_NONE (0) // the slot is empty
+#define MAIL_PARK (1) // the slot is empty, and its receiver is parked
+#define MAIL_WORK (2) // has_work: help with the current normal() pass
+#define MAIL_STOP (3) // has_work: stop the thread
+#define MAIL_DONE (4) // has_result: done with the current normal() pass
+#define MAIL_BATCH (5) // has_work: normalize calls of the current batch
+
+u64 spin_limit = SPIN_LIMIT;
+
+LOCAL void cpu_relax(void) {
+  #if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+  #elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+  #endif
+}
+
+// Sleeps until the slot stops holding `val`. May return spuriously.
+LOCAL void park(_Atomic(u32)* slot, u32 val) {
+  #ifdef __linux__
+  syscall(SYS_futex, slot, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+  #else
+  struct timespec nap = {0, 50000};
+  nanosleep(&nap, NULL);
+  #endif
+}
+
+LOCAL void unpark(_Atomic(u32)* slot) {
+  #ifdef __linux__
+  syscall(SYS_futex, slot, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  #endif
+}
+
+// Sends a message. Only enters the kernel if the receiver is parked.
+LOCAL void mail_send(_Atomic(u32)* slot, u32 msg) {
+  if (atomic_exchange(slot, msg) == MAIL_PARK) {
+    unpark(slot);
+  }
+}
+
+// Waits for a message and takes it
+LOCAL u32 mail_recv(_Atomic(u32)* slot) {
+  for (u64 tick = 0; ; ++tick) {
+    u32 msg = atomic_load(slot);
+    if (msg > MAIL_PARK) {
+      atomic_store(slot, MAIL_NONE);
+      return msg;
+    }
+    if (tick < spin_limit) {
+      cpu_relax();
+    } else if (tick < spin_limit + YIELD_LIMIT) {
+      sched_yield();
+    } else {
+      u32 none = MAIL_NONE;
+      if (atomic_compare_exchange_strong(slot, &none, MAIL_PARK) || none == MAIL_PARK) {
+        park(slot, MAIL_PARK);
+      }
+    }
+  }
+}
+
+#endif
+
 // Memory
 // ------
 // Creating, storing and reading Lnks, allocating and freeing memory.
 
-Lnk Var(u64 pos) {
+LOCAL Lnk Var(u64 pos) {
   return (VAR * TAG) | pos;
 }
 
-Lnk Dp0(u64 col, u64 pos) {
+LOCAL Lnk Dp0(u64 col, u64 pos) {
   return (DP0 * TAG) | (col * EXT) | pos;
 }
 
-Lnk Dp1(u64 col, u64 pos) {
+LOCAL Lnk Dp1(u64 col, u64 pos) {
   return (DP1 * TAG) | (col * EXT) | pos;
 }
 
-Lnk Arg(u64 pos) {
+LOCAL Lnk Arg(u64 pos) {
   return (ARG * TAG) | pos;
 }
 
-Lnk Era(void) {
+LOCAL Lnk Era(void) {
   return (ERA * TAG);
 }
 
-Lnk Lam(u64 pos) {
+LOCAL Lnk Lam(u64 pos) {
   return (LAM * TAG) | pos;
 }
 
-Lnk App(u64 pos) {
+LOCAL Lnk App(u64 pos) {
   return (APP * TAG) | pos;
 }
 
-Lnk Par(u64 col, u64 pos) {
+LOCAL Lnk Par(u64 col, u64 pos) {
   return (PAR * TAG) | (col * EXT) | pos;
 }
 
-Lnk Op2(u64 ope, u64 pos) {
+LOCAL Lnk Op2(u64 ope, u64 pos) {
   return (OP2 * TAG) | (ope * EXT) | pos;
 }
 
-Lnk U_32(u64 val) {
-  return (U32 * TAG) | val;
+LOCAL Lnk U_32(u64 val) {
+  return (U32 * TAG) | (val & 0xFFFFFFFF);
+}
+
+LOCAL Lnk F_32(float val) {
+  u32 bits;
+  memcpy(&bits, &val, sizeof(bits));
+  return (F32 * TAG) | bits;
+}
+
+LOCAL Lnk U_60(u64 val) {
+  return (U60 * TAG) | (val & NUM_MASK);
 }
 
-Lnk Nil(void) {
+LOCAL Lnk Nil(void) {
   return NIL * TAG;
 }
 
-Lnk Ctr(u64 ari, u64 fun, u64 pos) {
+LOCAL Lnk Ctr(u64 ari, u64 fun, u64 pos) {
   return (CTR * TAG) | (ari * ARI) | (fun * EXT) | pos;
 }
 
-Lnk Cal(u64 ari, u64 fun, u64 pos) {
+LOCAL Lnk Cal(u64 ari, u64 fun, u64 pos) {
   return (CAL * TAG) | (ari * ARI) | (fun * EXT) | pos;
 }
 
-u64 get_tag(Lnk lnk) {
+LOCAL u64 get_tag(Lnk lnk) {
   return lnk / TAG;
 }
 
-u64 get_ext(Lnk lnk) {
-  return (lnk / EXT) & 0xFFFFFF;
+LOCAL u64 get_ext(Lnk lnk) {
+  return (lnk / EXT) & EXT_MASK;
 }
 
-u64 get_val(Lnk lnk) {
-  return lnk & 0xFFFFFFFF;
+LOCAL u64 get_val(Lnk lnk) {
+  return lnk & VAL_MASK;
 }
 
-u64 get_ari(Lnk lnk) {
+LOCAL u64 get_ari(Lnk lnk) {
   return (lnk / ARI) & 0xF;
 }
 
-u64 get_loc(Lnk lnk, u64 arg) {
+LOCAL u64 get_loc(Lnk lnk, u64 arg) {
   return get_val(lnk) + arg;
 }
 
+LOCAL u64 get_num(Lnk lnk) {
+  return lnk & NUM_MASK;
+}
+
+LOCAL float get_f32(Lnk lnk) {
+  u32 bits = (u32) lnk;
+  float val;
+  memcpy(&val, &bits, sizeof(val));
+  return val;
+}
+
+// U32, F32 and U60 are consecutive tags
+LOCAL u8 is_num(Lnk lnk) {
+  return get_tag(lnk) - U32 <= U60 - U32;
+}
+
 // Dereferences a Lnk, getting what is stored on its target position
-Lnk ask_lnk(Worker* mem, u64 loc) {
+LOCAL Lnk ask_lnk(Worker* mem, u64 loc) {
   return mem->node[loc];
 }
 
 // Dereferences the nth argument of the Term represented by this Lnk
-Lnk ask_arg(Worker* mem, Lnk term, u64 arg) {
+LOCAL Lnk ask_arg(Worker* mem, Lnk term, u64 arg) {
   return ask_lnk(mem, get_loc(term, arg));
 }
 
+// Dup nodes are locked while their expression is reduced, by setting this bit
+// of their first word, which otherwise only holds an ARG or ERA back-pointer,
+// and thus never has an arity.
+#define DUP_LOCK (ARI * 0x8)
+
+// Tries to lock the dup node at `loc`. Returns 1 if it was taken. The word may
+// have been rewritten, freed and reused since the caller read its DP0/DP1, so
+// this is a CAS that only sets the bit on an unlocked ARG or ERA word, never a
+// blind RMW that could flip a bit of whatever a new owner stored there.
+LOCAL u8 dup_lock(Worker* mem, u64 loc) {
+  u64 old = __atomic_load_n(&mem->node[loc], __ATOMIC_RELAXED);
+  while ((get_tag(old) == ARG || get_tag(old) == ERA) && !(old & DUP_LOCK)) {
+    if (__atomic_compare_exchange_n(&mem->node[loc], &old, old | DUP_LOCK, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Releases the lock taken by dup_lock(). Likewise, only clears the bit of a
+// locked ARG or ERA word.
+LOCAL void dup_unlock(Worker* mem, u64 loc) {
+  u64 old = __atomic_load_n(&mem->node[loc], __ATOMIC_RELAXED);
+  while ((get_tag(old) == ARG || get_tag(old) == ERA) && (old & DUP_LOCK)) {
+    if (__atomic_compare_exchange_n(&mem->node[loc], &old, old & ~DUP_LOCK, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+}
+
+// Writes a back-pointer on the first word of a dup node. With threads, this is
+// a CAS that keeps the lock bit, since another worker may be holding it. Only
+// ARG and ERA words carry a lock; other bits are leftovers of a freed node.
+LOCAL void link_dup(Worker* mem, u64 loc, Lnk lnk) {
+  #ifdef PARALLEL
+  u64 old = __atomic_load_n(&mem->node[loc], __ATOMIC_RELAXED);
+  while (1) {
+    u64 keep = get_tag(old) == ARG || get_tag(old) == ERA ? old & DUP_LOCK : 0;
+    if (__atomic_compare_exchange_n(&mem->node[loc], &old, lnk | keep, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+  #else
+  mem->node[loc] = lnk;
+  #endif
+}
+
 // This inserts a value in another. It just writes a position in memory if
 // `value` is a constructor. If it is VAR, DP0 or DP1, it also updates the
-// corresponding λ or dup binder.
-u64 link(Worker* mem, u64 loc, Lnk lnk) {
+// corresponding λ or dup binder. (Not named `link`, which unistd.h declares.)
+LOCAL u64 link_lnk(Worker* mem, u64 loc, Lnk lnk) {
   mem->node[loc] = lnk;
   //array_write(mem->nodes, loc, lnk);
-  if (get_tag(lnk) <= VAR) {
+  if (get_tag(lnk) == DP0) {
+    link_dup(mem, get_loc(lnk, 0), Arg(loc));
+  } else if (get_tag(lnk) <= VAR) {
     mem->node[get_loc(lnk, get_tag(lnk) == DP1 ? 1 : 0)] = Arg(loc);
     //array_write(mem->nodes, get_loc(lnk, get_tag(lnk) == DP1 ? 1 : 0), Arg(loc));
   }
   return lnk;
 }
 
-// Allocates a block of memory, up to 16 words long
-u64 alloc(Worker* mem, u64 size) {
+#ifndef HVM_UNIT
+
+// Reserves address space for the heap, without committing any memory
+Lnk* heap_alloc(void) {
+  heap_node = mmap(NULL, HEAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(heap_node != MAP_FAILED);
+  heap_used = 0;
+  heap_done = 0;
+  heap_lock = 0;
+  normal_seen_data = mmap(NULL, NORMAL_SEEN_MCAP * sizeof(u64), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(normal_seen_data != MAP_FAILED);
+  normal_seen_used = 0;
+  return heap_node;
+}
+
+void heap_free(void) {
+  munmap(heap_node, HEAP_SIZE);
+  munmap(normal_seen_data, NORMAL_SEEN_MCAP * sizeof(u64));
+}
+
+#endif // HVM_UNIT
+
+// Makes sure the first `size` words of the heap are committed
+LOCAL void heap_commit(u64 size) {
+  if (LIKELY(__atomic_load_n(&heap_done, __ATOMIC_ACQUIRE) >= size)) {
+    return;
+  }
+  while (__atomic_test_and_set(&heap_lock, __ATOMIC_ACQUIRE)) {}
+  u64 done = heap_done;
+  if (done < size) {
+    u64 goal = (size + COMMIT_CHUNK - 1) / COMMIT_CHUNK * COMMIT_CHUNK;
+    if (goal > HEAP_SIZE / sizeof(u64)) {
+      goal = HEAP_SIZE / sizeof(u64);
+    }
+    if (mprotect(heap_node + done, (goal - done) * sizeof(u64), PROT_READ | PROT_WRITE) != 0) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(1);
+    }
+    __atomic_store_n(&heap_done, goal, __ATOMIC_RELEASE);
+  }
+  __atomic_clear(&heap_lock, __ATOMIC_RELEASE);
+}
+
+// Takes `size` fresh words from the shared heap
+LOCAL u64 heap_take(u64 size) {
+  u64 loc = __atomic_fetch_add(&heap_used, size, __ATOMIC_RELAXED);
+  if (UNLIKELY(loc + size > HEAP_SIZE / sizeof(u64))) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  heap_commit(loc + size);
+  return loc;
+}
+
+#ifndef HVM_UNIT
+
+// Reserves a worker's reduction stack. Like the heap, it is never reallocated.
+void reduce_stack_alloc(Stk* stack) {
+  stack->size = 0;
+  stack->mcap = REDUCE_STACK_MCAP;
+  stack->data = mmap(NULL, REDUCE_STACK_MCAP * sizeof(u64), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(stack->data != MAP_FAILED);
+}
+
+void reduce_stack_free(Stk* stack) {
+  munmap(stack->data, REDUCE_STACK_MCAP * sizeof(u64));
+}
+
+#endif // HVM_UNIT
+
+// Pushes to a reduction stack. Running out of it is a fatal error: the stack is
+// as deep as the term being reduced, so growing it past the limit would only
+// delay the failure.
+LOCAL void reduce_push(Stk* stack, u64 val) {
+  if (UNLIKELY(stack->size == stack->mcap)) {
+    fprintf(stderr, "Reduction stack overflow (%"PRIu64" entries). Rebuild with a larger -DREDUCE_STACK_MCAP.\n", stack->mcap);
+    exit(1);
+  }
+  stack->data[stack->size++] = val;
+}
+
+// Frees a block of memory by pushing it to the free list of its size. Since
+// this overwrites its last word, the block must not be read afterwards.
+LOCAL void clear(Worker* mem, u64 loc, u64 size) {
+  if (UNLIKELY(size == 0)) {
+    return;
+  }
+  mem->node[loc + size - 1] = mem->free[size];
+  mem->free[size] = loc;
+  mem->freed += size;
+}
+
+LOCAL int heap_trim_cmp(const void* a, const void* b) {
+  u64 x = *(const u64*)a;
+  u64 y = *(const u64*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Returns the pages covered by runs of this worker's free blocks to the OS.
+// Since the OS zeroes them, the blocks of such a run can't stay on the free
+// lists: the whole run becomes a range for alloc() to bump through, as it does
+// with a fresh chunk. Ranges are listed by their first two words, which hold
+// their end and the next range, so the pages returned start past them. The
+// blocks of the other runs are put back on their free lists in address order.
+// The words of a range are counted in `size` again as they are bumped, so they
+// are uncounted here; a worker's count may then wrap, but the total can't.
+LOCAL void heap_trim(Worker* mem) {
+  Stk blocks;
+  stk_init(&blocks);
+  for (u64 size = 1; size < MAX_ARITY; ++size) {
+    for (u64 loc = mem->free[size]; loc != FREE_NONE; loc = mem->node[loc + size - 1]) {
+      stk_push(&blocks, (loc << 4) | size);
+    }
+    mem->free[size] = FREE_NONE;
+  }
+  qsort(blocks.data, blocks.size, sizeof(u64), heap_trim_cmp);
+  mem->freed = 0;
+  for (u64 i = blocks.size; i > 0;) {
+    u64 end = (blocks.data[i - 1] >> 4) + (blocks.data[i - 1] & 0xF);
+    u64 ini = end;
+    u64 run = i;
+    while (i > 0 && (blocks.data[i - 1] >> 4) + (blocks.data[i - 1] & 0xF) == ini) {
+      ini = blocks.data[--i] >> 4;
+    }
+    u64 page_ini = (ini + 2 + PAGE_WORDS - 1) / PAGE_WORDS * PAGE_WORDS;
+    u64 page_end = end / PAGE_WORDS * PAGE_WORDS;
+    if (page_ini < page_end) {
+      madvise(mem->node + page_ini, (page_end - page_ini) * sizeof(u64), MADV_DONTNEED);
+      mem->node[ini + 0] = end;
+      mem->node[ini + 1] = mem->zero;
+      mem->zero = ini;
+      mem->size -= end - ini;
+      continue;
+    }
+    for (u64 j = run; j > i; --j) {
+      clear(mem, blocks.data[j - 1] >> 4, blocks.data[j - 1] & 0xF);
+    }
+  }
+  stk_free(&blocks);
+  mem->trim = mem->freed;
+}
+
+// Allocates a block of memory, up to 16 words long. Each size has a free list,
+// threaded through the last word of the freed blocks themselves. If it's empty,
+// it bumps a pointer on the worker's chunk of the heap. When that runs out, the
+// next chunk is a range given back by heap_trim(), if any; only otherwise does
+// it synchronize with other workers to take a new one.
+LOCAL u64 alloc(Worker* mem, u64 size) {
   if (UNLIKELY(size == 0)) {
     return 0;
   } else {
-    u64 reuse = stk_pop(&mem->free[size]);
-    if (reuse != -1) {
+    #ifdef PROFILE
+    mem->prof_alloc[size]++;
+    #endif
+    u64 reuse = mem->free[size];
+    if (reuse != FREE_NONE) {
+      #ifdef PROFILE
+      mem->prof_reuse[size]++;
+      #endif
+      mem->free[size] = mem->node[reuse + size - 1];
+      mem->freed -= size;
       return reuse;
     }
-    u64 loc = mem->size;
+    if (UNLIKELY(mem->next + size > mem->last)) {
+      if (mem->freed >= TRIM_THRESHOLD && mem->freed >= 2 * mem->trim) {
+        heap_trim(mem);
+      }
+      u64 zero = mem->zero;
+      if (zero != FREE_NONE && zero + size <= mem->node[zero]) {
+        mem->zero = mem->node[zero + 1];
+        mem->next = zero;
+        mem->last = mem->node[zero];
+      } else {
+        u64 len = size > ALLOC_CHUNK ? size : ALLOC_CHUNK;
+        mem->next = heap_take(len);
+        mem->last = mem->next + len;
+      }
+    }
+    u64 loc = mem->next;
+    mem->next += size;
     mem->size += size;
-    return mem->tid * MEM_SPACE + loc;
-    //return __atomic_fetch_add(&mem->nodes->size, size, __ATOMIC_RELAXED);
+    return loc;
   }
 }
 
-// Frees a block of memory by adding its position a freelist
-void clear(Worker* mem, u64 loc, u64 size) {
-  stk_push(&mem->free[size], loc);
-}
-
 // Garbage Collection
 // ------------------
 
@@ -344,57 +947,66 @@ void clear(Worker* mem, u64 loc, u64 size) {
 // mostly irrelevant in practice. Absolute GC-freedom, though, requires
 // uncommenting the `reduce` lines below, but this would make HVM not 100% lazy
 // in some cases, so it should be called in a separate thread.
-void collect(Worker* mem, Lnk term) {
-  switch (get_tag(term)) {
-    case DP0: {
-      link(mem, get_loc(term,0), Era());
-      //reduce(mem, get_loc(ask_arg(mem,term,1),0));
-      break;
-    }
-    case DP1: {
-      link(mem, get_loc(term,1), Era());
-      //reduce(mem, get_loc(ask_arg(mem,term,0),0));
-      break;
-    }
-    case VAR: {
-      link(mem, get_loc(term,0), Era());
-      break;
-    }
-    case LAM: {
-      if (get_tag(ask_arg(mem,term,0)) != ERA) {
-        link(mem, get_loc(ask_arg(mem,term,0),0), Era());
+LOCAL void collect(Worker* mem, Lnk term) {
+  Stk* stack = &mem->stack;
+  u64  base  = stack->size;
+  reduce_push(stack, term);
+  while (stack->size > base) {
+    term = stack->data[--stack->size];
+    switch (get_tag(term)) {
+      case DP0: {
+        link_dup(mem, get_loc(term,0), Era());
+        //reduce(mem, get_loc(ask_arg(mem,term,1),0));
+        break;
       }
-      collect(mem, ask_arg(mem,term,1));
-      clear(mem, get_loc(term,0), 2);
-      break;
-    }
-    case APP: {
-      collect(mem, ask_arg(mem,term,0));
-      collect(mem, ask_arg(mem,term,1));
-      clear(mem, get_loc(term,0), 2);
-      break;
-    }
-    case PAR: {
-      collect(mem, ask_arg(mem,term,0));
-      collect(mem, ask_arg(mem,term,1));
-      clear(mem, get_loc(term,0), 2);
-      break;
-    }
-    case OP2: {
-      collect(mem, ask_arg(mem,term,0));
-      collect(mem, ask_arg(mem,term,1));
-      break;
-    }
-    case U32: {
-      break;
-    }
-    case CTR: case CAL: {
-      u64 arity = get_ari(term);
-      for (u64 i = 0; i < arity; ++i) {
-        collect(mem, ask_arg(mem,term,i));
+      case DP1: {
+        link_lnk(mem, get_loc(term,1), Era());
+        //reduce(mem, get_loc(ask_arg(mem,term,0),0));
+        break;
+      }
+      case VAR: {
+        link_lnk(mem, get_loc(term,0), Era());
+        break;
+      }
+      // Nodes are cleared as soon as their arguments are on the stack. Erasing
+      // a variable later may still write to the first word of a cleared λ, but
+      // clear() only uses the last one, and nothing is allocated meanwhile.
+      case LAM: {
+        if (get_tag(ask_arg(mem,term,0)) != ERA) {
+          link_lnk(mem, get_loc(ask_arg(mem,term,0),0), Era());
+        }
+        reduce_push(stack, ask_arg(mem,term,1));
+        clear(mem, get_loc(term,0), 2);
+        break;
+      }
+      case APP: {
+        reduce_push(stack, ask_arg(mem,term,1));
+        reduce_push(stack, ask_arg(mem,term,0));
+        clear(mem, get_loc(term,0), 2);
+        break;
+      }
+      case PAR: {
+        reduce_push(stack, ask_arg(mem,term,1));
+        reduce_push(stack, ask_arg(mem,term,0));
+        clear(mem, get_loc(term,0), 2);
+        break;
+      }
+      case OP2: {
+        reduce_push(stack, ask_arg(mem,term,1));
+        reduce_push(stack, ask_arg(mem,term,0));
+        break;
+      }
+      case U32: case F32: case U60: {
+        break;
+      }
+      case CTR: case CAL: {
+        u64 arity = get_ari(term);
+        for (u64 i = arity; i > 0; --i) {
+          reduce_push(stack, ask_arg(mem,term,i-1));
+        }
+        clear(mem, get_loc(term,0), arity);
+        break;
       }
-      clear(mem, get_loc(term,0), arity);
-      break;
     }
   }
 }
@@ -402,16 +1014,37 @@ void collect(Worker* mem, Lnk term) {
 // Terms
 // -----
 
-void inc_cost(Worker* mem) {
+// Counts a rewrite. Only profiling builds keep track of its kind.
+LOCAL void inc_cost(Worker* mem, u64 kind) {
   mem->cost++;
+  #ifdef PROFILE
+  mem->prof_kind[kind]++;
+  #else
+  (void)kind;
+  #endif
+}
+
+#ifdef PROFILE
+void prof_rule(Worker* mem, u64 fun, u64 rule);
+#endif
+
+// A rewrite by the given rule (by its index in the function) of a function
+LOCAL void inc_rule(Worker* mem, u64 fun, u64 rule) {
+  inc_cost(mem, PROF_CAL_RULE);
+  #ifdef PROFILE
+  prof_rule(mem, fun, rule);
+  #else
+  (void)fun;
+  (void)rule;
+  #endif
 }
 
 // Performs a `x <- value` substitution. It just calls link if the substituted
 // value is a term. If it is an ERA node, that means `value` is now unreachable,
 // so we just call the collector.
-void subst(Worker* mem, Lnk lnk, Lnk val) {
+LOCAL void subst(Worker* mem, Lnk lnk, Lnk val) {
   if (get_tag(lnk) != ERA) {
-    link(mem, get_loc(lnk,0), val);
+    link_lnk(mem, get_loc(lnk,0), val);
   } else {
     collect(mem, val);
   }
@@ -423,8 +1056,8 @@ void subst(Worker* mem, Lnk lnk, Lnk val) {
 // dup c0 c1 = c
 // ...
 // {(F a0 b0 c0 ...) (F a1 b1 c1 ...)}
-Lnk cal_par(Worker* mem, u64 host, Lnk term, Lnk argn, u64 n) {
-  inc_cost(mem);
+LOCAL Lnk cal_par(Worker* mem, u64 host, Lnk term, Lnk argn, u64 n) {
+  inc_cost(mem, PROF_CAL_PAR);
   u64 arit = get_ari(term);
   u64 func = get_ext(term);
   u64 fun0 = get_loc(term, 0);
@@ -434,388 +1067,576 @@ Lnk cal_par(Worker* mem, u64 host, Lnk term, Lnk argn, u64 n) {
     if (i != n) {
       u64 leti = alloc(mem, 3);
       u64 argi = ask_arg(mem, term, i);
-      link(mem, fun0+i, Dp0(get_ext(argn), leti));
-      link(mem, fun1+i, Dp1(get_ext(argn), leti));
-      link(mem, leti+2, argi);
+      link_lnk(mem, fun0+i, Dp0(get_ext(argn), leti));
+      link_lnk(mem, fun1+i, Dp1(get_ext(argn), leti));
+      link_lnk(mem, leti+2, argi);
     } else {
-      link(mem, fun0+i, ask_arg(mem, argn, 0));
-      link(mem, fun1+i, ask_arg(mem, argn, 1));
+      link_lnk(mem, fun0+i, ask_arg(mem, argn, 0));
+      link_lnk(mem, fun1+i, ask_arg(mem, argn, 1));
     }
   }
-  link(mem, par0+0, Cal(arit, func, fun0));
-  link(mem, par0+1, Cal(arit, func, fun1));
+  link_lnk(mem, par0+0, Cal(arit, func, fun0));
+  link_lnk(mem, par0+1, Cal(arit, func, fun1));
   u64 done = Par(get_ext(argn), par0);
-  link(mem, host, done);
+  link_lnk(mem, host, done);
   return done;
 }
 
-// Reduces a term to weak head normal form.
-Lnk reduce(Worker* mem, u64 root, u64 slen) {
-  Stk stack;
-  stk_init(&stack);
+void reduce_strict(Worker* mem, Lnk term, u64* args, u64 size, u64 slen);
 
-  u64 init = 1;
-  u32 host = (u32)root;
+// The remainder of a / b, truncated towards zero, as C's fmodf() (which would
+// need libm). Doubling b up to a, then subtracting its halves, keeps every step
+// exact, since each subtracts a float between half and all of what's left.
+LOCAL float f32_mod(float a, float b) {
+  if (a != a || b != b || b == 0 || a - a != 0) {
+    return get_f32(0x7FC00000); // NaN, for NaN operands, a zero divisor or infinite a
+  }
+  float x = a < 0 ? -a : a;
+  float y = b < 0 ? -b : b;
+  if (x < y) {
+    return a;
+  }
+  float z = y;
+  while (z <= x / 2) {
+    z *= 2;
+  }
+  while (z >= y) {
+    if (x >= z) {
+      x -= z;
+    }
+    z /= 2;
+  }
+  return a < 0 ? -x : x;
+}
 
-  while (1) {
+// Converts an F32 to an integer for the bitwise operators, truncating and
+// saturating to the U32 range, as Rust's `as u32` does
+LOCAL u64 f32_to_u32(float val) {
+  return val > 0 ? (val < 4294967296.0f ? (u64) val : 0xFFFFFFFF) : 0;
+}
 
-    u64 term = ask_lnk(mem, host);
+// Applies a numeric operator to two unboxed numbers. U32 results wrap at 32
+// bits, and, when either operand is a U60, they're U60s, wrapping at 60 bits.
+// When either is an F32, both are taken as floats, except by the bitwise
+// operators, which truncate F32s to U32s. Comparisons always return a U32 0 or
+// 1, so rules can match on them. Kept out of reduce(), whose U32 case is hot.
+LOCAL COLD Lnk op2_num(u64 oper, Lnk arg0, Lnk arg1) {
+  if (get_tag(arg0) == F32 || get_tag(arg1) == F32) {
+    float a = get_tag(arg0) == F32 ? get_f32(arg0) : (float) get_num(arg0);
+    float b = get_tag(arg1) == F32 ? get_f32(arg1) : (float) get_num(arg1);
+    switch (oper) {
+      case ADD: return F_32(a + b);
+      case SUB: return F_32(a - b);
+      case MUL: return F_32(a * b);
+      case DIV: return F_32(a / b);
+      case MOD: return F_32(f32_mod(a, b));
+      case LTN: return U_32(a <  b ? 1 : 0);
+      case LTE: return U_32(a <= b ? 1 : 0);
+      case EQL: return U_32(a == b ? 1 : 0);
+      case GTE: return U_32(a >= b ? 1 : 0);
+      case GTN: return U_32(a >  b ? 1 : 0);
+      case NEQ: return U_32(a != b ? 1 : 0);
+    }
+  }
+  u64 a = get_tag(arg0) == F32 ? f32_to_u32(get_f32(arg0)) : get_num(arg0);
+  u64 b = get_tag(arg1) == F32 ? f32_to_u32(get_f32(arg1)) : get_num(arg1);
+  u64 c = 0;
+  switch (oper) {
+    case ADD: c = a +  b; break;
+    case SUB: c = a -  b; break;
+    case MUL: c = a *  b; break;
+    case DIV: c = a /  b; break;
+    case MOD: c = a %  b; break;
+    case AND: c = a &  b; break;
+    case OR : c = a |  b; break;
+    case XOR: c = a ^  b; break;
+    case SHL: c = a << (b & 63); break;
+    case SHR: c = a >> (b & 63); break;
+    case LTN: return U_32(a <  b ? 1 : 0);
+    case LTE: return U_32(a <= b ? 1 : 0);
+    case EQL: return U_32(a == b ? 1 : 0);
+    case GTE: return U_32(a >= b ? 1 : 0);
+    case GTN: return U_32(a >  b ? 1 : 0);
+    case NEQ: return U_32(a != b ? 1 : 0);
+  }
+  return get_tag(arg0) == U60 || get_tag(arg1) == U60 ? U_60(c) : U_32(c);
+}
 
-    //printf("reduce "); debug_print_lnk(term); printf("\n");
-    //printf("------\n");
-    //printf("reducing: host=%d size=%llu init=%llu ", host, stack.size, init); debug_print_lnk(term); printf("\n");
-    //for (u64 i = 0; i < 256; ++i) {
-      //printf("- %llx ", i); debug_print_lnk(mem->node[i]); printf("\n");
-    //}
+//GENERATED_UNIT_END//
 
-    if (init == 1) {
-      switch (get_tag(term)) {
-        case APP: {
-          stk_push(&stack, host);
+// With `hvm c --fn-table`, the rules of each function are compiled to a pair of
+// C functions, rather than to cases of the switches in reduce(). They are
+// called through tables indexed by function id, so reduce() stays small.
+#ifdef FN_TABLE
+typedef u64 (*Rules)(Worker* mem, Stk* stack, u64 base, u64 slen, u64 host, u64 init, Lnk term);
+
+/*! GENERATED_REWRITE_RULES_FUNCS !*/
+#endif
+
+// Each step of reduce() dispatches on the pair (init, tag) of the term at host.
+// With GCC or Clang, it jumps straight to the handler of that pair through a
+// table of label addresses, so there is one indirect branch per step, and no
+// bounds check. Build with -DNO_REDUCE_THREADED, or with other compilers, to
+// dispatch with a plain switch instead. Handlers are switch cases either way.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_REDUCE_THREADED)
+#define REDUCE_THREADED
+#define REDUCE_CASE(init, tag) case (init << 4) | tag: reduce_##init##_##tag
+#else
+#define REDUCE_CASE(init, tag) case (init << 4) | tag
+#endif
+
+#ifdef COMPACT
+// See Compaction, below
+void compact_check(Worker* mem, u64* root, u64* host);
+u64 compact_next;
+u64 compact_depth;
+#endif
+
+// Reduces a term to weak head normal form. Uses the worker's stack above its
+// current size, since reduce() is re-entered by strict argument reductions.
+Lnk reduce(Worker* mem, u64 root, u64 slen) {
+  Stk* stack = &mem->stack;
+  u64  base  = stack->size;
+
+  #ifdef REDUCE_THREADED
+  static void* const reduce_labels[32] = {
+    // init = 0, by tag: DP0 DP1 VAR ARG / ERA LAM APP PAR / CTR CAL OP2 U32 / F32 ...
+    &&reduce_0_DP0, &&reduce_0_DP1, &&reduce_next,  &&reduce_next,
+    &&reduce_next,  &&reduce_next,  &&reduce_0_APP, &&reduce_next,
+    &&reduce_next,  &&reduce_0_CAL, &&reduce_0_OP2, &&reduce_next,
+    &&reduce_next,  &&reduce_next,  &&reduce_next,  &&reduce_next,
+    // init = 1, same order
+    &&reduce_1_DP0, &&reduce_1_DP1, &&reduce_next,  &&reduce_next,
+    &&reduce_next,  &&reduce_next,  &&reduce_1_APP, &&reduce_next,
+    &&reduce_next,  &&reduce_1_CAL, &&reduce_1_OP2, &&reduce_next,
+    &&reduce_next,  &&reduce_next,  &&reduce_next,  &&reduce_next,
+  };
+  #endif
+
+  u64 init = 1;
+  u64 host = root;
+
+  #ifdef COMPACT
+  compact_depth++;
+  #endif
+
+  while (1) {
+
+    // Between steps, the only heap locations this reduction holds are `root`,
+    // `host` and those on the stack, so the heap may be compacted here
+    #ifdef COMPACT
+    if (UNLIKELY(mem->cost >= compact_next)) {
+      compact_check(mem, &root, &host);
+    }
+    #endif
+
+    u64 term = ask_lnk(mem, host);
+
+    //printf("reduce "); debug_print_lnk(term); printf("\n");
+    //printf("------\n");
+    //printf("reducing: host=%d size=%llu init=%llu ", host, stack.size, init); debug_print_lnk(term); printf("\n");
+    //for (u64 i = 0; i < 256; ++i) {
+      //printf("- %llx ", i); debug_print_lnk(mem->node[i]); printf("\n");
+    //}
+
+    #ifdef REDUCE_THREADED
+    goto *reduce_labels[(init << 4) | get_tag(term)];
+    #endif
+
+    switch ((init << 4) | get_tag(term)) {
+      REDUCE_CASE(1, APP): {
+        reduce_push(stack, host);
+        //stack[size++] = host;
+        init = 1;
+        host = get_loc(term, 0);
+        continue;
+      }
+      REDUCE_CASE(1, DP0):
+      REDUCE_CASE(1, DP1): {
+        #ifdef PARALLEL
+        // Claims the dup node, so that only one worker reduces its expression
+        // and rewrites it. If another worker holds it, or it is gone, waits and
+        // re-reads `host`. If `host` changed before the lock was taken, the dup
+        // was already rewritten (and the word locked is someone else's); retries.
+        if (!dup_lock(mem, get_loc(term,0))) {
+          cpu_relax();
+          continue;
+        }
+        if (ask_lnk(mem, host) != term) {
+          dup_unlock(mem, get_loc(term,0));
+          continue;
+        }
+        #endif
+        reduce_push(stack, host);
+        host = get_loc(term, 2);
+        continue;
+      }
+      REDUCE_CASE(1, OP2): {
+        if (slen == 1 || stack->size > base) {
+          reduce_push(stack, host);
+          reduce_push(stack, get_loc(term, 0) | REDUCE_INIT);
           //stack[size++] = host;
-          init = 1;
-          host = get_loc(term, 0);
+          //stack[size++] = get_loc(term, 0) | REDUCE_INIT;
+          host = get_loc(term, 1);
           continue;
         }
-        case DP0:
-        case DP1: {
-          #ifdef PARALLEL
-          // TODO: reason about this, comment
-          atomic_flag* flag = ((atomic_flag*)(mem->node + get_loc(term,0))) + 6;
-          if (atomic_flag_test_and_set(flag) != 0) {
+        break;
+      }
+      REDUCE_CASE(1, CAL): {
+        u64 fun = get_ext(term);
+        u64 ari = get_ari(term);
+
+        #ifdef FN_TABLE
+        if (fun < FN_TABLE_SIZE && fn_table_init[fun] != NULL) {
+          u64 next = fn_table_init[fun](mem, stack, base, slen, host, init, term);
+          if (next != REDUCE_STOP) {
+            init = next >> 63;
+            host = next & ~REDUCE_INIT;
             continue;
           }
-          #endif
-          stk_push(&stack, host);
-          host = get_loc(term, 2);
-          continue;
         }
-        case OP2: {
-          if (slen == 1 || stack.size > 0) {
-            stk_push(&stack, host);
-            stk_push(&stack, get_loc(term, 0) | 0x80000000);
-            //stack[size++] = host;
-            //stack[size++] = get_loc(term, 0) | 0x80000000;
-            host = get_loc(term, 1);
+        #else
+        switch (fun)
+        //GENERATED_REWRITE_RULES_STEP_0_START//
+        {
+/*! GENERATED_REWRITE_RULES_STEP_0 !*/
+        }
+        //GENERATED_REWRITE_RULES_STEP_0_END//
+        #endif
+
+        break;
+      }
+
+      REDUCE_CASE(0, APP): {
+        u64 arg0 = ask_arg(mem, term, 0);
+        switch (get_tag(arg0)) {
+
+          // (λx(body) a)
+          // ------------ APP-LAM
+          // x <- a
+          // body
+          case LAM: {
+            //printf("app-lam\n");
+            inc_cost(mem, PROF_APP_LAM);
+            subst(mem, ask_arg(mem, arg0, 0), ask_arg(mem, term, 1));
+            u64 done = link_lnk(mem, host, ask_arg(mem, arg0, 1));
+            clear(mem, get_loc(term,0), 2);
+            clear(mem, get_loc(arg0,0), 2);
+            init = 1;
             continue;
           }
-          break;
-        }
-        case CAL: {
-          u64 fun = get_ext(term);
-          u64 ari = get_ari(term);
 
-          switch (fun)
-          //GENERATED_REWRITE_RULES_STEP_0_START//
-          {
-/*! GENERATED_REWRITE_RULES_STEP_0 !*/
+          // ({a b} c)
+          // ----------------- APP-PAR
+          // dup x0 x1 = c
+          // {(a x0) (b x1)}
+          case PAR: {
+            //printf("app-sup\n");
+            inc_cost(mem, PROF_APP_PAR);
+            u64 app0 = get_loc(term, 0);
+            u64 app1 = get_loc(arg0, 0);
+            u64 let0 = alloc(mem, 3);
+            u64 par0 = alloc(mem, 2);
+            link_lnk(mem, let0+2, ask_arg(mem, term, 1));
+            link_lnk(mem, app0+1, Dp0(get_ext(arg0), let0));
+            link_lnk(mem, app0+0, ask_arg(mem, arg0, 0));
+            link_lnk(mem, app1+0, ask_arg(mem, arg0, 1));
+            link_lnk(mem, app1+1, Dp1(get_ext(arg0), let0));
+            link_lnk(mem, par0+0, App(app0));
+            link_lnk(mem, par0+1, App(app1));
+            u64 done = Par(get_ext(arg0), par0);
+            link_lnk(mem, host, done);
+            break;
           }
-          //GENERATED_REWRITE_RULES_STEP_0_END//
 
-          break;
         }
+        break;
       }
+      REDUCE_CASE(0, DP0):
+      REDUCE_CASE(0, DP1): {
+        u64 arg0 = ask_arg(mem, term, 2);
+        switch (get_tag(arg0)) {
+
+          // dup r s = λx(f)
+          // --------------- DUP-LAM
+          // dup f0 f1 = f
+          // r <- λx0(f0)
+          // s <- λx1(f1)
+          // x <- {x0 x1}
+          case LAM: {
+            //printf("dup-lam\n");
+            inc_cost(mem, PROF_DUP_LAM);
+            u64 let0 = get_loc(term, 0);
+            u64 par0 = get_loc(arg0, 0);
+            u64 lam0 = alloc(mem, 2);
+            u64 lam1 = alloc(mem, 2);
+            link_lnk(mem, let0+2, ask_arg(mem, arg0, 1));
+            link_lnk(mem, par0+1, Var(lam1));
+            u64 arg0_arg_0 = ask_arg(mem, arg0, 0);
+            link_lnk(mem, par0+0, Var(lam0));
+            subst(mem, arg0_arg_0, Par(get_ext(term), par0));
+            u64 term_arg_0 = ask_arg(mem,term,0);
+            link_lnk(mem, lam0+1, Dp0(get_ext(term), let0));
+            subst(mem, term_arg_0, Lam(lam0));
+            u64 term_arg_1 = ask_arg(mem,term,1);
+            link_lnk(mem, lam1+1, Dp1(get_ext(term), let0));
+            subst(mem, term_arg_1, Lam(lam1));
+            u64 done = Lam(get_tag(term) == DP0 ? lam0 : lam1);
+            link_lnk(mem, host, done);
+            #ifdef PARALLEL
+            dup_unlock(mem, let0);
+            #endif
+            init = 1;
+            continue;
+          }
 
-    } else {
-
-      switch (get_tag(term)) {
-        case APP: {
-          u64 arg0 = ask_arg(mem, term, 0);
-          switch (get_tag(arg0)) {
-
-            // (λx(body) a)
-            // ------------ APP-LAM
-            // x <- a
-            // body
-            case LAM: {
-              //printf("app-lam\n");
-              inc_cost(mem);
-              subst(mem, ask_arg(mem, arg0, 0), ask_arg(mem, term, 1));
-              u64 done = link(mem, host, ask_arg(mem, arg0, 1));
-              clear(mem, get_loc(term,0), 2);
+          // dup x y = {a b}
+          // --------------- DUP-PAR (equal)
+          // x <- a
+          // y <- b
+          //
+          // dup x y = {a b}
+          // ----------------- DUP-SUP (different)
+          // x <- {xA xB}
+          // y <- {yA yB}
+          // dup xA yA = a
+          // dup xB yB = b
+          case PAR: {
+            //printf("dup-sup\n");
+            if (get_ext(term) == get_ext(arg0)) {
+              inc_cost(mem, PROF_DUP_PAR);
+              subst(mem, ask_arg(mem,term,0), ask_arg(mem,arg0,0));
+              subst(mem, ask_arg(mem,term,1), ask_arg(mem,arg0,1));
+              u64 done = link_lnk(mem, host, ask_arg(mem, arg0, get_tag(term) == DP0 ? 0 : 1));
+              #ifdef PARALLEL
+              dup_unlock(mem, get_loc(term,0));
+              #endif
+              clear(mem, get_loc(term,0), 3);
               clear(mem, get_loc(arg0,0), 2);
               init = 1;
               continue;
-            }
-
-            // ({a b} c)
-            // ----------------- APP-PAR
-            // dup x0 x1 = c
-            // {(a x0) (b x1)}
-            case PAR: {
-              //printf("app-sup\n");
-              inc_cost(mem);
-              u64 app0 = get_loc(term, 0);
-              u64 app1 = get_loc(arg0, 0);
-              u64 let0 = alloc(mem, 3);
+            } else {
+              inc_cost(mem, PROF_DUP_SUP);
               u64 par0 = alloc(mem, 2);
-              link(mem, let0+2, ask_arg(mem, term, 1));
-              link(mem, app0+1, Dp0(get_ext(arg0), let0));
-              link(mem, app0+0, ask_arg(mem, arg0, 0));
-              link(mem, app1+0, ask_arg(mem, arg0, 1));
-              link(mem, app1+1, Dp1(get_ext(arg0), let0));
-              link(mem, par0+0, App(app0));
-              link(mem, par0+1, App(app1));
-              u64 done = Par(get_ext(arg0), par0);
-              link(mem, host, done);
-              break;
-            }
-
-          }
-          break;
-        }
-        case DP0:
-        case DP1: {
-          u64 arg0 = ask_arg(mem, term, 2);
-          switch (get_tag(arg0)) {
-
-            // dup r s = λx(f)
-            // --------------- DUP-LAM
-            // dup f0 f1 = f
-            // r <- λx0(f0)
-            // s <- λx1(f1)
-            // x <- {x0 x1}
-            case LAM: {
-              //printf("dup-lam\n");
-              inc_cost(mem);
-              u64 let0 = get_loc(term, 0);
-              u64 par0 = get_loc(arg0, 0);
-              u64 lam0 = alloc(mem, 2);
-              u64 lam1 = alloc(mem, 2);
-              link(mem, let0+2, ask_arg(mem, arg0, 1));
-              link(mem, par0+1, Var(lam1));
-              u64 arg0_arg_0 = ask_arg(mem, arg0, 0);
-              link(mem, par0+0, Var(lam0));
-              subst(mem, arg0_arg_0, Par(get_ext(term), par0));
+              u64 let0 = get_loc(term,0);
+              u64 par1 = get_loc(arg0,0);
+              u64 let1 = alloc(mem, 3);
+              link_lnk(mem, let0+2, ask_arg(mem,arg0,0));
+              link_lnk(mem, let1+2, ask_arg(mem,arg0,1));
               u64 term_arg_0 = ask_arg(mem,term,0);
-              link(mem, lam0+1, Dp0(get_ext(term), let0));
-              subst(mem, term_arg_0, Lam(lam0));
               u64 term_arg_1 = ask_arg(mem,term,1);
-              link(mem, lam1+1, Dp1(get_ext(term), let0));
-              subst(mem, term_arg_1, Lam(lam1));
-              u64 done = Lam(get_tag(term) == DP0 ? lam0 : lam1);
-              link(mem, host, done);
-              init = 1;
-              continue;
-            }
-
-            // dup x y = {a b}
-            // --------------- DUP-PAR (equal)
-            // x <- a
-            // y <- b
-            //
-            // dup x y = {a b}
-            // ----------------- DUP-SUP (different)
-            // x <- {xA xB}
-            // y <- {yA yB}
-            // dup xA yA = a
-            // dup xB yB = b
-            case PAR: {
-              //printf("dup-sup\n");
-              if (get_ext(term) == get_ext(arg0)) {
-                inc_cost(mem);
-                subst(mem, ask_arg(mem,term,0), ask_arg(mem,arg0,0));
-                subst(mem, ask_arg(mem,term,1), ask_arg(mem,arg0,1));
-                u64 done = link(mem, host, ask_arg(mem, arg0, get_tag(term) == DP0 ? 0 : 1));
-                clear(mem, get_loc(term,0), 3);
-                clear(mem, get_loc(arg0,0), 2);
-                init = 1;
-                continue;
-              } else {
-                inc_cost(mem);
-                u64 par0 = alloc(mem, 2);
-                u64 let0 = get_loc(term,0);
-                u64 par1 = get_loc(arg0,0);
-                u64 let1 = alloc(mem, 3);
-                link(mem, let0+2, ask_arg(mem,arg0,0));
-                link(mem, let1+2, ask_arg(mem,arg0,1));
-                u64 term_arg_0 = ask_arg(mem,term,0);
-                u64 term_arg_1 = ask_arg(mem,term,1);
-                link(mem, par1+0, Dp1(get_ext(term),let0));
-                link(mem, par1+1, Dp1(get_ext(term),let1));
-                link(mem, par0+0, Dp0(get_ext(term),let0));
-                link(mem, par0+1, Dp0(get_ext(term),let1));
-                subst(mem, term_arg_0, Par(get_ext(arg0),par0));
-                subst(mem, term_arg_1, Par(get_ext(arg0),par1));
-                u64 done = Par(get_ext(arg0), get_tag(term) == DP0 ? par0 : par1);
-                link(mem, host, done);
-                break;
-              }
+              link_lnk(mem, par1+0, Dp1(get_ext(term),let0));
+              link_lnk(mem, par1+1, Dp1(get_ext(term),let1));
+              link_lnk(mem, par0+0, Dp0(get_ext(term),let0));
+              link_lnk(mem, par0+1, Dp0(get_ext(term),let1));
+              subst(mem, term_arg_0, Par(get_ext(arg0),par0));
+              subst(mem, term_arg_1, Par(get_ext(arg0),par1));
+              u64 done = Par(get_ext(arg0), get_tag(term) == DP0 ? par0 : par1);
+              link_lnk(mem, host, done);
               break;
             }
+            break;
+          }
 
-            // dup x y = N
-            // ----------- DUP-U32
-            // x <- N
-            // y <- N
-            // ~
-            case U32: {
-              //printf("dup-u32\n");
-              inc_cost(mem);
-              subst(mem, ask_arg(mem,term,0), arg0);
-              subst(mem, ask_arg(mem,term,1), arg0);
-              u64 done = arg0;
-              link(mem, host, arg0);
-              break;
-            }
+          // dup x y = N
+          // ----------- DUP-NUM
+          // x <- N
+          // y <- N
+          // ~
+          case U32: case F32: case U60: {
+            //printf("dup-num\n");
+            inc_cost(mem, PROF_DUP_NUM);
+            subst(mem, ask_arg(mem,term,0), arg0);
+            subst(mem, ask_arg(mem,term,1), arg0);
+            u64 done = arg0;
+            link_lnk(mem, host, arg0);
+            break;
+          }
 
-            // dup x y = (K a b c ...)
-            // ----------------------- DUP-CTR
-            // dup a0 a1 = a
-            // dup b0 b1 = b
-            // dup c0 c1 = c
-            // ...
-            // x <- (K a0 b0 c0 ...)
-            // y <- (K a1 b1 c1 ...)
-            case CTR: {
-              //printf("dup-ctr\n");
-              inc_cost(mem);
-              u64 func = get_ext(arg0);
-              u64 arit = get_ari(arg0);
-              if (arit == 0) {
-                subst(mem, ask_arg(mem,term,0), Ctr(0, func, 0));
-                subst(mem, ask_arg(mem,term,1), Ctr(0, func, 0));
-                clear(mem, get_loc(term,0), 3);
-                u64 done = link(mem, host, Ctr(0, func, 0));
-              } else {
-                u64 ctr0 = get_loc(arg0,0);
-                u64 ctr1 = alloc(mem, arit);
-                for (u64 i = 0; i < arit - 1; ++i) {
-                  u64 leti = alloc(mem, 3);
-                  link(mem, leti+2, ask_arg(mem, arg0, i));
-                  link(mem, ctr0+i, Dp0(get_ext(term), leti));
-                  link(mem, ctr1+i, Dp1(get_ext(term), leti));
-                }
-                u64 leti = get_loc(term, 0);
-                link(mem, leti + 2, ask_arg(mem, arg0, arit - 1));
-                u64 term_arg_0 = ask_arg(mem, term, 0);
-                link(mem, ctr0 + arit - 1, Dp0(get_ext(term), leti));
-                subst(mem, term_arg_0, Ctr(arit, func, ctr0));
-                u64 term_arg_1 = ask_arg(mem, term, 1);
-                link(mem, ctr1 + arit - 1, Dp1(get_ext(term), leti));
-                subst(mem, term_arg_1, Ctr(arit, func, ctr1));
-                u64 done = Ctr(arit, func, get_tag(term) == DP0 ? ctr0 : ctr1);
-                link(mem, host, done);
+          // dup x y = (K a b c ...)
+          // ----------------------- DUP-CTR
+          // dup a0 a1 = a
+          // dup b0 b1 = b
+          // dup c0 c1 = c
+          // ...
+          // x <- (K a0 b0 c0 ...)
+          // y <- (K a1 b1 c1 ...)
+          case CTR: {
+            //printf("dup-ctr\n");
+            inc_cost(mem, PROF_DUP_CTR);
+            u64 func = get_ext(arg0);
+            u64 arit = get_ari(arg0);
+            if (arit == 0) {
+              subst(mem, ask_arg(mem,term,0), Ctr(0, func, 0));
+              subst(mem, ask_arg(mem,term,1), Ctr(0, func, 0));
+              clear(mem, get_loc(term,0), 3);
+              u64 done = link_lnk(mem, host, Ctr(0, func, 0));
+            } else {
+              u64 ctr0 = get_loc(arg0,0);
+              u64 ctr1 = alloc(mem, arit);
+              for (u64 i = 0; i < arit - 1; ++i) {
+                u64 leti = alloc(mem, 3);
+                link_lnk(mem, leti+2, ask_arg(mem, arg0, i));
+                link_lnk(mem, ctr0+i, Dp0(get_ext(term), leti));
+                link_lnk(mem, ctr1+i, Dp1(get_ext(term), leti));
               }
-              break;
+              u64 leti = get_loc(term, 0);
+              link_lnk(mem, leti + 2, ask_arg(mem, arg0, arit - 1));
+              u64 term_arg_0 = ask_arg(mem, term, 0);
+              link_lnk(mem, ctr0 + arit - 1, Dp0(get_ext(term), leti));
+              subst(mem, term_arg_0, Ctr(arit, func, ctr0));
+              u64 term_arg_1 = ask_arg(mem, term, 1);
+              link_lnk(mem, ctr1 + arit - 1, Dp1(get_ext(term), leti));
+              subst(mem, term_arg_1, Ctr(arit, func, ctr1));
+              u64 done = Ctr(arit, func, get_tag(term) == DP0 ? ctr0 : ctr1);
+              link_lnk(mem, host, done);
             }
-
+            break;
           }
-          #ifdef PARALLEL
-          atomic_flag* flag = ((atomic_flag*)(mem->node + get_loc(term,0))) + 6;
-          atomic_flag_clear(flag);
-          #endif
-          break;
+
         }
-        case OP2: {
-          u64 arg0 = ask_arg(mem, term, 0);
-          u64 arg1 = ask_arg(mem, term, 1);
-
-          // (+ a b)
-          // --------- OP2-U32
-          // add(a, b)
-          if (get_tag(arg0) == U32 && get_tag(arg1) == U32) {
-            //printf("op2-u32\n");
-            inc_cost(mem);
-            u64 a = get_val(arg0);
-            u64 b = get_val(arg1);
-            u64 c = 0;
-            switch (get_ext(term)) {
-              case ADD: c = (a +  b) & 0xFFFFFFFF; break;
-              case SUB: c = (a -  b) & 0xFFFFFFFF; break;
-              case MUL: c = (a *  b) & 0xFFFFFFFF; break;
-              case DIV: c = (a /  b) & 0xFFFFFFFF; break;
-              case MOD: c = (a %  b) & 0xFFFFFFFF; break;
-              case AND: c = (a &  b) & 0xFFFFFFFF; break;
-              case OR : c = (a |  b) & 0xFFFFFFFF; break;
-              case XOR: c = (a ^  b) & 0xFFFFFFFF; break;
-              case SHL: c = (a << b) & 0xFFFFFFFF; break;
-              case SHR: c = (a >> b) & 0xFFFFFFFF; break;
-              case LTN: c = (a <  b) ? 1 : 0;      break;
-              case LTE: c = (a <= b) ? 1 : 0;      break;
-              case EQL: c = (a == b) ? 1 : 0;      break;
-              case GTE: c = (a >= b) ? 1 : 0;      break;
-              case GTN: c = (a >  b) ? 1 : 0;      break;
-              case NEQ: c = (a != b) ? 1 : 0;      break;
-            }
-            u64 done = U_32(c);
-            clear(mem, get_loc(term,0), 2);
-            link(mem, host, done);
-          }
+        #ifdef PARALLEL
+        dup_unlock(mem, get_loc(term,0));
+        #endif
+        break;
+      }
+      REDUCE_CASE(0, OP2): {
+        u64 arg0 = ask_arg(mem, term, 0);
+        u64 arg1 = ask_arg(mem, term, 1);
 
-          // (+ {a0 a1} b)
-          // --------------------- OP2-SUP-0
-          // let b0 b1 = b
-          // {(+ a0 b0) (+ a1 b1)}
-          else if (get_tag(arg0) == PAR) {
-            //printf("op2-sup-0\n");
-            inc_cost(mem);
-            u64 op20 = get_loc(term, 0);
-            u64 op21 = get_loc(arg0, 0);
-            u64 let0 = alloc(mem, 3);
-            u64 par0 = alloc(mem, 2);
-            link(mem, let0+2, arg1);
-            link(mem, op20+1, Dp0(get_ext(arg0), let0));
-            link(mem, op20+0, ask_arg(mem, arg0, 0));
-            link(mem, op21+0, ask_arg(mem, arg0, 1));
-            link(mem, op21+1, Dp1(get_ext(arg0), let0));
-            link(mem, par0+0, Op2(get_ext(term), op20));
-            link(mem, par0+1, Op2(get_ext(term), op21));
-            u64 done = Par(get_ext(arg0), par0);
-            link(mem, host, done);
+        // (+ a b)
+        // --------- OP2-U32
+        // add(a, b)
+        if (get_tag(arg0) == U32 && get_tag(arg1) == U32) {
+          //printf("op2-u32\n");
+          inc_cost(mem, PROF_OP2_U32);
+          u64 a = get_val(arg0);
+          u64 b = get_val(arg1);
+          u64 c = 0;
+          switch (get_ext(term)) {
+            case ADD: c = (a +  b) & 0xFFFFFFFF; break;
+            case SUB: c = (a -  b) & 0xFFFFFFFF; break;
+            case MUL: c = (a *  b) & 0xFFFFFFFF; break;
+            case DIV: c = (a /  b) & 0xFFFFFFFF; break;
+            case MOD: c = (a %  b) & 0xFFFFFFFF; break;
+            case AND: c = (a &  b) & 0xFFFFFFFF; break;
+            case OR : c = (a |  b) & 0xFFFFFFFF; break;
+            case XOR: c = (a ^  b) & 0xFFFFFFFF; break;
+            case SHL: c = (a << b) & 0xFFFFFFFF; break;
+            case SHR: c = (a >> b) & 0xFFFFFFFF; break;
+            case LTN: c = (a <  b) ? 1 : 0;      break;
+            case LTE: c = (a <= b) ? 1 : 0;      break;
+            case EQL: c = (a == b) ? 1 : 0;      break;
+            case GTE: c = (a >= b) ? 1 : 0;      break;
+            case GTN: c = (a >  b) ? 1 : 0;      break;
+            case NEQ: c = (a != b) ? 1 : 0;      break;
           }
+          u64 done = U_32(c);
+          clear(mem, get_loc(term,0), 2);
+          link_lnk(mem, host, done);
+        }
 
-          // (+ a {b0 b1})
-          // --------------- OP2-SUP-1
-          // dup a0 a1 = a
-          // {(+ a0 b0) (+ a1 b1)}
-          else if (get_tag(arg1) == PAR) {
-            //printf("op2-sup-1\n");
-            inc_cost(mem);
-            u64 op20 = get_loc(term, 0);
-            u64 op21 = get_loc(arg1, 0);
-            u64 let0 = alloc(mem, 3);
-            u64 par0 = alloc(mem, 2);
-            link(mem, let0+2, arg0);
-            link(mem, op20+0, Dp0(get_ext(arg1), let0));
-            link(mem, op20+1, ask_arg(mem, arg1, 0));
-            link(mem, op21+1, ask_arg(mem, arg1, 1));
-            link(mem, op21+0, Dp1(get_ext(arg1), let0));
-            link(mem, par0+0, Op2(get_ext(term), op20));
-            link(mem, par0+1, Op2(get_ext(term), op21));
-            u64 done = Par(get_ext(arg1), par0);
-            link(mem, host, done);
-          }
+        // (+ a b)
+        // --------- OP2-NUM
+        // add(a, b)
+        else if (is_num(arg0) && is_num(arg1)) {
+          //printf("op2-num\n");
+          inc_cost(mem, PROF_OP2_NUM);
+          u64 done = op2_num(get_ext(term), arg0, arg1);
+          clear(mem, get_loc(term,0), 2);
+          link_lnk(mem, host, done);
+        }
 
-          break;
+        // (+ {a0 a1} b)
+        // --------------------- OP2-SUP-0
+        // let b0 b1 = b
+        // {(+ a0 b0) (+ a1 b1)}
+        else if (get_tag(arg0) == PAR) {
+          //printf("op2-sup-0\n");
+          inc_cost(mem, PROF_OP2_SUP_0);
+          u64 op20 = get_loc(term, 0);
+          u64 op21 = get_loc(arg0, 0);
+          u64 let0 = alloc(mem, 3);
+          u64 par0 = alloc(mem, 2);
+          link_lnk(mem, let0+2, arg1);
+          link_lnk(mem, op20+1, Dp0(get_ext(arg0), let0));
+          link_lnk(mem, op20+0, ask_arg(mem, arg0, 0));
+          link_lnk(mem, op21+0, ask_arg(mem, arg0, 1));
+          link_lnk(mem, op21+1, Dp1(get_ext(arg0), let0));
+          link_lnk(mem, par0+0, Op2(get_ext(term), op20));
+          link_lnk(mem, par0+1, Op2(get_ext(term), op21));
+          u64 done = Par(get_ext(arg0), par0);
+          link_lnk(mem, host, done);
         }
-        case CAL: {
-          u64 fun = get_ext(term);
-          u64 ari = get_ari(term);
 
-          switch (fun)
-          //GENERATED_REWRITE_RULES_STEP_1_START//
-          {
-/*! GENERATED_REWRITE_RULES_STEP_1 !*/
-          }
-          //GENERATED_REWRITE_RULES_STEP_1_END//
+        // (+ a {b0 b1})
+        // --------------- OP2-SUP-1
+        // dup a0 a1 = a
+        // {(+ a0 b0) (+ a1 b1)}
+        else if (get_tag(arg1) == PAR) {
+          //printf("op2-sup-1\n");
+          inc_cost(mem, PROF_OP2_SUP_1);
+          u64 op20 = get_loc(term, 0);
+          u64 op21 = get_loc(arg1, 0);
+          u64 let0 = alloc(mem, 3);
+          u64 par0 = alloc(mem, 2);
+          link_lnk(mem, let0+2, arg0);
+          link_lnk(mem, op20+0, Dp0(get_ext(arg1), let0));
+          link_lnk(mem, op20+1, ask_arg(mem, arg1, 0));
+          link_lnk(mem, op21+1, ask_arg(mem, arg1, 1));
+          link_lnk(mem, op21+0, Dp1(get_ext(arg1), let0));
+          link_lnk(mem, par0+0, Op2(get_ext(term), op20));
+          link_lnk(mem, par0+1, Op2(get_ext(term), op21));
+          u64 done = Par(get_ext(arg1), par0);
+          link_lnk(mem, host, done);
+        }
 
-          break;
+        break;
+      }
+      REDUCE_CASE(0, CAL): {
+        u64 fun = get_ext(term);
+        u64 ari = get_ari(term);
+
+        #ifdef FN_TABLE
+        if (fun < FN_TABLE_SIZE && fn_table_rules[fun] != NULL) {
+          u64 next = fn_table_rules[fun](mem, stack, base, slen, host, init, term);
+          if (next != REDUCE_STOP) {
+            init = next >> 63;
+            host = next & ~REDUCE_INIT;
+            continue;
+          }
         }
+        #else
+        switch (fun)
+        //GENERATED_REWRITE_RULES_STEP_1_START//
+        {
+/*! GENERATED_REWRITE_RULES_STEP_1 !*/
+        }
+        //GENERATED_REWRITE_RULES_STEP_1_END//
+        #endif
+
+        break;
       }
     }
 
-    u64 item = stk_pop(&stack);
-    if (item == -1) {
+    #ifdef REDUCE_THREADED
+    reduce_next:
+    #endif
+    if (stack->size == base) {
       break;
     } else {
-      init = item >> 31;
-      host = item & 0x7FFFFFFF;
+      u64 item = stack->data[--stack->size];
+      init = item >> 63;
+      host = item & ~REDUCE_INIT;
       continue;
     }
 
   }
 
+  #ifdef COMPACT
+  compact_depth--;
+  #endif
+
   return ask_lnk(mem, root);
 }
 
@@ -829,453 +1650,1468 @@ u8 get_bit(u64* bits, u64 bit) {
   return (bits[bit >> 6] >> (bit & 0x3F)) & 1;
 }
 
-#ifdef PARALLEL
-void normal_fork(u64 tid, u64 host, u64 sidx, u64 slen);
-u64  normal_join(u64 tid);
-#endif
-
-u64 normal_seen_data[NORMAL_SEEN_MCAP];
-
+// Clears the marks of the previous normal() pass
 void normal_init(void) {
-  for (u64 i = 0; i < NORMAL_SEEN_MCAP; ++i) {
-    normal_seen_data[i] = 0;
+  memset(normal_seen_data, 0, (normal_seen_used + 63) / 64 * sizeof(u64));
+  normal_seen_used = 0;
+}
+
+// Records how much of the bitmap the pass that just ended may have marked
+void normal_done(void) {
+  u64 used = __atomic_load_n(&heap_used, __ATOMIC_RELAXED);
+  if (used > normal_seen_used) {
+    normal_seen_used = used;
   }
 }
 
-Lnk normal_go(Worker* mem, u64 host, u64 sidx, u64 slen) {
-  Lnk term = ask_lnk(mem, host);
-  //printf("normal %llu %llu | ", sidx, slen); debug_print_lnk(term); printf("\n");
+// Marks a location as visited, returning 1 if it already was. With threads,
+// this is an atomic test-and-set, so each location is normalized only once.
+u8 normal_seen(u64 host) {
+  #ifdef PARALLEL
+  u64 mask = 1ULL << (host & 0x3F);
+  return (__atomic_fetch_or(&normal_seen_data[host >> 6], mask, __ATOMIC_RELAXED) & mask) != 0;
+  #else
   if (get_bit(normal_seen_data, host)) {
-    return term;
-  } else {
-    term = reduce(mem, host, slen);
-    set_bit(normal_seen_data, host);
-    u64 rec_size = 0;
-    u64 rec_locs[16];
-    switch (get_tag(term)) {
-      case LAM: {
-        rec_locs[rec_size++] = get_loc(term,1);
-        break;
-      }
-      case APP: {
-        rec_locs[rec_size++] = get_loc(term,0);
-        rec_locs[rec_size++] = get_loc(term,1);
-        break;
-      }
-      case PAR: {
+    return 1;
+  }
+  set_bit(normal_seen_data, host);
+  return 0;
+  #endif
+}
+
+// Fills `rec_locs` with the locations normal() must visit after `term` was
+// reduced to weak head normal form, and returns how many there are.
+u64 normal_rec_locs(Lnk term, u64 slen, u64* rec_locs) {
+  u64 rec_size = 0;
+  switch (get_tag(term)) {
+    case LAM: {
+      rec_locs[rec_size++] = get_loc(term,1);
+      break;
+    }
+    case APP: {
+      rec_locs[rec_size++] = get_loc(term,0);
+      rec_locs[rec_size++] = get_loc(term,1);
+      break;
+    }
+    case PAR: {
+      rec_locs[rec_size++] = get_loc(term,0);
+      rec_locs[rec_size++] = get_loc(term,1);
+      break;
+    }
+    case DP0: {
+      rec_locs[rec_size++] = get_loc(term,2);
+      break;
+    }
+    case DP1: {
+      rec_locs[rec_size++] = get_loc(term,2);
+      break;
+    }
+    case OP2: {
+      if (slen > 1) {
         rec_locs[rec_size++] = get_loc(term,0);
         rec_locs[rec_size++] = get_loc(term,1);
         break;
       }
-      case DP0: {
-        rec_locs[rec_size++] = get_loc(term,2);
-        break;
-      }
-      case DP1: {
-        rec_locs[rec_size++] = get_loc(term,2);
-        break;
+    }
+    case CTR: case CAL: {
+      u64 arity = (u64)get_ari(term);
+      for (u64 i = 0; i < arity; ++i) {
+        rec_locs[rec_size++] = get_loc(term,i);
       }
-      case OP2: {
-        if (slen > 1) {
-          rec_locs[rec_size++] = get_loc(term,0);
-          rec_locs[rec_size++] = get_loc(term,1);
-          break;
-        }
+      break;
+    }
+  }
+  return rec_size;
+}
+
+// Split budget of each subterm, when a term with `rec_size` subterms has `slen`
+u64 normal_rec_slen(u64 rec_size, u64 slen) {
+  return rec_size >= 2 && slen >= rec_size ? slen / rec_size : slen;
+}
+
+// A task is a location to normalize, plus the split budget it was given
+u64 Task(u64 host, u64 slen) {
+  return (slen << 48) | host;
+}
+
+// Normalizes the term at `host`, visiting its subterms depth-first, in order.
+// The locations left to visit are kept on the worker's stack, as tasks.
+Lnk normal_go(Worker* mem, u64 host, u64 slen) {
+  Stk* stack = &mem->stack;
+  u64  base  = stack->size;
+  reduce_push(stack, Task(host, slen));
+  while (stack->size > base) {
+    u64 task = stack->data[--stack->size];
+    u64 loc = task & 0xFFFFFFFFFFFF;
+    u64 loc_slen = task >> 48;
+    //printf("normal %llu | ", loc_slen); debug_print_lnk(ask_lnk(mem, loc)); printf("\n");
+    if (normal_seen(loc)) {
+      continue;
+    }
+    Lnk term = reduce(mem, loc, loc_slen);
+    u64 rec_locs[16];
+    u64 rec_size = normal_rec_locs(term, loc_slen, rec_locs);
+    u64 rec_slen = normal_rec_slen(rec_size, loc_slen);
+    for (u64 i = rec_size; i > 0; --i) {
+      reduce_push(stack, Task(rec_locs[i-1], rec_slen));
+    }
+  }
+  return ask_lnk(mem, host);
+}
+
+// Reduces the strict argument at `host` of a call being reduced in parallel
+void strict_go(Worker* mem, u64 host, u64 slen) {
+  if (get_tag(reduce(mem, host, slen)) == OP2) {
+    reduce(mem, host, 1);
+  }
+}
+
+#ifdef PARALLEL
+
+// Number of tasks of the current normal() pass that weren't finished yet
+_Atomic(u64) normal_pending;
+
+// Marks tasks that reduce a strict argument of a call. They point to a 3-word
+// join cell on the heap, holding how many arguments are still being reduced,
+// their split budget, and the call.
+#define STRICT_TASK (0x8000000000000000)
+
+u64 StrictTask(u64 join, u64 arg) {
+  return STRICT_TASK | (arg << 48) | join;
+}
+
+// Reduces the strict argument a task points to, then signals its join cell
+void strict_task(Worker* mem, u64 task) {
+  u64 join = task & 0xFFFFFFFFFFFF;
+  u64 arg = (task >> 48) & 0xF;
+  u64 slen = mem->node[join + 1];
+  Lnk term = mem->node[join + 2];
+  strict_go(mem, get_loc(term, arg), slen);
+  __atomic_fetch_sub(&mem->node[join + 0], 1, __ATOMIC_RELEASE);
+}
+
+// Reduces the strict arguments of a call, in parallel. All but the first are
+// pushed as tasks that idle workers can steal. While it waits for them, this
+// worker only takes back tasks it pushed itself: running others could require
+// a dup node it holds locked further up its stack.
+void reduce_strict(Worker* mem, Lnk term, u64* args, u64 size, u64 slen) {
+  u64 rec_slen = normal_rec_slen(size, slen);
+  u64 join = alloc(mem, 3);
+  mem->node[join + 0] = size - 1;
+  mem->node[join + 1] = rec_slen;
+  mem->node[join + 2] = term;
+  i64 base = atomic_load_explicit(&mem->deque.bot, memory_order_relaxed);
+  for (u64 i = size - 1; i > 0; --i) {
+    if (!deq_push(&mem->deque, StrictTask(join, args[i]))) {
+      strict_task(mem, StrictTask(join, args[i]));
+    }
+  }
+  strict_go(mem, get_loc(term, args[0]), rec_slen);
+  u64 idle = 0;
+  while (__atomic_load_n(&mem->node[join + 0], __ATOMIC_ACQUIRE) > 0) {
+    u64 task = atomic_load_explicit(&mem->deque.bot, memory_order_relaxed) > base ? deq_take(&mem->deque) : -1;
+    if (task != -1) {
+      strict_task(mem, task);
+    } else if (++idle < spin_limit) {
+      cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+  clear(mem, join, 3);
+}
+
+// Normalizes the term at `host`. Its first subterm is handled right away; the
+// others are pushed to this worker's deque, where idle workers can steal them.
+void normal_task(Worker* mem, u64 host, u64 slen) {
+  while (!normal_seen(host)) {
+    Lnk term = reduce(mem, host, slen);
+    u64 rec_locs[16];
+    u64 rec_size = normal_rec_locs(term, slen, rec_locs);
+    if (rec_size == 0) {
+      return;
+    }
+    u64 rec_slen = normal_rec_slen(rec_size, slen);
+    atomic_fetch_add(&normal_pending, rec_size - 1);
+    for (u64 i = rec_size - 1; i > 0; --i) {
+      if (!deq_push(&mem->deque, Task(rec_locs[i], rec_slen))) {
+        link_lnk(mem, rec_locs[i], normal_go(mem, rec_locs[i], rec_slen));
+        atomic_fetch_sub(&normal_pending, 1);
       }
-      case CTR: case CAL: {
-        u64 arity = (u64)get_ari(term);
-        for (u64 i = 0; i < arity; ++i) {
-          rec_locs[rec_size++] = get_loc(term,i);
-        }
-        break;
+    }
+    host = rec_locs[0];
+    slen = rec_slen;
+  }
+}
+
+// Steals a task from the first other worker that has one
+u64 normal_steal(Worker* mem) {
+  for (u64 i = 1; i < MAX_WORKERS; ++i) {
+    u64 task = deq_steal(&workers[(mem->tid + i) % MAX_WORKERS].deque);
+    if (task != -1) {
+      return task;
+    }
+  }
+  return -1;
+}
+
+// Runs tasks until the current normal() pass has none left. Workers only go
+// idle when every deque is empty, instead of when their own subtree is done.
+void normal_work(Worker* mem) {
+  u64 idle = 0;
+  while (atomic_load(&normal_pending) > 0) {
+    u64 task = deq_take(&mem->deque);
+    if (task == -1) {
+      task = normal_steal(mem);
+    }
+    if (task == -1) {
+      if (++idle < spin_limit) {
+        cpu_relax();
+      } else {
+        sched_yield();
       }
+      continue;
     }
-    #ifdef PARALLEL
+    idle = 0;
+    if (task & STRICT_TASK) {
+      strict_task(mem, task);
+    } else {
+      normal_task(mem, task & 0xFFFFFFFFFFFF, task >> 48);
+      atomic_fetch_sub(&normal_pending, 1);
+    }
+  }
+}
 
-    //printf("ue %llu %llu\n", rec_size, slen);
+void worker_wake(u64 tid);
+void worker_wait(u64 tid);
 
-    if (rec_size >= 2 && slen >= rec_size) {
+#else
 
-      u64 space = slen / rec_size;
+void reduce_strict(Worker* mem, Lnk term, u64* args, u64 size, u64 slen) {
+  for (u64 i = 0; i < size; ++i) {
+    strict_go(mem, get_loc(term, args[i]), normal_rec_slen(size, slen));
+  }
+}
 
-      for (u64 i = 1; i < rec_size; ++i) {
-        //printf("spawn %llu %llu\n", sidx + i * space, space);
-        normal_fork(sidx + i * space, rec_locs[i], sidx + i * space, space);
-      }
+#endif
 
-      link(mem, rec_locs[0], normal_go(mem, rec_locs[0], sidx, space));
+#ifdef COMPACT
+
+// Compaction
+// ----------
+// As freed blocks are reused, long reductions scatter live nodes all over the
+// heap. When built with -DCOMPACT, reduce() checks, every COMPACT_INTERVAL
+// rewrites, how much of the heap is on free lists. If enough is, the graph
+// reachable from the root is moved to the start of the heap, in DFS order, and
+// every pointer to it is rewritten: the ARG back-pointers in binders, as well
+// as the locations on the worker's stack and the marks of normal().
+//
+// This needs to know every live location, so it only happens when the term
+// being normalized is all that lives on the heap (see compact_root, which
+// main() sets, but the library API doesn't), in the outermost reduce(), and
+// in single-threaded builds, where no other worker holds locations.
 
-      for (u64 i = 1; i < rec_size; ++i) {
-        link(mem, get_loc(term, i), normal_join(sidx + i * space));
+#ifdef PARALLEL
+#error "-DCOMPACT needs a single-threaded build (hvm c --single-thread)."
+#endif
+
+// Percentage of the heap handed out by alloc() that must be back on free lists
+// to trigger compaction
+#ifndef COMPACT_THRESHOLD
+#define COMPACT_THRESHOLD (50)
+#endif
+
+// How many rewrites reduce() does between checks
+#ifndef COMPACT_INTERVAL
+#define COMPACT_INTERVAL (0x100000)
+#endif
+
+// The host of the term being normalized, if every live node is reachable from
+// it, or -1, which disables compaction. The host itself never moves.
+u64 compact_root = -1;
+
+// Size of the node a Lnk points to, or 0 if it points to none. A VAR keeps its
+// λ alive, since the variable may have escaped the λ's body.
+u64 compact_size(Lnk lnk) {
+  switch (get_tag(lnk)) {
+    case DP0: case DP1: return 3;
+    case VAR: case LAM: case APP: case PAR: case OP2: return 2;
+    case CTR: case CAL: return get_ari(lnk);
+    default: return 0;
+  }
+}
+
+// Whether the nth word of the node a Lnk points to is a subterm, rather than
+// a back-pointer to a variable
+u8 compact_child(Lnk lnk, u64 i) {
+  switch (get_tag(lnk)) {
+    case DP0: case DP1: return i == 2;
+    case VAR: case LAM: return i == 1;
+    default: return 1;
+  }
+}
+
+// Relocates a Lnk, given the forwarding table of the `used` words of the heap
+Lnk compact_lnk(u64* fwd, u64 used, Lnk lnk) {
+  u8 has_loc = get_tag(lnk) <= ARG || compact_size(lnk) > 0;
+  if (!has_loc || get_val(lnk) >= used) {
+    return lnk;
+  }
+  u64 loc = fwd[get_val(lnk)];
+  if (loc == -1) {
+    return get_tag(lnk) == ARG ? Era() : lnk;
+  }
+  return (lnk & ~VAL_MASK) | loc;
+}
+
+// Relocates a location held by a reduction, keeping the flags above its 48
+// bits. Returns 0 if it isn't in a node being moved.
+u8 compact_loc(u64* fwd, u64 used, u64* item) {
+  u64 loc = *item & 0xFFFFFFFFFFFF;
+  if (loc >= used || fwd[loc] == -1) {
+    return 0;
+  }
+  *item = (*item & ~(u64)0xFFFFFFFFFFFF) | fwd[loc];
+  return 1;
+}
+
+// Sums the distances, in words, between each node of `order` (at `base`, or at
+// its new position, if given a forwarding table) and the nodes of its subterms
+double compact_dist(Worker* mem, Stk* order, u64* fwd, u64* links) {
+  double dist = 0;
+  *links = 0;
+  for (u64 k = 0; k < order->size; ++k) {
+    u64 base = order->data[k] >> 4;
+    u64 size = order->data[k] & 0xF;
+    u64 from = fwd ? fwd[base] : base;
+    for (u64 i = 0; i < size; ++i) {
+      Lnk term = mem->node[from + i];
+      if (get_tag(term) != VAR && compact_size(term) > 0) {
+        u64 dest = get_loc(term, 0);
+        dist += (double)(dest > from ? dest - from : from - dest);
+        *links += 1;
       }
+    }
+  }
+  return dist;
+}
 
-    } else {
+// Returns the pages in [ini, end) to the OS
+void compact_trim(Worker* mem, u64 ini, u64 end) {
+  ini = (ini + PAGE_WORDS - 1) / PAGE_WORDS * PAGE_WORDS;
+  end = end / PAGE_WORDS * PAGE_WORDS;
+  if (ini < end) {
+    madvise(mem->node + ini, (end - ini) * sizeof(u64), MADV_DONTNEED);
+  }
+}
 
-      for (u64 i = 0; i < rec_size; ++i) {
-        link(mem, rec_locs[i], normal_go(mem, rec_locs[i], sidx, slen));
+// Moves the graph reachable from compact_root to the start of the heap, and
+// relocates `root`, `host` and the worker's stack, which must all be in it.
+void compact(Worker* mem, u64* root, u64* host) {
+  u64 used = heap_used;
+  u64 taken = used - (mem->last - mem->next);
+  u64 free_words = mem->freed;
+
+  // Assigns new positions to the live nodes, in DFS order, around the host
+  u64* fwd = malloc(used * sizeof(u64));
+  assert(fwd);
+  memset(fwd, 0xFF, used * sizeof(u64));
+  fwd[compact_root] = compact_root;
+  u64 next = 0;
+  Stk order;
+  Stk visit;
+  stk_init(&order);
+  stk_init(&visit);
+  stk_push(&visit, mem->node[compact_root]);
+  while (visit.size > 0) {
+    Lnk term = stk_pop(&visit);
+    u64 size = compact_size(term);
+    u64 base = get_loc(term, 0);
+    if (size == 0 || fwd[base] != -1) {
+      continue;
+    }
+    if (next <= compact_root && compact_root < next + size) {
+      next = compact_root + 1;
+    }
+    for (u64 i = 0; i < size; ++i) {
+      fwd[base + i] = next + i;
+    }
+    stk_push(&order, (base << 4) | size);
+    next += size;
+    for (u64 i = size; i > 0; --i) {
+      if (compact_child(term, i - 1)) {
+        stk_push(&visit, mem->node[base + i - 1]);
       }
+    }
+  }
 
+  // Relocates the locations held by the reduction. If one isn't in the graph,
+  // something else is live, so gives up.
+  Stk* stack = &mem->stack;
+  u64 held[2] = {*root, *host};
+  u8 known = compact_loc(fwd, used, &held[0]) && compact_loc(fwd, used, &held[1]);
+  for (u64 i = 0; known && i < stack->size; ++i) {
+    u64 item = stack->data[i];
+    known = compact_loc(fwd, used, &item);
+  }
+  if (!known) {
+    stk_free(&order);
+    stk_free(&visit);
+    free(fwd);
+    return;
+  }
+  *root = held[0];
+  *host = held[1];
+  for (u64 i = 0; i < stack->size; ++i) {
+    compact_loc(fwd, used, &stack->data[i]);
+  }
+  u64 links;
+  double dist_before = compact_dist(mem, &order, NULL, &links);
+
+  // Copies the nodes aside, relocated, then back to the start of the heap
+  u64* copy = malloc((next + 1) * sizeof(u64));
+  assert(copy);
+  for (u64 k = 0; k < order.size; ++k) {
+    u64 base = order.data[k] >> 4;
+    u64 size = order.data[k] & 0xF;
+    for (u64 i = 0; i < size; ++i) {
+      copy[fwd[base] + i] = compact_lnk(fwd, used, mem->node[base + i]);
     }
-    #else
+  }
+  Lnk root_lnk = compact_lnk(fwd, used, mem->node[compact_root]);
+  if (compact_root < next) {
+    copy[compact_root] = root_lnk;
+  }
+  memcpy(mem->node, copy, next * sizeof(u64));
+  mem->node[compact_root] = root_lnk;
+  double dist_after = compact_dist(mem, &order, fwd, &links);
 
-    for (u64 i = 0; i < rec_size; ++i) {
-      link(mem, rec_locs[i], normal_go(mem, rec_locs[i], sidx, slen));
+  // Moves the marks of the current normal() pass along
+  u64 words = (used + 63) / 64;
+  Stk seen;
+  stk_init(&seen);
+  for (u64 w = 0; w < words; ++w) {
+    for (u64 bits = normal_seen_data[w]; bits != 0; bits &= bits - 1) {
+      u64 loc = fwd[w * 64 + __builtin_ctzll(bits)];
+      if (loc != -1) {
+        stk_push(&seen, loc);
+      }
     }
+  }
+  memset(normal_seen_data, 0, words * sizeof(u64));
+  for (u64 i = 0; i < seen.size; ++i) {
+    set_bit(normal_seen_data, seen.data[i]);
+  }
+  stk_free(&seen);
 
-    #endif
+  // Forgets the free blocks. If the host sits above the moved nodes, the words
+  // between them become the worker's chunk. The rest goes back to the OS.
+  for (u64 a = 0; a < MAX_ARITY; ++a) {
+    mem->free[a] = FREE_NONE;
+  }
+  mem->freed = 0;
+  mem->trim = 0;
+  mem->zero = FREE_NONE;
+  if (compact_root >= next) {
+    mem->next = next;
+    mem->last = compact_root;
+    heap_used = compact_root + 1;
+    compact_trim(mem, next, compact_root);
+  } else {
+    mem->next = 0;
+    mem->last = 0;
+    heap_used = next;
+  }
+  compact_trim(mem, heap_used, used);
+
+  #ifndef HVM_LIBRARY
+  fprintf(stderr, "Compact: %"PRIu64" -> %"PRIu64" words (%"PRIu64"%% free -> 0%%), ", taken, heap_used, free_words * 100 / taken);
+  fprintf(stderr, "avg. link distance %.1f -> %.1f words.\n", links ? dist_before / links : 0, links ? dist_after / links : 0);
+  #endif
+
+  stk_free(&order);
+  stk_free(&visit);
+  free(copy);
+  free(fwd);
+}
 
-    return term;
+// Called by reduce() every COMPACT_INTERVAL rewrites
+void compact_check(Worker* mem, u64* root, u64* host) {
+  compact_next = mem->cost + COMPACT_INTERVAL;
+  if (compact_root == -1 || compact_depth > 1) {
+    return;
+  }
+  u64 used = heap_used - (mem->last - mem->next);
+  if (mem->freed * 100 >= used * COMPACT_THRESHOLD) {
+    compact(mem, root, host);
   }
 }
 
-Lnk normal(Worker* mem, u64 host, u64 sidx, u64 slen) {
+#endif
+
+Lnk normal(Worker* mem, u64 host) {
+  #ifdef PARALLEL
   // In order to allow parallelization of numeric operations, reduce() will treat OP2 as a CTR if
   // there is enough thread space. So, for example, normalizing a recursive "sum" function with 4
   // threads might return something like `(+ (+ 64 64) (+ 64 64))`. reduce() will treat the first
   // 2 layers as CTRs, allowing normal() to parallelize them. So, in order to finish the reduction,
   // we call `normal_go()` a second time, with no thread space, to eliminate lasting redexes.
   normal_init();
-  normal_go(mem, host, sidx, slen);
+  atomic_store(&normal_pending, 1);
+  deq_push(&mem->deque, Task(host, MAX_WORKERS * NORMAL_SPLIT_FACTOR));
+  for (u64 tid = 1; tid < MAX_WORKERS; ++tid) {
+    worker_wake(tid);
+  }
+  normal_work(mem);
+  for (u64 tid = 1; tid < MAX_WORKERS; ++tid) {
+    worker_wait(tid);
+  }
+  normal_done();
+  #endif
   normal_init();
-  return normal_go(mem, host, 0, 1);
+  Lnk done = normal_go(mem, host, 1);
+  normal_done();
+  return done;
 }
 
+// Batches
+// -------
+// A batch is a list of independent terms, such as many calls to Main. Rather
+// than splitting each one, workers take whole terms, in order, and normalize
+// them sequentially, each allocating on its own chunks of the heap.
 
-#ifdef PARALLEL
-
-// Normalizes in a separate thread
-// Note that, right now, the allocator will just partition the space of the
-// normal form equally among threads, which will not fully use the CPU cores in
-// many cases. A better task scheduler should be implemented. See Issues.
-void normal_fork(u64 tid, u64 host, u64 sidx, u64 slen) {
-  pthread_mutex_lock(&workers[tid].has_work_mutex);
-  workers[tid].has_work = (sidx << 48) | (slen << 32) | host;
-  pthread_cond_signal(&workers[tid].has_work_signal);
-  pthread_mutex_unlock(&workers[tid].has_work_mutex);
-}
+u64* batch_hosts;
+u64  batch_size;
+u64  batch_next;
 
-// Waits the result of a forked normalizer
-u64 normal_join(u64 tid) {
+// Normalizes terms of the current batch until none is left
+void batch_work(Worker* mem) {
   while (1) {
-    pthread_mutex_lock(&workers[tid].has_result_mutex);
-    while (workers[tid].has_result == -1) {
-      pthread_cond_wait(&workers[tid].has_result_signal, &workers[tid].has_result_mutex);
+    u64 i = __atomic_fetch_add(&batch_next, 1, __ATOMIC_RELAXED);
+    if (i >= batch_size) {
+      return;
     }
-    u64 done = workers[tid].has_result;
-    workers[tid].has_result = -1;
-    pthread_mutex_unlock(&workers[tid].has_result_mutex);
-    return done;
+    normal_go(mem, batch_hosts[i], 1);
   }
 }
 
+
+#ifdef PARALLEL
+
+// Asks a worker to help with the current normal() pass
+void worker_wake(u64 tid) {
+  mail_send(&workers[tid].has_work, MAIL_WORK);
+}
+
+// Waits a worker to run out of tasks of the current normal() pass
+void worker_wait(u64 tid) {
+  mail_recv(&workers[tid].has_result);
+}
+
 // Stops a worker
 void worker_stop(u64 tid) {
-  pthread_mutex_lock(&workers[tid].has_work_mutex);
-  workers[tid].has_work = -2;
-  pthread_cond_signal(&workers[tid].has_work_signal);
-  pthread_mutex_unlock(&workers[tid].has_work_mutex);
+  mail_send(&workers[tid].has_work, MAIL_STOP);
 }
 
 // The normalizer worker
 void *worker(void *arg) {
   u64 tid = (u64)arg;
-  while (1) {
-    pthread_mutex_lock(&workers[tid].has_work_mutex);
-    while (workers[tid].has_work == -1) {
-      pthread_cond_wait(&workers[tid].has_work_signal, &workers[tid].has_work_mutex);
-    }
-    u64 work = workers[tid].has_work;
-    if (work == -2) {
-      break;
+  u32 msg;
+  while ((msg = mail_recv(&workers[tid].has_work)) != MAIL_STOP) {
+    if (msg == MAIL_BATCH) {
+      batch_work(&workers[tid]);
     } else {
-      u64 sidx = (work >> 48) & 0xFFFF;
-      u64 slen = (work >> 32) & 0xFFFF;
-      u64 host = (work >>  0) & 0xFFFFFFFF;
-      workers[tid].has_result = normal_go(&workers[tid], host, sidx, slen);
-      workers[tid].has_work = -1;
-      pthread_cond_signal(&workers[tid].has_result_signal);
-      pthread_mutex_unlock(&workers[tid].has_work_mutex);
+      normal_work(&workers[tid]);
     }
+    mail_send(&workers[tid].has_result, MAIL_DONE);
   }
   return 0;
 }
 
 #endif
 
+// Snapshots
+// ---------
+// A snapshot holds the used heap, the root of a term in it and the free lists,
+// so that a later process can restore it and keep reducing. The file starts
+// with a header of SNAPSHOT_HEADER bytes, followed by the heap words, padded
+// to a multiple of SNAPSHOT_HEADER. Since that is a multiple of the page size,
+// the heap part can be mapped, copy-on-write, right into the reserved heap, so
+// restoring costs nothing until pages are touched, and concurrent processes
+// share the clean ones. Snapshots are only valid for the same compiled program,
+// so the header holds its fingerprint (see rulebook::fingerprint), and others
+// are refused.
+
+#define SNAPSHOT_MAGIC (0x50414E534D5648) // "HVMSNAP"
+#define SNAPSHOT_VERSION (1)
+#define SNAPSHOT_HEADER (0x10000)
+#define SNAPSHOT_BOOK ((u64) /*! GENERATED_BOOK_HASH */ 0 /* GENERATED_BOOK_HASH !*/)
+
+// Free lists restored by snapshot_load(), which the next ffi_normal() hands
+// to its first worker
+u64 snapshot_free[MAX_ARITY];
+u64 snapshot_freed;
+
+u64 snapshot_bytes(u64 size) {
+  return (size * sizeof(u64) + SNAPSHOT_HEADER - 1) / SNAPSHOT_HEADER * SNAPSHOT_HEADER;
+}
+
+// Gives back the unused tails of the workers' chunks, and the ranges left by
+// heap_trim(), so that they are neither saved as dead space nor leaked on
+// restore. Tails at the top of the heap are cut off it; the rest is split into
+// 2-word blocks, the size most nodes have, on the free lists.
+void snapshot_trim(void) {
+  for (u8 cut = 1; cut;) {
+    cut = 0;
+    for (u64 t = 0; t < MAX_WORKERS; ++t) {
+      if (workers[t].next < workers[t].last && workers[t].last == heap_used) {
+        heap_used = workers[t].next;
+        workers[t].last = workers[t].next;
+        cut = 1;
+      }
+    }
+  }
+  for (u64 t = 0; t < MAX_WORKERS; ++t) {
+    while (workers[t].next < workers[t].last) {
+      u64 size = workers[t].last - workers[t].next < 2 ? 1 : 2;
+      clear(&workers[t], workers[t].next, size);
+      workers[t].next += size;
+    }
+    for (u64 zero = workers[t].zero; zero != FREE_NONE;) {
+      u64 end = heap_node[zero + 0];
+      u64 rest = heap_node[zero + 1];
+      for (u64 loc = zero; loc < end;) {
+        u64 size = end - loc < 2 ? 1 : 2;
+        clear(&workers[t], loc, size);
+        loc += size;
+      }
+      zero = rest;
+    }
+    workers[t].zero = FREE_NONE;
+  }
+}
+
+// Saves the heap and the term at `host`. The workers' free lists are merged,
+// one per size, which is fine since ffi_normal() resets them anyway.
+void snapshot_save(const char* path, u64 host) {
+  snapshot_trim();
+  u64 head[SNAPSHOT_HEADER / sizeof(u64)] = {0};
+  head[0] = SNAPSHOT_MAGIC;
+  head[1] = SNAPSHOT_VERSION;
+  #ifdef WIDE_LNK
+  head[2] = 1;
+  #endif
+  head[3] = heap_used;
+  head[4] = host;
+  for (u64 t = 0; t < MAX_WORKERS; ++t) {
+    head[5] += workers[t].freed;
+  }
+  head[6] = FREE_NONE;
+  for (u64 size = 1; size < MAX_ARITY; ++size) {
+    u64 list = FREE_NONE;
+    for (u64 t = 0; t < MAX_WORKERS; ++t) {
+      u64 loc = workers[t].free[size];
+      if (loc != FREE_NONE) {
+        while (heap_node[loc + size - 1] != FREE_NONE) {
+          loc = heap_node[loc + size - 1];
+        }
+        heap_node[loc + size - 1] = list;
+        list = workers[t].free[size];
+        workers[t].free[size] = FREE_NONE;
+      }
+    }
+    workers[0].free[size] = list;
+    head[6 + size] = list;
+  }
+  head[6 + MAX_ARITY] = SNAPSHOT_BOOK;
+  for (u64 t = 0; t < MAX_WORKERS; ++t) {
+    workers[t].freed = t == 0 ? head[5] : 0;
+  }
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Can't write snapshot '%s'.\n", path);
+    exit(1);
+  }
+  u64 bytes = snapshot_bytes(heap_used);
+  u8  zero[SNAPSHOT_HEADER] = {0};
+  u8  done = fwrite(head, 1, SNAPSHOT_HEADER, file) == SNAPSHOT_HEADER
+          && fwrite(heap_node, sizeof(u64), heap_used, file) == heap_used
+          && fwrite(zero, 1, bytes - heap_used * sizeof(u64), file) == bytes - heap_used * sizeof(u64);
+  if (fclose(file) != 0 || !done) {
+    fprintf(stderr, "Can't write snapshot '%s'.\n", path);
+    exit(1);
+  }
+}
+
+// Maps a snapshot into the heap reserved by heap_alloc(), and returns the host
+// of its term. Its free lists are kept for the next ffi_normal().
+u64 snapshot_load(const char* path) {
+  u64 head[SNAPSHOT_HEADER / sizeof(u64)];
+  FILE* file = fopen(path, "rb");
+  if (file == NULL || fread(head, 1, SNAPSHOT_HEADER, file) != SNAPSHOT_HEADER || head[0] != SNAPSHOT_MAGIC) {
+    fprintf(stderr, "Can't read snapshot '%s'.\n", path);
+    exit(1);
+  }
+  #ifdef WIDE_LNK
+  u64 wide = 1;
+  #else
+  u64 wide = 0;
+  #endif
+  if (head[1] != SNAPSHOT_VERSION || head[2] != wide) {
+    fprintf(stderr, "Snapshot '%s' was saved by an incompatible runtime.\n", path);
+    exit(1);
+  }
+  if (head[6 + MAX_ARITY] != SNAPSHOT_BOOK) {
+    fprintf(stderr, "Snapshot '%s' was saved by another program.\n", path);
+    exit(1);
+  }
+  u64 size = head[3];
+  u64 bytes = snapshot_bytes(size);
+  if (bytes > HEAP_SIZE) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  // Pages mapped past the end of the file would raise SIGBUS once touched
+  struct stat info;
+  if (fstat(fileno(file), &info) != 0 || (u64)info.st_size < SNAPSHOT_HEADER + bytes) {
+    fprintf(stderr, "Snapshot '%s' is truncated.\n", path);
+    exit(1);
+  }
+  if (bytes > 0 && mmap(heap_node, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(file), SNAPSHOT_HEADER) == MAP_FAILED) {
+    fprintf(stderr, "Can't map snapshot '%s'.\n", path);
+    exit(1);
+  }
+  fclose(file);
+  heap_used = size;
+  heap_done = bytes / sizeof(u64);
+  snapshot_freed = head[5];
+  for (u64 a = 0; a < MAX_ARITY; ++a) {
+    snapshot_free[a] = head[6 + a];
+  }
+  return head[4];
+}
+
+// Profiling
+// ---------
+// With `-DPROFILE`, workers_stats() also sums the counters of the workers, and
+// prof_report() prints them, sorted by count, as text on stderr. If the
+// HVM_PROFILE environment variable is set, they are also written to the file it
+// names, as JSON. Rules are numbered in order, from 0, by function, where the
+// functions include those rulebook.rs splits off from user-defined ones.
+
+#ifdef PROFILE
+
+const char* prof_kind_name[PROF_KINDS] = {
+  [PROF_CAL_RULE]  = "CAL-RULE",
+  [PROF_CAL_PAR]   = "CAL-PAR",
+  [PROF_APP_LAM]   = "APP-LAM",
+  [PROF_APP_PAR]   = "APP-PAR",
+  [PROF_DUP_LAM]   = "DUP-LAM",
+  [PROF_DUP_PAR]   = "DUP-PAR",
+  [PROF_DUP_SUP]   = "DUP-SUP",
+  [PROF_DUP_NUM]   = "DUP-NUM",
+  [PROF_DUP_CTR]   = "DUP-CTR",
+  [PROF_OP2_U32]   = "OP2-U32",
+  [PROF_OP2_NUM]   = "OP2-NUM",
+  [PROF_OP2_SUP_0] = "OP2-SUP-0",
+  [PROF_OP2_SUP_1] = "OP2-SUP-1",
+};
+
+// The totals of every worker, as of the last workers_stats(). Rule counts are
+// keyed by `fun << 32 | rule`.
+u64 prof_kind[PROF_KINDS];
+u64 prof_alloc[MAX_ARITY];
+u64 prof_reuse[MAX_ARITY];
+Map prof_rule_total;
+
+void prof_rule(Worker* mem, u64 fun, u64 rule) {
+  u64 key = (fun << 32) | rule;
+  u64 count = map_get(&mem->prof_rule, key);
+  map_set(&mem->prof_rule, key, count == (u64)-1 ? 1 : count + 1);
+}
+
+void prof_map_clear(Map* map) {
+  if (map->keys == NULL) {
+    map_init(map);
+  } else {
+    memset(map->keys, 0xFF, map->mcap * sizeof(u64));
+    map->size = 0;
+  }
+}
+
+void prof_reset(Worker* mem) {
+  memset(mem->prof_kind, 0, sizeof(mem->prof_kind));
+  memset(mem->prof_alloc, 0, sizeof(mem->prof_alloc));
+  memset(mem->prof_reuse, 0, sizeof(mem->prof_reuse));
+  prof_map_clear(&mem->prof_rule);
+}
+
+void prof_stats(void) {
+  memset(prof_kind, 0, sizeof(prof_kind));
+  memset(prof_alloc, 0, sizeof(prof_alloc));
+  memset(prof_reuse, 0, sizeof(prof_reuse));
+  prof_map_clear(&prof_rule_total);
+  for (u64 tid = 0; tid < MAX_WORKERS; ++tid) {
+    Worker* mem = &workers[tid];
+    for (u64 k = 0; k < PROF_KINDS; ++k) {
+      prof_kind[k] += mem->prof_kind[k];
+    }
+    for (u64 s = 0; s < MAX_ARITY; ++s) {
+      prof_alloc[s] += mem->prof_alloc[s];
+      prof_reuse[s] += mem->prof_reuse[s];
+    }
+    for (u64 i = 0; mem->prof_rule.keys != NULL && i < mem->prof_rule.mcap; ++i) {
+      u64 key = mem->prof_rule.keys[i];
+      if (key != MAP_NONE) {
+        u64 count = map_get(&prof_rule_total, key);
+        map_set(&prof_rule_total, key, (count == (u64)-1 ? 0 : count) + mem->prof_rule.vals[i]);
+      }
+    }
+  }
+}
+
+// Sorts (count, key) pairs by decreasing count, then by key
+int prof_entry_cmp(const void* a, const void* b) {
+  const u64* x = a;
+  const u64* y = b;
+  if (x[0] != y[0]) {
+    return x[0] > y[0] ? -1 : 1;
+  }
+  return x[1] < y[1] ? -1 : x[1] > y[1] ? 1 : 0;
+}
+
+void prof_report(char** id_to_name_data, u64 id_to_name_size) {
+  u64 total = 0;
+  for (u64 k = 0; k < PROF_KINDS; ++k) {
+    total += prof_kind[k];
+  }
+  double pct = total > 0 ? 100.0 / (double)total : 0.0;
+
+  // Sorts the kinds and the rules by count
+  u64 kinds[PROF_KINDS][2];
+  for (u64 k = 0; k < PROF_KINDS; ++k) {
+    kinds[k][0] = prof_kind[k];
+    kinds[k][1] = k;
+  }
+  qsort(kinds, PROF_KINDS, 2 * sizeof(u64), prof_entry_cmp);
+  u64  rules_size = 0;
+  u64 (*rules)[2] = malloc((prof_rule_total.size + 1) * 2 * sizeof(u64));
+  assert(rules);
+  for (u64 i = 0; i < prof_rule_total.mcap; ++i) {
+    if (prof_rule_total.keys[i] != MAP_NONE) {
+      rules[rules_size][0] = prof_rule_total.vals[i];
+      rules[rules_size][1] = prof_rule_total.keys[i];
+      rules_size++;
+    }
+  }
+  qsort(rules, rules_size, 2 * sizeof(u64), prof_entry_cmp);
+
+  // Text
+  fprintf(stderr, "Interactions:\n");
+  for (u64 i = 0; i < PROF_KINDS && kinds[i][0] > 0; ++i) {
+    fprintf(stderr, "  %-24s %14"PRIu64" %6.2f%%\n", prof_kind_name[kinds[i][1]], kinds[i][0], kinds[i][0] * pct);
+  }
+  fprintf(stderr, "Rules:\n");
+  for (u64 i = 0; i < rules_size; ++i) {
+    u64 fun = rules[i][1] >> 32;
+    const char* name = fun < id_to_name_size && id_to_name_data[fun] != NULL ? id_to_name_data[fun] : "?";
+    char label[256];
+    snprintf(label, sizeof(label), "%s#%"PRIu64, name, rules[i][1] & 0xFFFFFFFF);
+    fprintf(stderr, "  %-24s %14"PRIu64" %6.2f%%\n", label, rules[i][0], rules[i][0] * pct);
+  }
+  fprintf(stderr, "Allocs (words: count, reused from free lists):\n");
+  for (u64 s = 1; s < MAX_ARITY; ++s) {
+    if (prof_alloc[s] > 0) {
+      fprintf(stderr, "  %2"PRIu64": %14"PRIu64" %14"PRIu64"\n", s, prof_alloc[s], prof_reuse[s]);
+    }
+  }
+  fprintf(stderr, "\n");
+
+  // JSON
+  char* path = getenv("HVM_PROFILE");
+  if (path != NULL) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Can't write the profile to '%s'.\n", path);
+    } else {
+      fprintf(out, "{\n  \"rewrites\": %"PRIu64",\n  \"interactions\": [", total);
+      for (u64 i = 0; i < PROF_KINDS && kinds[i][0] > 0; ++i) {
+        fprintf(out, "%s\n    {\"kind\": \"%s\", \"count\": %"PRIu64"}", i > 0 ? "," : "", prof_kind_name[kinds[i][1]], kinds[i][0]);
+      }
+      fprintf(out, "\n  ],\n  \"rules\": [");
+      for (u64 i = 0; i < rules_size; ++i) {
+        u64 fun = rules[i][1] >> 32;
+        const char* name = fun < id_to_name_size && id_to_name_data[fun] != NULL ? id_to_name_data[fun] : "?";
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"rule\": %"PRIu64", \"count\": %"PRIu64"}", i > 0 ? "," : "", name, rules[i][1] & 0xFFFFFFFF, rules[i][0]);
+      }
+      fprintf(out, "\n  ],\n  \"allocs\": [");
+      for (u64 s = 1, first = 1; s < MAX_ARITY; ++s) {
+        if (prof_alloc[s] > 0) {
+          fprintf(out, "%s\n    {\"size\": %"PRIu64", \"count\": %"PRIu64", \"reused\": %"PRIu64"}", first ? "" : ",", s, prof_alloc[s], prof_reuse[s]);
+          first = 0;
+        }
+      }
+      fprintf(out, "\n  ]\n}\n");
+      fclose(out);
+    }
+  }
+
+  free(rules);
+}
+
+#endif // PROFILE
+
 u64 ffi_cost;
 u64 ffi_size;
 
-void ffi_normal(u8* mem_data, u32 mem_size, u32 host) {
-
-  // Init thread objects
+// Resets the allocation state of every worker, as if only the first
+// `mem_size` words of the heap were ever taken
+void workers_reset(Lnk* mem_data, u64 mem_size) {
+  heap_used = mem_size;
   for (u64 t = 0; t < MAX_WORKERS; ++t) {
     workers[t].tid = t;
     workers[t].size = t == 0 ? (u64)mem_size : 0l;
-    workers[t].node = (u64*)mem_data;
+    workers[t].next = 0;
+    workers[t].last = 0;
+    workers[t].trim = 0;
+    workers[t].zero = FREE_NONE;
+    workers[t].node = mem_data;
     for (u64 a = 0; a < MAX_ARITY; ++a) {
-      stk_init(&workers[t].free[a]);
+      workers[t].free[a] = FREE_NONE;
     }
+    workers[t].freed = 0;
     workers[t].cost = 0;
-    #ifdef PARALLEL
-    workers[t].has_work = -1;
-    pthread_mutex_init(&workers[t].has_work_mutex, NULL);
-    pthread_cond_init(&workers[t].has_work_signal, NULL);
-    workers[t].has_result = -1;
-    pthread_mutex_init(&workers[t].has_result_mutex, NULL);
-    pthread_cond_init(&workers[t].has_result_signal, NULL);
-    // workers[t].thread = NULL;
+    #ifdef PROFILE
+    prof_reset(&workers[t]);
     #endif
   }
+}
 
-  // Spawns threads
+// Allocates the stacks of every worker, and spawns their threads, which then
+// wait for normal() passes until workers_stop()
+void workers_start(void) {
+  for (u64 t = 0; t < MAX_WORKERS; ++t) {
+    reduce_stack_alloc(&workers[t].stack);
+    #ifdef PARALLEL
+    atomic_init(&workers[t].has_work, MAIL_NONE);
+    atomic_init(&workers[t].has_result, MAIL_NONE);
+    deq_init(&workers[t].deque);
+    #endif
+  }
   #ifdef PARALLEL
+  spin_limit = MAX_WORKERS <= sysconf(_SC_NPROCESSORS_ONLN) ? SPIN_LIMIT : 0;
   for (u64 tid = 1; tid < MAX_WORKERS; ++tid) {
     pthread_create(&workers[tid].thread, NULL, &worker, (void*)tid);
   }
   #endif
+}
 
-  // Normalizes trm
-  normal(&workers[0], (u64) host, 0, MAX_WORKERS);
+void workers_stop(void) {
+  #ifdef PARALLEL
 
-  // Computes total cost and size
+  // Asks workers to stop
+  for (u64 tid = 1; tid < MAX_WORKERS; ++tid) {
+    worker_stop(tid);
+  }
+
+  // Waits workers to stop
+  for (u64 tid = 1; tid < MAX_WORKERS; ++tid) {
+    pthread_join(workers[tid].thread, NULL);
+  }
+
+  #endif
+
+  // Clears workers
+  for (u64 tid = 0; tid < MAX_WORKERS; ++tid) {
+    reduce_stack_free(&workers[tid].stack);
+    #ifdef PARALLEL
+    deq_free(&workers[tid].deque);
+    #endif
+  }
+}
+
+// Computes the total cost and size of the workers
+void workers_stats(void) {
   ffi_cost = 0;
   ffi_size = 0;
   for (u64 tid = 0; tid < MAX_WORKERS; ++tid) {
     ffi_cost += workers[tid].cost;
     ffi_size += workers[tid].size;
   }
+  #ifdef PROFILE
+  prof_stats();
+  #endif
+}
 
-  #ifdef PARALLEL
+// Normalizes the term at `host`. The memory must come from heap_alloc(), and
+// its first `mem_size` words must be committed and in use. The worker threads
+// only live for this call; see hvm_init() to keep them.
+void ffi_normal(u8* mem_data, u64 mem_size, u64 host) {
 
-  // Asks workers to stop
+  // Init thread objects
+  workers_reset((Lnk*)mem_data, mem_size);
+  if (snapshot_freed > 0) {
+    for (u64 a = 0; a < MAX_ARITY; ++a) {
+      workers[0].free[a] = snapshot_free[a];
+    }
+    workers[0].freed = snapshot_freed;
+    snapshot_freed = 0;
+  }
+
+  // Spawns threads
+  workers_start();
+
+  // Normalizes trm. Nothing else lives on the heap, so it may be compacted.
+  #ifdef COMPACT
+  compact_root = host;
+  compact_next = COMPACT_INTERVAL;
+  #endif
+  normal(&workers[0], (u64) host);
+  #ifdef COMPACT
+  compact_root = -1;
+  #endif
+
+  // Computes total cost and size
+  workers_stats();
+
+  // Stops threads
+  workers_stop();
+}
+
+// Normalizes the terms at `hosts`, spreading them over the workers. The memory
+// is as in ffi_normal().
+void ffi_batch(u8* mem_data, u64 mem_size, u64* hosts, u64 size) {
+  workers_reset((Lnk*)mem_data, mem_size);
+  workers_start();
+  batch_hosts = hosts;
+  batch_size = size;
+  batch_next = 0;
+  normal_init();
+  #ifdef PARALLEL
   for (u64 tid = 1; tid < MAX_WORKERS; ++tid) {
-    worker_stop(tid);
+    mail_send(&workers[tid].has_work, MAIL_BATCH);
+  }
+  #endif
+  batch_work(&workers[0]);
+  #ifdef PARALLEL
+  for (u64 tid = 1; tid < MAX_WORKERS; ++tid) {
+    worker_wait(tid);
+  }
+  #endif
+  normal_done();
+  workers_stats();
+  workers_stop();
+}
+
+// Readback
+// --------
+
+// Numbers the λ-bound variables of a term, in the order readback_term() first
+// meets their binders. Subterms left to visit are kept on a work stack.
+void readback_vars(Map* vars, Worker* mem, Lnk term, Map* seen) {
+  Stk work;
+  stk_init(&work);
+  stk_push(&work, term);
+  while (work.size > 0) {
+    term = stk_pop(&work);
+    //printf("- readback_vars %llu ", get_loc(term,0)); debug_print_lnk(term); printf("\n");
+    if (map_get(seen, term) != -1) {
+      continue;
+    }
+    map_set(seen, term, 1);
+    switch (get_tag(term)) {
+      case LAM: {
+        u64 argm = ask_arg(mem, term, 0);
+        u64 body = ask_arg(mem, term, 1);
+        if (get_tag(argm) != ERA) {
+          map_set(vars, Var(get_loc(term, 0)), vars->size);
+        };
+        stk_push(&work, body);
+        break;
+      }
+      case APP: case PAR: case OP2: {
+        stk_push(&work, ask_arg(mem, term, 1));
+        stk_push(&work, ask_arg(mem, term, 0));
+        break;
+      }
+      case DP0: case DP1: {
+        stk_push(&work, ask_arg(mem, term, 2));
+        break;
+      }
+      case CTR: case CAL: {
+        u64 arity = get_ari(term);
+        for (u64 i = arity; i > 0; --i) {
+          stk_push(&work, ask_arg(mem, term, i-1));
+        }
+        break;
+      }
+    }
+  }
+  stk_free(&work);
+}
+
+void readback_oper(FILE* out, u64 oper) {
+  switch (oper) {
+    case ADD: { fputc('+', out); break; }
+    case SUB: { fputc('-', out); break; }
+    case MUL: { fputc('*', out); break; }
+    case DIV: { fputc('/', out); break; }
+    case MOD: { fputc('%', out); break; }
+    case AND: { fputc('&', out); break; }
+    case OR: { fputc('|', out); break; }
+    case XOR: { fputc('^', out); break; }
+    case SHL: { fputs("<<", out); break; }
+    case SHR: { fputs(">>", out); break; }
+    case LTN: { fputc('<', out); break; }
+    case LTE: { fputs("<=", out); break; }
+    case EQL: { fputs("==", out); break; }
+    case GTE: { fputs(">=", out); break; }
+    case GTN: { fputc('>', out); break; }
+    case NEQ: { fputs("!=", out); break; }
+  }
+}
+
+// Prints a float as the shortest literal that reads back to it, in the form of
+// Rust's `{:?}`, so both runtimes print alike. NaN and the infinities have no
+// literals, so they're printed as the divisions that make them.
+void readback_f32(FILE* out, float val) {
+  if (val != val) {
+    fputs("(/ 0.0 0.0)", out);
+    return;
+  }
+  if (val - val != 0) {
+    fputs(val > 0 ? "(/ 1.0 0.0)" : "(/ -1.0 0.0)", out);
+    return;
+  }
+  // Finds the fewest significant digits that read back, as in "d.ddde+XX"
+  char text[32];
+  for (int prec = 0; prec < 9; ++prec) {
+    snprintf(text, sizeof(text), "%.*e", prec, val);
+    if (strtof(text, NULL) == val) {
+      break;
+    }
+  }
+  char* mark = strchr(text, 'e');
+  int exp = atoi(mark + 1);
+  *mark = '\0';
+  char digits[16];
+  int size = 0;
+  for (char* chr = text; *chr != '\0'; ++chr) {
+    if (*chr >= '0' && *chr <= '9') {
+      digits[size++] = *chr;
+    }
   }
-
-  // Waits workers to stop
-  for (u64 tid = 1; tid < MAX_WORKERS; ++tid) {
-    pthread_join(workers[tid].thread, NULL);
+  digits[size] = '\0';
+  if (text[0] == '-') {
+    fputc('-', out);
   }
-
-  #endif
-
-  // Clears workers
-  for (u64 tid = 0; tid < MAX_WORKERS; ++tid) {
-    for (u64 a = 0; a < MAX_ARITY; ++a) {
-      stk_free(&workers[tid].free[a]);
+  if (exp < -4 || exp >= 16) {
+    fputc(digits[0], out);
+    if (size > 1) {
+      fprintf(out, ".%s", digits + 1);
     }
-    #ifdef PARALLEL
-    pthread_mutex_destroy(&workers[tid].has_work_mutex);
-    pthread_cond_destroy(&workers[tid].has_work_signal);
-    pthread_mutex_destroy(&workers[tid].has_result_mutex);
-    pthread_cond_destroy(&workers[tid].has_result_signal);
-    #endif
+    fprintf(out, "e%d", exp);
+  } else if (exp < 0) {
+    fputs("0.", out);
+    for (int i = 1; i < -exp; ++i) {
+      fputc('0', out);
+    }
+    fputs(digits, out);
+  } else {
+    for (int i = 0; i <= exp; ++i) {
+      fputc(i < size ? digits[i] : '0', out);
+    }
+    fprintf(out, ".%s", size > exp + 1 ? digits + exp + 1 : "0");
   }
 }
 
-// Readback
-// --------
+// readback_term() keeps what is left to print on a work stack, as pairs of an
+// argument and one of these actions, so that deep terms don't recurse
+#define READBACK_TERM (0) // prints a term
+#define READBACK_CHAR (1) // prints a character
+#define READBACK_OPER (2) // prints an operator
+#define READBACK_DIR  (3) // pushes direction `arg & 1` to dirs[arg >> 1]
+#define READBACK_UNDIR (4) // pops a direction from dirs[arg]
+
+void readback_work(Stk* work, u64 action, u64 arg) {
+  stk_push(work, arg);
+  stk_push(work, action);
+}
 
-void readback_vars(Stk* vars, Worker* mem, Lnk term, Stk* seen) {
-  //printf("- readback_vars %llu ", get_loc(term,0)); debug_print_lnk(term); printf("\n");
-  if (stk_find(seen, term) != -1) { // FIXME: probably very slow, change to a proper hashmap
-    return;
-  } else {
-    stk_push(seen, term);
+void readback_term(FILE* out, Worker* mem, Lnk term, Map* vars, Stk* dirs, char** id_to_name_data, u64 id_to_name_mcap) {
+  Stk work;
+  stk_init(&work);
+  readback_work(&work, READBACK_TERM, term);
+  while (work.size > 0) {
+    u64 action = stk_pop(&work);
+    u64 arg = stk_pop(&work);
+    switch (action) {
+      case READBACK_CHAR: {
+        fputc(arg, out);
+        continue;
+      }
+      case READBACK_OPER: {
+        readback_oper(out, arg);
+        continue;
+      }
+      case READBACK_DIR: {
+        stk_push(&dirs[arg >> 1], arg & 1);
+        continue;
+      }
+      case READBACK_UNDIR: {
+        stk_pop(&dirs[arg]);
+        continue;
+      }
+    }
+    term = arg;
+    //printf("- readback_term: "); debug_print_lnk(term); printf("\n");
     switch (get_tag(term)) {
       case LAM: {
-        u64 argm = ask_arg(mem, term, 0);
-        u64 body = ask_arg(mem, term, 1);
-        if (get_tag(argm) != ERA) {
-          stk_push(vars, Var(get_loc(term, 0)));
+        fputc('%', out);
+        if (get_tag(ask_arg(mem, term, 0)) == ERA) {
+          fputc('_', out);
+        } else {
+          fprintf(out, "x%"PRIu64, map_get(vars, Var(get_loc(term, 0))));
         };
-        readback_vars(vars, mem, body, seen);
+        fputc(' ', out);
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 1));
         break;
       }
       case APP: {
-        u64 lam = ask_arg(mem, term, 0);
-        u64 arg = ask_arg(mem, term, 1);
-        readback_vars(vars, mem, lam, seen);
-        readback_vars(vars, mem, arg, seen);
+        fputc('(', out);
+        readback_work(&work, READBACK_CHAR, ')');
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 1));
+        readback_work(&work, READBACK_CHAR, ' ');
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 0));
         break;
       }
       case PAR: {
-        u64 arg0 = ask_arg(mem, term, 0);
-        u64 arg1 = ask_arg(mem, term, 1);
-        readback_vars(vars, mem, arg0, seen);
-        readback_vars(vars, mem, arg1, seen);
+        u64 col = get_ext(term);
+        if (dirs[col].size > 0) {
+          u64 head = stk_pop(&dirs[col]);
+          readback_work(&work, READBACK_DIR, (col << 1) | head);
+          readback_work(&work, READBACK_TERM, ask_arg(mem, term, head == 0 ? 0 : 1));
+        } else {
+          fputc('<', out);
+          readback_work(&work, READBACK_CHAR, '>');
+          readback_work(&work, READBACK_TERM, ask_arg(mem, term, 1));
+          readback_work(&work, READBACK_CHAR, ' ');
+          readback_work(&work, READBACK_TERM, ask_arg(mem, term, 0));
+        }
         break;
       }
-      case DP0: {
-        u64 arg = ask_arg(mem, term, 2);
-        readback_vars(vars, mem, arg, seen);
+      case DP0: case DP1: {
+        u64 col = get_ext(term);
+        stk_push(&dirs[col], get_tag(term) == DP0 ? 0 : 1);
+        readback_work(&work, READBACK_UNDIR, col);
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 2));
         break;
       }
-      case DP1: {
-        u64 arg = ask_arg(mem, term, 2);
-        readback_vars(vars, mem, arg, seen);
+      case OP2: {
+        fputc('(', out);
+        readback_work(&work, READBACK_CHAR, ')');
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 1));
+        readback_work(&work, READBACK_OPER, get_ext(term));
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 0));
         break;
       }
-      case OP2: {
-        u64 arg0 = ask_arg(mem, term, 0);
-        u64 arg1 = ask_arg(mem, term, 1);
-        readback_vars(vars, mem, arg0, seen);
-        readback_vars(vars, mem, arg1, seen);
+      case U32: {
+        //printf("- u32\n");
+        fprintf(out, "%"PRIu64, get_val(term));
+        //printf("- u32 done\n");
+        break;
+      }
+      case F32: {
+        readback_f32(out, get_f32(term));
+        break;
+      }
+      case U60: {
+        fprintf(out, "%"PRIu64"u", get_num(term));
         break;
       }
       case CTR: case CAL: {
-        u64 arity = get_ari(term);
-        for (u64 i = 0; i < arity; ++i) {
-          readback_vars(vars, mem, ask_arg(mem, term, i), seen);
+        u64 func = get_ext(term);
+        u64 arit = get_ari(term);
+        fputc('(', out);
+        if (func < id_to_name_mcap && id_to_name_data[func] != NULL) {
+          fputs(id_to_name_data[func], out);
+        } else {
+          fprintf(out, "$%"PRIu64, func); // TODO: function names
+        }
+        readback_work(&work, READBACK_CHAR, ')');
+        for (u64 i = arit; i > 0; --i) {
+          readback_work(&work, READBACK_TERM, ask_arg(mem, term, i-1));
+          readback_work(&work, READBACK_CHAR, ' ');
         }
         break;
       }
+      case VAR: {
+        fprintf(out, "x%"PRIu64, map_get(vars, term));
+        break;
+      }
+      default: {
+        fputc('?', out);
+        break;
+      }
     }
   }
+  stk_free(&work);
 }
 
-void readback_decimal_go(Stk* chrs, u64 n) {
-  //printf("--- A %llu\n", n);
-  if (n > 0) {
-    readback_decimal_go(chrs, n / 10);
-    stk_push(chrs, '0' + (n % 10));
+// Binary readback
+// ---------------
+// With `--output=bin`, the normal form is written in a binary format instead of
+// text, for programs that consume it (see `readback::from_bin` in the crate).
+// Integers are little-endian. It starts with "HVMB", a version byte and the
+// name table: a u64 count, then, for each id, a u32 length and the name's bytes
+// (length 0 if the id has no name). Then comes the term, in prefix order, each
+// node being a byte with its runtime tag, followed by:
+// - LAM: the variable's index (u64), or -1 if erased, then the body
+// - APP: the function, then the argument
+// - PAR: the color (u32), then both sides
+// - OP2: the operator (u8), then both operands
+// - U32: the number (u32)
+// - F32: the number's bits (u32)
+// - U60: the number (u64)
+// - CTR: the id (u32) and arity (u8), then the arguments
+// - VAR: the variable's index (u64)
+// - NIL: a node that couldn't be read back, with nothing else
+
+#define READBACK_BIN_VERSION (1)
+
+void readback_bin_int(FILE* out, u64 val, u64 size) {
+  for (u64 i = 0; i < size; ++i) {
+    fputc((val >> (i * 8)) & 0xFF, out);
   }
 }
 
-void readback_decimal(Stk* chrs, u64 n) {
-  if (n == 0) {
-    stk_push(chrs, '0');
-  } else {
-    readback_decimal_go(chrs, n);
+void readback_bin_names(FILE* out, char** id_to_name_data, u64 id_to_name_mcap) {
+  fputs("HVMB", out);
+  fputc(READBACK_BIN_VERSION, out);
+  readback_bin_int(out, id_to_name_mcap, 8);
+  for (u64 i = 0; i < id_to_name_mcap; ++i) {
+    u64 size = id_to_name_data[i] != NULL ? strlen(id_to_name_data[i]) : 0;
+    readback_bin_int(out, size, 4);
+    fwrite(id_to_name_data[i], 1, size, out);
   }
 }
 
-void readback_term(Stk* chrs, Worker* mem, Lnk term, Stk* vars, Stk* dirs, char** id_to_name_data, u64 id_to_name_mcap) {
-  //printf("- readback_term: "); debug_print_lnk(term); printf("\n");
-  switch (get_tag(term)) {
-    case LAM: {
-      stk_push(chrs, '%');
-      if (get_tag(ask_arg(mem, term, 0)) == ERA) {
-        stk_push(chrs, '_');
-      } else {
-        stk_push(chrs, 'x');
-        readback_decimal(chrs, stk_find(vars, Var(get_loc(term, 0))));
-      };
-      stk_push(chrs, ' ');
-      readback_term(chrs, mem, ask_arg(mem, term, 1), vars, dirs, id_to_name_data, id_to_name_mcap);
-      break;
-    }
-    case APP: {
-      stk_push(chrs, '(');
-      readback_term(chrs, mem, ask_arg(mem, term, 0), vars, dirs, id_to_name_data, id_to_name_mcap);
-      stk_push(chrs, ' ');
-      readback_term(chrs, mem, ask_arg(mem, term, 1), vars, dirs, id_to_name_data, id_to_name_mcap);
-      stk_push(chrs, ')');
-      break;
+// Like readback_term(), but writes the binary format
+void readback_bin_term(FILE* out, Worker* mem, Lnk term, Map* vars, Stk* dirs) {
+  Stk work;
+  stk_init(&work);
+  readback_work(&work, READBACK_TERM, term);
+  while (work.size > 0) {
+    u64 action = stk_pop(&work);
+    u64 arg = stk_pop(&work);
+    switch (action) {
+      case READBACK_DIR: {
+        stk_push(&dirs[arg >> 1], arg & 1);
+        continue;
+      }
+      case READBACK_UNDIR: {
+        stk_pop(&dirs[arg]);
+        continue;
+      }
     }
-    case PAR: {
-      u64 col = get_ext(term);
-      if (dirs[col].size > 0) {
-        u64 head = stk_pop(&dirs[col]);
-        if (head == 0) {
-          readback_term(chrs, mem, ask_arg(mem, term, 0), vars, dirs, id_to_name_data, id_to_name_mcap);
-          stk_push(&dirs[col], head);
+    term = arg;
+    switch (get_tag(term)) {
+      case LAM: {
+        fputc(LAM, out);
+        if (get_tag(ask_arg(mem, term, 0)) == ERA) {
+          readback_bin_int(out, -1, 8);
         } else {
-          readback_term(chrs, mem, ask_arg(mem, term, 1), vars, dirs, id_to_name_data, id_to_name_mcap);
-          stk_push(&dirs[col], head);
+          readback_bin_int(out, map_get(vars, Var(get_loc(term, 0))), 8);
         }
-      } else {
-        stk_push(chrs, '<');
-        readback_term(chrs, mem, ask_arg(mem, term, 0), vars, dirs, id_to_name_data, id_to_name_mcap);
-        stk_push(chrs, ' ');
-        readback_term(chrs, mem, ask_arg(mem, term, 1), vars, dirs, id_to_name_data, id_to_name_mcap);
-        stk_push(chrs, '>');
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 1));
+        break;
       }
-      break;
-    }
-    case DP0: case DP1: {
-      u64 col = get_ext(term);
-      u64 val = ask_arg(mem, term, 2);
-      stk_push(&dirs[col], get_tag(term) == DP0 ? 0 : 1);
-      readback_term(chrs, mem, ask_arg(mem, term, 2), vars, dirs, id_to_name_data, id_to_name_mcap);
-      stk_pop(&dirs[col]);
-      break;
-    }
-    case OP2: {
-      stk_push(chrs, '(');
-      readback_term(chrs, mem, ask_arg(mem, term, 0), vars, dirs, id_to_name_data, id_to_name_mcap);
-      switch (get_ext(term)) {
-        case ADD: { stk_push(chrs, '+'); break; }
-        case SUB: { stk_push(chrs, '-'); break; }
-        case MUL: { stk_push(chrs, '*'); break; }
-        case DIV: { stk_push(chrs, '/'); break; }
-        case MOD: { stk_push(chrs, '%'); break; }
-        case AND: { stk_push(chrs, '&'); break; }
-        case OR: { stk_push(chrs, '|'); break; }
-        case XOR: { stk_push(chrs, '^'); break; }
-        case SHL: { stk_push(chrs, '<'); stk_push(chrs, '<'); break; }
-        case SHR: { stk_push(chrs, '>'); stk_push(chrs, '>'); break; }
-        case LTN: { stk_push(chrs, '<'); break; }
-        case LTE: { stk_push(chrs, '<'); stk_push(chrs, '='); break; }
-        case EQL: { stk_push(chrs, '='); stk_push(chrs, '='); break; }
-        case GTE: { stk_push(chrs, '>'); stk_push(chrs, '='); break; }
-        case GTN: { stk_push(chrs, '>'); break; }
-        case NEQ: { stk_push(chrs, '!'); stk_push(chrs, '='); break; }
-      }
-      readback_term(chrs, mem, ask_arg(mem, term, 1), vars, dirs, id_to_name_data, id_to_name_mcap);
-      stk_push(chrs, ')');
-      break;
-    }
-    case U32: {
-      //printf("- u32\n");
-      readback_decimal(chrs, get_val(term));
-      //printf("- u32 done\n");
-      break;
-    }
-    case CTR: case CAL: {
-      u64 func = get_ext(term);
-      u64 arit = get_ari(term);
-      stk_push(chrs, '(');
-      if (func < id_to_name_mcap && id_to_name_data[func] != NULL) {
-        for (u64 i = 0; id_to_name_data[func][i] != '\0'; ++i) {
-          stk_push(chrs, id_to_name_data[func][i]);
+      case APP: {
+        fputc(APP, out);
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 1));
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 0));
+        break;
+      }
+      case PAR: {
+        u64 col = get_ext(term);
+        if (dirs[col].size > 0) {
+          u64 head = stk_pop(&dirs[col]);
+          readback_work(&work, READBACK_DIR, (col << 1) | head);
+          readback_work(&work, READBACK_TERM, ask_arg(mem, term, head == 0 ? 0 : 1));
+        } else {
+          fputc(PAR, out);
+          readback_bin_int(out, col, 4);
+          readback_work(&work, READBACK_TERM, ask_arg(mem, term, 1));
+          readback_work(&work, READBACK_TERM, ask_arg(mem, term, 0));
         }
-      } else {
-        stk_push(chrs, '$');
-        readback_decimal(chrs, func); // TODO: function names
+        break;
       }
-      for (u64 i = 0; i < arit; ++i) {
-        stk_push(chrs, ' ');
-        readback_term(chrs, mem, ask_arg(mem, term, i), vars, dirs, id_to_name_data, id_to_name_mcap);
+      case DP0: case DP1: {
+        u64 col = get_ext(term);
+        stk_push(&dirs[col], get_tag(term) == DP0 ? 0 : 1);
+        readback_work(&work, READBACK_UNDIR, col);
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 2));
+        break;
+      }
+      case OP2: {
+        fputc(OP2, out);
+        fputc(get_ext(term), out);
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 1));
+        readback_work(&work, READBACK_TERM, ask_arg(mem, term, 0));
+        break;
+      }
+      case U32: {
+        fputc(U32, out);
+        readback_bin_int(out, get_val(term), 4);
+        break;
+      }
+      case F32: {
+        fputc(F32, out);
+        readback_bin_int(out, get_num(term), 4);
+        break;
+      }
+      case U60: {
+        fputc(U60, out);
+        readback_bin_int(out, get_num(term), 8);
+        break;
+      }
+      case CTR: case CAL: {
+        u64 arit = get_ari(term);
+        fputc(CTR, out);
+        readback_bin_int(out, get_ext(term), 4);
+        fputc(arit, out);
+        for (u64 i = arit; i > 0; --i) {
+          readback_work(&work, READBACK_TERM, ask_arg(mem, term, i-1));
+        }
+        break;
+      }
+      case VAR: {
+        fputc(VAR, out);
+        readback_bin_int(out, map_get(vars, term), 8);
+        break;
+      }
+      default: {
+        fputc(NIL, out);
+        break;
       }
-      stk_push(chrs, ')');
-      break;
-    }
-    case VAR: {
-      stk_push(chrs, 'x');
-      readback_decimal(chrs, stk_find(vars, term));
-      break;
-    }
-    default: {
-      stk_push(chrs, '?');
-      break;
     }
   }
+  stk_free(&work);
 }
 
-void readback(char* code_data, u64 code_mcap, Worker* mem, Lnk term, char** id_to_name_data, u64 id_to_name_mcap) {
+// Prints the normal form of a term to `out`, as it is read back, either as
+// text or, if `bin` is set, in the binary format
+void readback(FILE* out, Worker* mem, Lnk term, char** id_to_name_data, u64 id_to_name_mcap, u8 bin) {
   //printf("reading back\n");
 
   // Used vars
-  Stk seen;
-  Stk chrs;
-  Stk vars;
+  Map seen;
+  Map vars;
   Stk* dirs;
 
   // Initialization
-  stk_init(&seen);
-  stk_init(&chrs);
-  stk_init(&vars);
+  map_init(&seen);
+  map_init(&vars);
   dirs = (Stk*)malloc(sizeof(Stk) * DIRS_MCAP);
   assert(dirs);
   for (u64 i = 0; i < DIRS_MCAP; ++i) {
@@ -1284,21 +3120,20 @@ void readback(char* code_data, u64 code_mcap, Worker* mem, Lnk term, char** id_t
 
   // Readback
   readback_vars(&vars, mem, term, &seen);
-  readback_term(&chrs, mem, term, &vars, dirs, id_to_name_data, id_to_name_mcap);
-
-  // Generates C string
-  for (u64 i = 0; i < chrs.size && i < code_mcap; ++i) {
-    code_data[i] = chrs.data[i];
+  if (bin) {
+    readback_bin_names(out, id_to_name_data, id_to_name_mcap);
+    readback_bin_term(out, mem, term, &vars, dirs);
+  } else {
+    readback_term(out, mem, term, &vars, dirs, id_to_name_data, id_to_name_mcap);
   }
-  code_data[chrs.size < code_mcap ? chrs.size : code_mcap] = '\0';
 
   // Cleanup
-  stk_free(&seen);
-  stk_free(&chrs);
-  stk_free(&vars);
+  map_free(&seen);
+  map_free(&vars);
   for (u64 i = 0; i < DIRS_MCAP; ++i) {
     stk_free(&dirs[i]);
   }
+  free(dirs);
 }
 
 // Debug
@@ -1322,6 +3157,7 @@ void debug_print_lnk(Lnk x) {
     case OP2: printf("OP2"); break;
     case U32: printf("U32"); break;
     case F32: printf("F32"); break;
+    case U60: printf("U60"); break;
     case NIL: printf("NIL"); break;
     default : printf("???"); break;
   }
@@ -1331,59 +3167,600 @@ void debug_print_lnk(Lnk x) {
 // Main
 // ----
 
-Lnk parse_arg(char* code, char** id_to_name_data, u64 id_to_name_size) {
-  if (code[0] >= '0' && code[0] <= '9') {
-    return U_32(strtol(code, 0, 10));
+// Peak resident memory of this process, in bytes
+u64 peak_rss(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  #ifdef __APPLE__
+  return (u64)usage.ru_maxrss;
+  #else
+  return (u64)usage.ru_maxrss * 1024;
+  #endif
+}
+
+#define ID_TO_NAME_SIZE (/*! GENERATED_NAME_COUNT */ 1 /* GENERATED_NAME_COUNT !*/)
+
+// Fills a table of the names of constructors and functions, by id
+void id_to_name_init(char** id_to_name_data) {
+/*! GENERATED_ID_TO_NAME_DATA !*/;
+}
+
+// The arity of each constructor and function, by id, as the rules use it, or
+// ARITY_ANY for names used with several. Inputs must build them alike.
+#define ARITY_ANY (0xFF)
+u8 id_to_arity_data[ID_TO_NAME_SIZE] = {
+/*! GENERATED_ID_TO_ARITY_DATA */ 0 /* GENERATED_ID_TO_ARITY_DATA !*/
+};
+
+// Input
+// -----
+// An argument of the form `@path` (or `@-`, for stdin) is a term read from a
+// file and allocated right into the heap, so big inputs skip both argv and the
+// Rust parser. The file holds either text, with numbers and constructors, as
+// in `(Cons 1 (Cons 2 Nil))`, or the binary format of `--output=bin`, whose
+// constructor ids are mapped to this program's by name. Both are read in one
+// streaming pass, with explicit stacks, so deep terms don't recurse.
+
+typedef struct {
+  FILE* file;
+  char* path;
+  int   back[4]; // characters read ahead, to be returned last-first
+  u64   back_size;
+} Input;
+
+int input_get(Input* input) {
+  return input->back_size > 0 ? input->back[--input->back_size] : getc(input->file);
+}
+
+void input_unget(Input* input, int chr) {
+  input->back[input->back_size++] = chr;
+}
+
+void input_fail(Input* input, const char* msg, const char* name) {
+  fprintf(stderr, "Can't load '%s': %s%s.\n", input->path, msg, name);
+  exit(1);
+}
+
+u64 input_int(Input* input, u64 size) {
+  u64 val = 0;
+  for (u64 i = 0; i < size; ++i) {
+    int chr = input_get(input);
+    if (chr == EOF) {
+      input_fail(input, "unexpected end of input", "");
+    }
+    val |= (u64)(chr & 0xFF) << (i * 8);
+  }
+  return val;
+}
+
+u64 input_hash(const char* name, u64 size) {
+  u64 hash = 0xCBF29CE484222325;
+  for (u64 i = 0; i < size; ++i) {
+    hash = (hash ^ (u8)name[i]) * 0x100000001B3;
+  }
+  return hash >> 1; // never MAP_NONE
+}
+
+// Finds the id of a constructor name, or returns -1
+u64 input_ctr_id(Map* names, const char* name, u64 size, char** id_to_name_data, u64 id_to_name_size) {
+  u64 id = map_get(names, input_hash(name, size));
+  if (id != -1 && strlen(id_to_name_data[id]) == size && strncmp(id_to_name_data[id], name, size) == 0) {
+    return id;
+  }
+  for (id = 0; id < id_to_name_size; ++id) {
+    if (id_to_name_data[id] != NULL && strlen(id_to_name_data[id]) == size && strncmp(id_to_name_data[id], name, size) == 0) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+// Reads a number, as the parser does: `12` is a U32, `12u` a U60, and a literal
+// with a point or an exponent, like `1.5` or `-2e3`, an F32. Returns NIL if the
+// text isn't a number.
+Lnk input_num(const char* text) {
+  char* end;
+  if (strpbrk(text, ".eE") != NULL) {
+    float val = strtof(text, &end);
+    return *end == '\0' && val - val == 0 ? F_32(val) : Nil();
+  }
+  if (text[0] < '0' || text[0] > '9') {
+    return Nil();
+  }
+  u64 val = strtoull(text, &end, 10);
+  if (end[0] == 'u' && end[1] == '\0' && val <= NUM_MASK) {
+    return U_60(val);
+  }
+  return *end == '\0' ? U_32(val) : Nil();
+}
+
+// Builds a constructor from its arguments, the last `arity` values on `vals`.
+// It must have as many as the rules give it.
+Lnk input_ctr(Input* input, Worker* mem, Stk* vals, u64 id, u64 arity, char** id_to_name_data) {
+  if (id_to_arity_data[id] != ARITY_ANY && id_to_arity_data[id] != arity) {
+    input_fail(input, "wrong number of fields for ", id_to_name_data[id]);
+  }
+  if (arity >= MAX_ARITY) {
+    input_fail(input, "too many constructor fields", "");
+  }
+  u64 loc = arity > 0 ? heap_take(arity) : 0;
+  vals->size -= arity;
+  for (u64 i = 0; i < arity; ++i) {
+    mem->node[loc + i] = vals->data[vals->size + i];
+  }
+  return Ctr(arity, id, loc);
+}
+
+Lnk input_text(Input* input, Worker* mem, Map* names, char** id_to_name_data, u64 id_to_name_size) {
+  Stk vals; // values of the fields read so far
+  Stk ctrs; // constructors still open, as their id and where their fields start
+  stk_init(&vals);
+  stk_init(&ctrs);
+  char text[256];
+  int chr = input_get(input);
+  while (1) {
+    while (chr == ' ' || chr == '\t' || chr == '\n' || chr == '\r') {
+      chr = input_get(input);
+    }
+    if (chr == EOF) {
+      break;
+    } else if (chr == '(') {
+      chr = input_get(input);
+      u64 size = 0;
+      while (chr == '_' || chr == '.' || (chr >= '0' && chr <= '9') || (chr >= 'a' && chr <= 'z') || (chr >= 'A' && chr <= 'Z')) {
+        if (size + 1 < sizeof(text)) {
+          text[size++] = chr;
+        }
+        chr = input_get(input);
+      }
+      text[size] = '\0';
+      u64 id = input_ctr_id(names, text, size, id_to_name_data, id_to_name_size);
+      if (id == -1) {
+        input_fail(input, "unknown constructor ", text);
+      }
+      stk_push(&ctrs, id);
+      stk_push(&ctrs, vals.size);
+      continue;
+    } else if (chr == ')') {
+      if (ctrs.size == 0) {
+        input_fail(input, "unbalanced ')'", "");
+      }
+      u64 base = stk_pop(&ctrs);
+      u64 id = stk_pop(&ctrs);
+      stk_push(&vals, input_ctr(input, mem, &vals, id, vals.size - base, id_to_name_data));
+      chr = input_get(input);
+    } else if ((chr >= '0' && chr <= '9') || chr == '-') {
+      u64 size = 0;
+      while (chr == '.' || (chr >= '0' && chr <= '9') || (chr >= 'a' && chr <= 'z') || (chr >= 'A' && chr <= 'Z')
+        || ((chr == '-' || chr == '+') && (size == 0 || text[size - 1] == 'e' || text[size - 1] == 'E'))) {
+        if (size + 1 < sizeof(text)) {
+          text[size++] = chr;
+        }
+        chr = input_get(input);
+      }
+      text[size] = '\0';
+      Lnk numb = input_num(text);
+      if (get_tag(numb) == NIL) {
+        input_fail(input, "invalid number ", text);
+      }
+      stk_push(&vals, numb);
+    } else if (chr == '_' || (chr >= 'a' && chr <= 'z') || (chr >= 'A' && chr <= 'Z')) {
+      u64 size = 0;
+      while (chr == '_' || chr == '.' || (chr >= '0' && chr <= '9') || (chr >= 'a' && chr <= 'z') || (chr >= 'A' && chr <= 'Z')) {
+        if (size + 1 < sizeof(text)) {
+          text[size++] = chr;
+        }
+        chr = input_get(input);
+      }
+      text[size] = '\0';
+      u64 id = input_ctr_id(names, text, size, id_to_name_data, id_to_name_size);
+      if (id == -1) {
+        input_fail(input, "unknown constructor ", text);
+      }
+      stk_push(&vals, input_ctr(input, mem, &vals, id, 0, id_to_name_data));
+    } else {
+      char what[2] = {chr, '\0'};
+      input_fail(input, "unexpected character ", what);
+    }
+    if (ctrs.size == 0) {
+      break;
+    }
+  }
+  while (chr == ' ' || chr == '\t' || chr == '\n' || chr == '\r') {
+    chr = input_get(input);
+  }
+  if (ctrs.size > 0 || vals.size != 1 || chr != EOF) {
+    input_fail(input, "expected a single term", "");
+  }
+  Lnk term = vals.data[0];
+  stk_free(&vals);
+  stk_free(&ctrs);
+  return term;
+}
+
+Lnk input_bin(Input* input, Worker* mem, Map* names, char** id_to_name_data, u64 id_to_name_size) {
+  if (input_int(input, 1) != READBACK_BIN_VERSION) {
+    input_fail(input, "unsupported binary version", "");
+  }
+  // Maps the file's constructor ids to ours, by name
+  u64 ids_size = input_int(input, 8);
+  u64* ids = malloc((ids_size + 1) * sizeof(u64));
+  char text[256];
+  assert(ids);
+  for (u64 i = 0; i < ids_size; ++i) {
+    u64 size = input_int(input, 4);
+    u64 kept = 0;
+    for (u64 j = 0; j < size; ++j) {
+      int chr = (int)input_int(input, 1);
+      if (kept + 1 < sizeof(text)) {
+        text[kept++] = chr;
+      }
+    }
+    text[kept] = '\0';
+    ids[i] = input_ctr_id(names, text, kept, id_to_name_data, id_to_name_size);
+  }
+  Stk vals; // values of the fields read so far
+  Stk ctrs; // constructors still open, as their id, arity and where their fields start
+  stk_init(&vals);
+  stk_init(&ctrs);
+  do {
+    u64 tag = input_int(input, 1);
+    if (tag == U32) {
+      stk_push(&vals, U_32(input_int(input, 4)));
+    } else if (tag == F32) {
+      stk_push(&vals, (F32 * TAG) | input_int(input, 4));
+    } else if (tag == U60) {
+      stk_push(&vals, U_60(input_int(input, 8)));
+    } else if (tag == CTR) {
+      u64 id = input_int(input, 4);
+      u64 arity = input_int(input, 1);
+      if (id >= ids_size || ids[id] == -1) {
+        input_fail(input, "unknown constructor in binary input", "");
+      }
+      stk_push(&ctrs, ids[id]);
+      stk_push(&ctrs, arity);
+      stk_push(&ctrs, vals.size);
+    } else {
+      input_fail(input, "only numbers and constructors can be loaded", "");
+    }
+    while (ctrs.size > 0 && vals.size - ctrs.data[ctrs.size - 1] == ctrs.data[ctrs.size - 2]) {
+      u64 arity = ctrs.data[ctrs.size - 2];
+      u64 id = ctrs.data[ctrs.size - 3];
+      ctrs.size -= 3;
+      stk_push(&vals, input_ctr(input, mem, &vals, id, arity, id_to_name_data));
+    }
+  } while (ctrs.size > 0);
+  Lnk term = vals.data[0];
+  stk_free(&vals);
+  stk_free(&ctrs);
+  free(ids);
+  return term;
+}
+
+// Reads the term of an `@path` argument into the heap
+Lnk input_load(Worker* mem, char* path, char** id_to_name_data, u64 id_to_name_size) {
+  Input input = {0};
+  input.path = path;
+  input.file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  if (input.file == NULL) {
+    input_fail(&input, "no such file", "");
+  }
+  Map names;
+  map_init(&names);
+  for (u64 id = 0; id < id_to_name_size; ++id) {
+    if (id_to_name_data[id] != NULL) {
+      map_set(&names, input_hash(id_to_name_data[id], strlen(id_to_name_data[id])), id);
+    }
+  }
+  // Binary inputs start with "HVMB"; anything else is put back and read as text
+  int head[4];
+  u64 size = 0;
+  while (size < 4 && (head[size] = input_get(&input)) == "HVMB"[size]) {
+    ++size;
+  }
+  Lnk term;
+  if (size == 4) {
+    term = input_bin(&input, mem, &names, id_to_name_data, id_to_name_size);
   } else {
-    return U_32(0);
+    for (u64 i = size + 1; i > 0; --i) {
+      input_unget(&input, head[i - 1]);
+    }
+    term = input_text(&input, mem, &names, id_to_name_data, id_to_name_size);
+  }
+  map_free(&names);
+  if (input.file != stdin) {
+    fclose(input.file);
+  }
+  return term;
+}
+
+// Reads an argument of Main: a number, or an `@path` term
+Lnk parse_arg(Worker* mem, char* code, char** id_to_name_data, u64 id_to_name_size) {
+  if (code[0] == '@') {
+    return input_load(mem, code + 1, id_to_name_data, id_to_name_size);
   }
+  Lnk numb = input_num(code);
+  if (get_tag(numb) == NIL) {
+    fprintf(stderr, "Invalid argument '%s': expected a number or an @file.\n", code);
+    exit(1);
+  }
+  return numb;
+}
+
+// Allocates a call to Main with the given arguments, returning its host
+u64 main_call(Worker* mem, u64 size, char** args, char** id_to_name_data, u64 id_to_name_size) {
+  u64 host = heap_take(1 + size);
+  mem->node[host] = Cal(size, _MAIN_, size > 0 ? host + 1 : 0);
+  for (u64 i = 0; i < size; ++i) {
+    mem->node[host + 1 + i] = parse_arg(mem, args[i], id_to_name_data, id_to_name_size);
+  }
+  return host;
+}
+
+// Allocates a call to Main per non-blank line of a batch file (or of stdin, if
+// `path` is "-"), whose arguments are as in the command line, and pushes their
+// hosts to `hosts`, in order
+void batch_read(Worker* mem, char* path, Stk* hosts, char** id_to_name_data, u64 id_to_name_size) {
+  FILE* file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Can't read batch '%s'.\n", path);
+    exit(1);
+  }
+  char* line = NULL;
+  size_t line_mcap = 0;
+  u64 line_num = 0;
+  while (getline(&line, &line_mcap, file) != -1) {
+    char* args[MAX_ARITY];
+    ++line_num;
+    u64 size = 0;
+    for (char* arg = strtok(line, " \t\r\n"); arg != NULL; arg = strtok(NULL, " \t\r\n")) {
+      if (size == MAX_ARITY) {
+        fprintf(stderr, "Can't read batch '%s': too many arguments in line %"PRIu64".\n", path, line_num);
+        exit(1);
+      }
+      args[size++] = arg;
+    }
+    if (size > 0) {
+      stk_push(hosts, main_call(mem, size, args, id_to_name_data, id_to_name_size));
+    }
+  }
+  free(line);
+  if (file != stdin) {
+    fclose(file);
+  }
+}
+
+// Library
+// -------
+// Built with `-DHVM_LIBRARY`, a compiled program leaves main() out and can be
+// embedded. The runtime is started once, and its worker threads then wait for
+// work between calls, rather than being spawned and joined by each one:
+//
+//   hvm_init();
+//   Lnk args[1] = {hvm_u32(20)};
+//   u64 host = hvm_normal(hvm_call(hvm_id("Main"), 1, args));
+//   hvm_readback(stdout, host, 0);
+//   hvm_reset();
+//   ...
+//   hvm_free();
+//
+// Terms stay on the heap, and can be shared by later terms, until hvm_reset().
+// Calls must not overlap, and errors exit the process, as they do in main().
+// Since the runtime can't tell which earlier terms are still in use, -DCOMPACT
+// never moves them: hvm_normal() doesn't compact, and the library doesn't print
+// compaction stats.
+
+char* hvm_id_to_name[ID_TO_NAME_SIZE];
+Map   hvm_names;
+
+// Reserves the heap and spawns the worker threads
+void hvm_init(void) {
+  id_to_name_init(hvm_id_to_name);
+  map_init(&hvm_names);
+  for (u64 id = 0; id < ID_TO_NAME_SIZE; ++id) {
+    if (hvm_id_to_name[id] != NULL) {
+      map_set(&hvm_names, input_hash(hvm_id_to_name[id], strlen(hvm_id_to_name[id])), id);
+    }
+  }
+  workers_reset(heap_alloc(), 0);
+  workers_start();
+}
+
+// Stops the worker threads and releases the heap
+void hvm_free(void) {
+  workers_stop();
+  heap_free();
+  map_free(&hvm_names);
+}
+
+// Drops every term. The heap pages stay committed, so they are reused for free.
+void hvm_reset(void) {
+  workers_reset(heap_node, 0);
+}
+
+// The id of a constructor or function, or -1 if there is none with that name
+u64 hvm_id(const char* name) {
+  return input_ctr_id(&hvm_names, name, strlen(name), hvm_id_to_name, ID_TO_NAME_SIZE);
+}
+
+Lnk hvm_u32(u32 val) {
+  return U_32(val);
+}
+
+Lnk hvm_f32(float val) {
+  return F_32(val);
+}
+
+Lnk hvm_u60(u64 val) {
+  return U_60(val);
+}
+
+// Stores the arguments of a constructor or call, returning their location
+u64 hvm_args(u64 arity, Lnk* args) {
+  u64 loc = alloc(&workers[0], arity);
+  for (u64 i = 0; i < arity; ++i) {
+    link_lnk(&workers[0], loc + i, args[i]);
+  }
+  return loc;
 }
 
+Lnk hvm_ctr(u64 id, u64 arity, Lnk* args) {
+  return Ctr(arity, id, hvm_args(arity, args));
+}
+
+Lnk hvm_call(u64 id, u64 arity, Lnk* args) {
+  return Cal(arity, id, hvm_args(arity, args));
+}
+
+// Reads a term from a file, as the `@path` arguments of main() do
+Lnk hvm_load(char* path) {
+  return input_load(&workers[0], path, hvm_id_to_name, ID_TO_NAME_SIZE);
+}
+
+// Normalizes a term, returning the host that holds its normal form. Afterwards,
+// ffi_cost and ffi_size hold the totals since the last hvm_reset(). The host
+// may be a block freed by an earlier call, so compaction stays off (see
+// compact_root): it would pack this term over the others.
+u64 hvm_normal(Lnk term) {
+  u64 host = alloc(&workers[0], 1);
+  link_lnk(&workers[0], host, term);
+  normal(&workers[0], host);
+  workers_stats();
+  return host;
+}
+
+// The normal form at a host, e.g., to read a number with get_val(), get_num()
+// or get_f32()
+Lnk hvm_get(u64 host) {
+  return heap_node[host];
+}
+
+void hvm_readback(FILE* out, u64 host, u8 bin) {
+  readback(out, &workers[0], heap_node[host], hvm_id_to_name, ID_TO_NAME_SIZE, bin);
+}
+
+#ifdef PROFILE
+// Reports the profile of the last ffi_normal() or ffi_batch(), or of the
+// hvm_normal() calls since the last hvm_reset()
+void ffi_profile(void) {
+  char* id_to_name_data[ID_TO_NAME_SIZE];
+  id_to_name_init(id_to_name_data);
+  prof_report(id_to_name_data, ID_TO_NAME_SIZE);
+}
+#endif
+
 // Uncomment to test without Deno FFI
+#ifndef HVM_LIBRARY
 int main(int argc, char* argv[]) {
 
   Worker mem;
   struct timeval stop, start;
 
   // Id-to-Name map
-  const u64 id_to_name_size = /*! GENERATED_NAME_COUNT */ 1 /* GENERATED_NAME_COUNT !*/;
+  const u64 id_to_name_size = ID_TO_NAME_SIZE;
   char* id_to_name_data[id_to_name_size];
-/*! GENERATED_ID_TO_NAME_DATA !*/;
+  id_to_name_init(id_to_name_data);
+
+  // Reads flags, leaving only the arguments of Main in argv
+  u8 output_bin = 0;
+  char* save_path = NULL;
+  char* load_path = NULL;
+  char* batch_path = NULL;
+  int argn = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--output=bin") == 0) {
+      output_bin = 1;
+    } else if (strcmp(argv[i], "--output=text") == 0) {
+      output_bin = 0;
+    } else if (strncmp(argv[i], "--save=", 7) == 0) {
+      save_path = argv[i] + 7;
+    } else if (strncmp(argv[i], "--load=", 7) == 0) {
+      load_path = argv[i] + 7;
+    } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+      batch_path = argv[i] + 8;
+    } else {
+      argv[argn++] = argv[i];
+    }
+  }
+  argc = argn;
+  if (batch_path != NULL && (save_path != NULL || load_path != NULL || argc > 1)) {
+    fprintf(stderr, "A --batch run takes its arguments from the batch, and can't be saved or loaded.\n");
+    exit(1);
+  }
 
-  // Builds main term
-  mem.size = 0;
-  mem.node = (u64*)malloc(HEAP_SIZE);
-  assert(mem.node);
-  if (argc <= 1) {
-    mem.node[mem.size++] = Cal(0, _MAIN_, 0);
+  // Builds main term. With --load, it is instead the term of a snapshot,
+  // applied to the arguments. With --batch, there is a call to Main per line.
+  u64 host = 0;
+  Stk hosts;
+  stk_init(&hosts);
+  mem.node = heap_alloc();
+  if (batch_path != NULL) {
+    batch_read(&mem, batch_path, &hosts, id_to_name_data, id_to_name_size);
+  } else if (load_path == NULL) {
+    host = main_call(&mem, argc - 1, argv + 1, id_to_name_data, id_to_name_size);
   } else {
-    mem.node[mem.size++] = Cal(argc - 1, _MAIN_, 1);
-    for (u64 i = 1; i < argc; ++i) {
-      mem.node[mem.size++] = parse_arg(argv[i], id_to_name_data, id_to_name_size);
+    host = snapshot_load(load_path);
+    if (argc > 1) {
+      Lnk func = mem.node[host];
+      for (u64 i = 1; i < argc; ++i) {
+        u64 app = heap_take(2);
+        link_lnk(&mem, app + 0, func);
+        link_lnk(&mem, app + 1, parse_arg(&mem, argv[i], id_to_name_data, id_to_name_size));
+        func = App(app);
+      }
+      host = heap_take(1);
+      link_lnk(&mem, host, func);
     }
   }
+  mem.size = heap_used;
 
   // Reduces and benchmarks
   //printf("Reducing.\n");
   gettimeofday(&start, NULL);
-  ffi_normal((u8*)mem.node, mem.size, 0);
+  if (batch_path != NULL) {
+    ffi_batch((u8*)mem.node, mem.size, hosts.data, hosts.size);
+  } else {
+    ffi_normal((u8*)mem.node, mem.size, host);
+  }
   gettimeofday(&stop, NULL);
 
   // Prints result statistics
   u64 delta_time = (stop.tv_sec - start.tv_sec) * 1000000 + stop.tv_usec - start.tv_usec;
   double rwt_per_sec = (double)ffi_cost / (double)delta_time;
   fprintf(stderr, "Rewrites: %"PRIu64" (%.2f MR/s).\n", ffi_cost, rwt_per_sec);
+  if (batch_path != NULL) {
+    double calls_per_sec = (double)hosts.size * 1000000 / (double)delta_time;
+    double rwt_per_call = hosts.size > 0 ? (double)ffi_cost / (double)hosts.size : 0;
+    fprintf(stderr, "Batch: %"PRIu64" calls (%.2f calls/s, %.2f rewrites/call).\n", hosts.size, calls_per_sec, rwt_per_call);
+  }
   fprintf(stderr, "Mem.Size: %"PRIu64" words.\n", ffi_size);
+  fprintf(stderr, "Peak RSS: %"PRIu64" MB.\n", peak_rss() / (1024 * 1024));
+  #ifdef ALLOC_STATS
+  fprintf(stderr, "Stk.Allocs: %"PRIu64".\n", stk_allocs);
+  #endif
   fprintf(stderr, "\n");
+  #ifdef PROFILE
+  prof_report(id_to_name_data, id_to_name_size);
+  #endif
+
+  // Saves the normal form, so that it can be restored with --load
+  if (save_path != NULL) {
+    snapshot_save(save_path, host);
+  }
 
-  // Prints result normal form
-  const u64 code_mcap = 256 * 256 * 256; // max code size = 16 MB
-  char* code_data = (char*)malloc(code_mcap * sizeof(char));
-  assert(code_data);
-  readback(code_data, code_mcap, &mem, mem.node[0], id_to_name_data, id_to_name_size);
-  printf("%s\n", code_data);
+  // Prints result normal form. A batch prints one per call, in order.
+  if (batch_path == NULL) {
+    stk_push(&hosts, host);
+  }
+  for (u64 i = 0; i < hosts.size; ++i) {
+    readback(stdout, &mem, mem.node[hosts.data[i]], id_to_name_data, id_to_name_size, output_bin);
+    if (!output_bin) {
+      printf("\n");
+    }
+  }
 
   // Cleanup
-  free(code_data);
-  free(mem.node);
+  stk_free(&hosts);
+  heap_free();
 }
+#endif
@@ -2,7 +2,10 @@
 #![allow(dead_code)]
 #![allow(non_snake_case)]
 
-use std::collections::{hash_map, HashMap};
+use crate::language as lang;
+use std::collections::{hash_map, HashMap, VecDeque};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
 
 // Constants
 // ---------
@@ -21,6 +24,8 @@ pub const EXT: u64 = 0x100000000;
 pub const ARI: u64 = 0x100000000000000;
 pub const TAG: u64 = 0x1000000000000000;
 
+pub const NUM_MASK: u64 = 0xFFFFFFFFFFFFFFF;
+
 pub const DP0: u64 = 0x0;
 pub const DP1: u64 = 0x1;
 pub const VAR: u64 = 0x2;
@@ -34,6 +39,7 @@ pub const CAL: u64 = 0x9;
 pub const OP2: u64 = 0xA;
 pub const U32: u64 = 0xB;
 pub const F32: u64 = 0xC;
+pub const U60: u64 = 0xD;
 pub const OUT: u64 = 0xE;
 pub const NIL: u64 = 0xF;
 
@@ -59,7 +65,7 @@ pub const NEQ: u64 = 0xF;
 
 pub type Lnk = u64;
 
-pub type Rewriter = Box<dyn Fn(&mut Worker, u64, Lnk) -> bool>;
+pub type Rewriter = Box<dyn Fn(&mut Worker, u64, Lnk) -> bool + Send + Sync>;
 
 pub struct Function {
   pub arity: u64,
@@ -67,21 +73,163 @@ pub struct Function {
   pub rewriter: Rewriter,
 }
 
+// The heap. Its words are atomics so that the workers of a parallel normal()
+// can share it, but relaxed loads and stores compile to plain moves. Workers
+// take chunks of it, bumping `used`, and allocate within them.
+pub struct Heap {
+  pub node: Box<[AtomicU64]>,
+  pub used: AtomicU64,
+}
+
 pub struct Worker {
-  pub node: Vec<Lnk>,
+  pub heap: Arc<Heap>,
+  node: *const AtomicU64, // the heap's words, cached, as they're read so often
+  pub shared: bool,       // whether other workers are using the heap
+  pub next: u64,
+  pub last: u64,
   pub size: u64,
   pub free: Vec<Vec<u64>>,
   pub cost: u64,
+  pub work: Vec<u64>, // scratch space for rewriters
 }
 
+// The heap starts small and doubles whenever alloc() runs past its end, so
+// only the memory a program actually uses is ever committed. A shared heap
+// can't move, though, so a parallel normal() reserves all of it beforehand.
+pub const HEAP_INIT_SIZE: usize = U64_PER_MB as usize;
+pub const HEAP_MAX_SIZE: usize = SEEN_SIZE * 64;
+
+// Words a worker takes from the heap at once
+pub const ALLOC_CHUNK: u64 = U64_PER_KB * 32;
+
 pub fn new_worker() -> Worker {
-  Worker { node: vec![0; 6 * 0x8000000], size: 0, free: vec![vec![]; 16], cost: 0 }
+  new_worker_with(Vec::new())
 }
 
-// Globals
-// -------
+// A worker whose heap starts with the given words
+pub fn new_worker_with(words: Vec<Lnk>) -> Worker {
+  let heap = Arc::new(Heap::new(words, HEAP_INIT_SIZE).expect("Out of memory."));
+  let used = heap.used.load(Ordering::Relaxed);
+  let node = heap.node.as_ptr();
+  let free = vec![vec![]; 16];
+  Worker { heap, node, shared: false, next: used, last: used, size: 0, free, cost: 0, work: vec![] }
+}
+
+// Another worker on the same heap, for a parallel normal()
+pub fn fork_worker(mem: &Worker) -> Worker {
+  let (heap, node, free) = (Arc::clone(&mem.heap), mem.node, vec![vec![]; 16]);
+  Worker { heap, node, shared: true, next: 0, last: 0, size: 0, free, cost: 0, work: vec![] }
+}
+
+// A worker only touches the heap's words through atomics, and its free lists
+// only hold blocks it owns, so it can be moved to another thread.
+unsafe impl Send for Worker {}
+
+// Gives the free blocks and statistics of a forked worker back to `mem`
+pub fn join_worker(mem: &mut Worker, done: Worker) {
+  for (list, done) in mem.free.iter_mut().zip(done.free) {
+    list.extend(done);
+  }
+  mem.size += done.size;
+  mem.cost += done.cost;
+}
 
-static mut SEEN_DATA: [u64; SEEN_SIZE] = [0; SEEN_SIZE];
+// Zeroed atomics. Large ones are mapped by the allocator, so their pages are
+// only committed once written. Returns None if the allocation fails.
+fn zeroed_atomics(len: usize) -> Option<Box<[AtomicU64]>> {
+  let layout = std::alloc::Layout::array::<AtomicU64>(len).ok()?;
+  if len == 0 {
+    return Some(Box::new([]));
+  }
+  unsafe {
+    let data = std::alloc::alloc_zeroed(layout) as *mut AtomicU64;
+    if data.is_null() {
+      None
+    } else {
+      Some(Box::from_raw(std::ptr::slice_from_raw_parts_mut(data, len)))
+    }
+  }
+}
+
+impl Heap {
+  // A heap of at least `len` words, holding `words` at its start
+  fn new(words: Vec<Lnk>, len: usize) -> Option<Heap> {
+    let node = zeroed_atomics(std::cmp::max(words.len(), len))?;
+    for (word, lnk) in node.iter().zip(&words) {
+      word.store(*lnk, Ordering::Relaxed);
+    }
+    Some(Heap { node, used: AtomicU64::new(words.len() as u64) })
+  }
+
+  // Moves the heap to one of `len` words
+  fn resize(&mut self, len: usize) -> bool {
+    let used = std::cmp::min(*self.used.get_mut() as usize, self.node.len());
+    match zeroed_atomics(len) {
+      Some(node) => {
+        for (word, old) in node.iter().zip(&mut self.node[0..used]) {
+          word.store(*old.get_mut(), Ordering::Relaxed);
+        }
+        self.node = node;
+        true
+      }
+      None => false,
+    }
+  }
+}
+
+// Takes `size` fresh words from the heap, growing it if this worker is the
+// only one using it.
+pub fn heap_take(mem: &mut Worker, size: u64) -> u64 {
+  let loc = mem.heap.used.fetch_add(size, Ordering::Relaxed);
+  let need = (loc + size) as usize;
+  if need > mem.heap.node.len() {
+    let len = std::cmp::min(std::cmp::max(need, mem.heap.node.len() * 2), HEAP_MAX_SIZE);
+    let grown = need <= len && Arc::get_mut(&mut mem.heap).map_or(false, |heap| heap.resize(len));
+    if !grown {
+      eprintln!("Out of memory.");
+      std::process::exit(1);
+    }
+    mem.node = mem.heap.node.as_ptr();
+  }
+  loc
+}
+
+// Makes room for the workers of a parallel normal(): reserves the largest heap
+// the allocator gives, up to HEAP_MAX_SIZE. Returns false if the heap is
+// already shared.
+pub fn heap_reserve(mem: &mut Worker) -> bool {
+  let heap = match Arc::get_mut(&mut mem.heap) {
+    Some(heap) => heap,
+    None => return false,
+  };
+  let mut len = HEAP_MAX_SIZE;
+  while len > heap.node.len() && !heap.resize(len) {
+    len /= 2;
+  }
+  mem.node = heap.node.as_ptr();
+  true
+}
+
+// Words of the heap taken so far, by any worker
+pub fn heap_used(mem: &Worker) -> u64 {
+  mem.heap.used.load(Ordering::Relaxed)
+}
+
+// Gives back the unused tail of the worker's chunk, as snapshot_trim() does in
+// the C runtime: if it is at the top of the heap, it is cut off it; otherwise,
+// it is split into 2-word blocks, on the free lists.
+pub fn heap_return(mem: &mut Worker) {
+  if mem.last == heap_used(mem) {
+    mem.heap.used.store(mem.next, Ordering::Relaxed);
+  } else {
+    while mem.next < mem.last {
+      let size = if mem.last - mem.next < 2 { 1 } else { 2 };
+      clear(mem, mem.next, size);
+      mem.next += size;
+    }
+  }
+  mem.last = mem.next;
+}
 
 // Constructors
 // ------------
@@ -126,6 +274,14 @@ pub fn U_32(val: u64) -> Lnk {
   (U32 * TAG) | val
 }
 
+pub fn F_32(val: f32) -> Lnk {
+  (F32 * TAG) | val.to_bits() as u64
+}
+
+pub fn U_60(val: u64) -> Lnk {
+  (U60 * TAG) | (val & NUM_MASK)
+}
+
 pub fn Nil() -> Lnk {
   NIL * TAG
 }
@@ -165,11 +321,23 @@ pub fn get_loc(lnk: Lnk, arg: u64) -> u64 {
   get_val(lnk) + arg
 }
 
+pub fn get_num(lnk: Lnk) -> u64 {
+  lnk & NUM_MASK
+}
+
+pub fn get_f32(lnk: Lnk) -> f32 {
+  f32::from_bits(lnk as u32)
+}
+
+pub fn is_num(lnk: Lnk) -> bool {
+  matches!(get_tag(lnk), U32 | F32 | U60)
+}
+
 // Memory
 // ------
 
 pub fn ask_lnk(mem: &Worker, loc: u64) -> Lnk {
-  unsafe { *mem.node.get_unchecked(loc as usize) }
+  word(mem, loc).load(Ordering::Relaxed)
   // mem.node[loc as usize]
 }
 
@@ -177,15 +345,73 @@ pub fn ask_arg(mem: &Worker, term: Lnk, arg: u64) -> Lnk {
   ask_lnk(mem, get_loc(term, arg))
 }
 
+// Writes a word, without updating binders. See link().
+pub fn put_lnk(mem: &Worker, loc: u64, lnk: Lnk) {
+  word(mem, loc).store(lnk, Ordering::Relaxed)
+}
+
+fn word(mem: &Worker, loc: u64) -> &AtomicU64 {
+  unsafe { &*mem.node.add(loc as usize) }
+}
+
+// Whether other workers, of a parallel normal(), are using this heap
+pub fn is_shared(mem: &Worker) -> bool {
+  mem.shared
+}
+
+// Dup nodes are locked while their expression is reduced, by setting this bit
+// of their first word, which otherwise only holds an ARG or ERA back-pointer,
+// and thus never has an arity. Only done when the heap is shared.
+pub const DUP_LOCK: u64 = ARI * 0x8;
+
+// Tries to lock the dup node at `loc`. Returns true if it was taken. The word
+// may have been rewritten, freed and reused since the caller read its DP0/DP1,
+// so this only sets the bit of an unlocked ARG or ERA word, with a CAS.
+pub fn dup_lock(mem: &Worker, loc: u64) -> bool {
+  word(mem, loc)
+    .fetch_update(Ordering::Acquire, Ordering::Relaxed, |old| {
+      (matches!(get_tag(old), ARG | ERA) && old & DUP_LOCK == 0).then(|| old | DUP_LOCK)
+    })
+    .is_ok()
+}
+
+// Releases the lock taken by dup_lock(). Likewise, only clears the bit of a
+// locked ARG or ERA word.
+pub fn dup_unlock(mem: &Worker, loc: u64) {
+  let _ = word(mem, loc).fetch_update(Ordering::Release, Ordering::Relaxed, |old| {
+    (matches!(get_tag(old), ARG | ERA) && old & DUP_LOCK != 0).then(|| old & !DUP_LOCK)
+  });
+}
+
+// Writes a back-pointer on the first word of a dup node. On a shared heap,
+// this keeps the lock bit, since another worker may be holding it.
+pub fn link_dup(mem: &Worker, loc: u64, lnk: Lnk) {
+  if is_shared(mem) {
+    link_dup_shared(mem, loc, lnk);
+  } else {
+    put_lnk(mem, loc, lnk);
+  }
+}
+
+// Kept out of line, so that link(), which is inlined everywhere, stays small
+#[cold]
+#[inline(never)]
+fn link_dup_shared(mem: &Worker, loc: u64, lnk: Lnk) {
+  let _ = word(mem, loc).fetch_update(Ordering::Relaxed, Ordering::Relaxed, |old| {
+    let keep = if matches!(get_tag(old), ARG | ERA) { old & DUP_LOCK } else { 0 };
+    Some(lnk | keep)
+  });
+}
+
 pub fn link(mem: &mut Worker, loc: u64, lnk: Lnk) -> Lnk {
-  unsafe {
-    // mem.node[loc as usize] = lnk;
-    *mem.node.get_unchecked_mut(loc as usize) = lnk;
-    if get_tag(lnk) <= VAR {
-      // let pos = get_loc(lnk, if get_tag(lnk) == DP1 { 1 } else { 0 });
-      let pos = get_loc(lnk, get_tag(lnk) & 0x01);
-      // mem.node[pos as usize] = Arg(loc);
-      *mem.node.get_unchecked_mut(pos as usize) = Arg(loc);
+  put_lnk(mem, loc, lnk);
+  if get_tag(lnk) <= VAR {
+    // let pos = get_loc(lnk, if get_tag(lnk) == DP1 { 1 } else { 0 });
+    let pos = get_loc(lnk, get_tag(lnk) & 0x01);
+    if is_shared(mem) && get_tag(lnk) == DP0 {
+      link_dup_shared(mem, pos, Arg(loc));
+    } else {
+      put_lnk(mem, pos, Arg(loc));
     }
   }
   lnk
@@ -197,7 +423,13 @@ pub fn alloc(mem: &mut Worker, size: u64) -> u64 {
   } else if let Some(reuse) = mem.free[size as usize].pop() {
     reuse
   } else {
-    let loc = mem.size;
+    if mem.next + size > mem.last {
+      let len = std::cmp::max(size, ALLOC_CHUNK);
+      mem.next = heap_take(mem, len);
+      mem.last = mem.next + len;
+    }
+    let loc = mem.next;
+    mem.next += size;
     mem.size += size;
     loc
   }
@@ -210,7 +442,7 @@ pub fn clear(mem: &mut Worker, loc: u64, size: u64) {
 pub fn collect(mem: &mut Worker, term: Lnk) {
   match get_tag(term) {
     DP0 => {
-      link(mem, get_loc(term, 0), Era());
+      link_dup(mem, get_loc(term, 0), Era());
       //r_educe(mem, get_loc(ask_arg(mem,term,1),0));
     }
     DP1 => {
@@ -241,7 +473,7 @@ pub fn collect(mem: &mut Worker, term: Lnk) {
       collect(mem, ask_arg(mem, term, 0));
       collect(mem, ask_arg(mem, term, 1));
     }
-    U32 => {}
+    U32 | F32 | U60 => {}
     CTR | CAL => {
       let arity = get_ari(term);
       for i in 0..arity {
@@ -257,6 +489,94 @@ pub fn inc_cost(mem: &mut Worker) {
   mem.cost += 1;
 }
 
+// Snapshots
+// ---------
+// A snapshot holds the used heap, the free lists and the root of a term, so a
+// later process can restore it and keep reducing. The layout is the one of the
+// C runtime (see `snapshot_save` in runtime.c): a header of SNAPSHOT_HEADER
+// bytes, then the heap words, padded to a multiple of SNAPSHOT_HEADER. Each
+// free list is threaded through its blocks, which hold the next one in their
+// last word. Here, the heap is read into a Vec rather than mapped. A snapshot
+// only loads with the fingerprint of the program that saved it (see
+// `rulebook::fingerprint`).
+
+const SNAPSHOT_MAGIC: u64 = 0x50414E534D5648; // "HVMSNAP"
+const SNAPSHOT_VERSION: u64 = 1;
+const SNAPSHOT_HEADER: usize = 0x10000;
+const FREE_NONE: u64 = u64::MAX;
+
+/// Saves the heap and the term at `host` to `path`, for the program with the
+/// fingerprint `book`. The free blocks are overwritten, since the free lists
+/// are threaded through them.
+pub fn save_snapshot(mem: &mut Worker, host: u64, book: u64, path: &str) -> std::io::Result<()> {
+  use std::io::Write;
+  heap_return(mem);
+  let mut head = vec![0; SNAPSHOT_HEADER / 8];
+  head[0] = SNAPSHOT_MAGIC;
+  head[1] = SNAPSHOT_VERSION;
+  let size = heap_used(mem) as usize;
+  head[3] = size as u64;
+  head[4] = host;
+  head[6] = FREE_NONE;
+  for size in 1..MAX_ARITY as usize {
+    let mut list = FREE_NONE;
+    for &loc in &mem.free[size] {
+      put_lnk(mem, loc + size as u64 - 1, list);
+      list = loc;
+      head[5] += size as u64;
+    }
+    head[6 + size] = list;
+  }
+  head[6 + MAX_ARITY as usize] = book;
+  let mut file = std::io::BufWriter::new(std::fs::File::create(path)?);
+  let words = (0..size as u64).map(|loc| ask_lnk(mem, loc));
+  for word in head.iter().copied().chain(words) {
+    file.write_all(&word.to_le_bytes())?;
+  }
+  let used = size * 8 % SNAPSHOT_HEADER;
+  if used > 0 {
+    file.write_all(&vec![0; SNAPSHOT_HEADER - used])?;
+  }
+  file.flush()
+}
+
+/// Restores a snapshot saved by `save_snapshot` for the program with the
+/// fingerprint `book`, returning a worker with its heap and free lists, and
+/// the host of its term
+pub fn load_snapshot(path: &str, book: u64) -> std::io::Result<(Worker, u64)> {
+  let bytes = std::fs::read(path)?;
+  let invalid =
+    |msg: &str| std::io::Error::new(std::io::ErrorKind::InvalidData, format!("{}: {}", path, msg));
+  let word = |i: usize| u64::from_le_bytes(bytes[i * 8..i * 8 + 8].try_into().unwrap());
+  if bytes.len() < SNAPSHOT_HEADER || word(0) != SNAPSHOT_MAGIC {
+    return Err(invalid("not a snapshot"));
+  }
+  if word(1) != SNAPSHOT_VERSION || word(2) != 0 {
+    return Err(invalid("saved by an incompatible runtime"));
+  }
+  if word(6 + MAX_ARITY as usize) != book {
+    return Err(invalid("saved by another program"));
+  }
+  let size = word(3) as usize;
+  let padded = (size * 8 + SNAPSHOT_HEADER - 1) / SNAPSHOT_HEADER * SNAPSHOT_HEADER;
+  if bytes.len() < SNAPSHOT_HEADER + padded {
+    return Err(invalid("truncated"));
+  }
+  let node: Vec<Lnk> = (0..size).map(|i| word(SNAPSHOT_HEADER / 8 + i)).collect();
+  let mut free = vec![vec![]; MAX_ARITY as usize];
+  for (size, list) in free.iter_mut().enumerate().skip(1) {
+    let mut loc = word(6 + size);
+    while loc != FREE_NONE {
+      list.push(loc);
+      loc = node[loc as usize + size - 1];
+    }
+    list.reverse();
+  }
+  let mut mem = new_worker_with(node);
+  mem.free = free;
+  Ok((mem, word(4)))
+}
+
 // Reduction
 // ---------
 
@@ -268,6 +588,69 @@ pub fn subst(mem: &mut Worker, lnk: Lnk, val: Lnk) {
   }
 }
 
+// Applies a numeric operator, as the C runtime's op2_num() does. U32 results
+// wrap at 32 bits, and U60 ones, when either operand is a U60, at 60 bits. When
+// either is an F32, both are taken as floats, except by the bitwise operators,
+// which truncate them to U32s. Comparisons always return a U32 0 or 1.
+pub fn op2_num(oper: u64, arg0: Lnk, arg1: Lnk) -> Lnk {
+  fn float(lnk: Lnk) -> f32 {
+    match get_tag(lnk) {
+      F32 => get_f32(lnk),
+      _ => get_num(lnk) as f32,
+    }
+  }
+  fn int(lnk: Lnk) -> u64 {
+    match get_tag(lnk) {
+      F32 => get_f32(lnk) as u32 as u64,
+      _ => get_num(lnk),
+    }
+  }
+  if get_tag(arg0) == F32 || get_tag(arg1) == F32 {
+    let a = float(arg0);
+    let b = float(arg1);
+    match oper {
+      ADD => return F_32(a + b),
+      SUB => return F_32(a - b),
+      MUL => return F_32(a * b),
+      DIV => return F_32(a / b),
+      MOD => return F_32(a % b),
+      LTN => return U_32(u64::from(a < b)),
+      LTE => return U_32(u64::from(a <= b)),
+      EQL => return U_32(u64::from(a == b)),
+      GTE => return U_32(u64::from(a >= b)),
+      GTN => return U_32(u64::from(a > b)),
+      NEQ => return U_32(u64::from(a != b)),
+      _ => {}
+    }
+  }
+  let a = int(arg0);
+  let b = int(arg1);
+  let c = match oper {
+    ADD => a.wrapping_add(b),
+    SUB => a.wrapping_sub(b),
+    MUL => a.wrapping_mul(b),
+    DIV => a / b,
+    MOD => a % b,
+    AND => a & b,
+    OR => a | b,
+    XOR => a ^ b,
+    SHL => a.wrapping_shl(b as u32),
+    SHR => a.wrapping_shr(b as u32),
+    LTN => return U_32(u64::from(a < b)),
+    LTE => return U_32(u64::from(a <= b)),
+    EQL => return U_32(u64::from(a == b)),
+    GTE => return U_32(u64::from(a >= b)),
+    GTN => return U_32(u64::from(a > b)),
+    NEQ => return U_32(u64::from(a != b)),
+    _ => 0,
+  };
+  if get_tag(arg0) == U60 || get_tag(arg1) == U60 {
+    U_60(c)
+  } else {
+    U_32(c & 0xFFFFFFFF)
+  }
+}
+
 pub fn cal_par(mem: &mut Worker, host: u64, term: Lnk, argn: Lnk, n: u64) -> Lnk {
   inc_cost(mem);
   let arit = get_ari(term);
@@ -294,14 +677,18 @@ pub fn cal_par(mem: &mut Worker, host: u64, term: Lnk, argn: Lnk, n: u64) -> Lnk
   done
 }
 
+// Reduces a term to weak head normal form. With a split budget, `slen`, over 1,
+// an OP2 at the root is left for normal() to split, as in the C runtime.
 pub fn reduce(
   mem: &mut Worker,
   funcs: &[Option<Function>],
   root: u64,
+  slen: u64,
   _opt_id_to_name: Option<&HashMap<u64, String>>,
   debug: bool,
 ) -> Lnk {
   let mut stack: Vec<u64> = Vec::new();
+  let shared = is_shared(mem);
 
   let mut init = 1;
   let mut host = root;
@@ -323,15 +710,31 @@ pub fn reduce(
           continue;
         }
         DP0 | DP1 => {
+          // On a shared heap, claims the dup node, so that only one worker
+          // reduces its expression and rewrites it. If another worker holds it,
+          // or it is gone, waits and re-reads `host`. If `host` changed before
+          // the lock was taken, the dup was already rewritten; retries.
+          if shared {
+            if !dup_lock(mem, get_loc(term, 0)) {
+              std::hint::spin_loop();
+              continue;
+            }
+            if ask_lnk(mem, host) != term {
+              dup_unlock(mem, get_loc(term, 0));
+              continue;
+            }
+          }
           stack.push(host);
           host = get_loc(term, 2);
           continue;
         }
         OP2 => {
-          stack.push(host);
-          stack.push(get_loc(term, 1) | 0x80000000);
-          host = get_loc(term, 0);
-          continue;
+          if slen == 1 || !stack.is_empty() {
+            stack.push(host);
+            stack.push(get_loc(term, 1) | 0x80000000);
+            host = get_loc(term, 0);
+            continue;
+          }
         }
         CAL => {
           let fun = get_ext(term);
@@ -418,6 +821,9 @@ pub fn reduce(
             subst(mem, term_arg_1, Lam(lam1));
             let done = Lam(if get_tag(term) == DP0 { lam0 } else { lam1 });
             link(mem, host, done);
+            if shared {
+              dup_unlock(mem, let0);
+            }
             init = 1;
             continue;
           } else if get_tag(arg0) == PAR {
@@ -428,6 +834,9 @@ pub fn reduce(
               subst(mem, ask_arg(mem, term, 1), ask_arg(mem, arg0, 1));
               let _done =
                 link(mem, host, ask_arg(mem, arg0, if get_tag(term) == DP0 { 0 } else { 1 }));
+              if shared {
+                dup_unlock(mem, get_loc(term, 0));
+              }
               clear(mem, get_loc(term, 0), 3);
               clear(mem, get_loc(arg0, 0), 2);
               init = 1;
@@ -451,8 +860,8 @@ pub fn reduce(
               let done = Par(get_ext(arg0), if get_tag(term) == DP0 { par0 } else { par1 });
               link(mem, host, done);
             }
-          } else if get_tag(arg0) == U32 {
-            //println!("dup-u32");
+          } else if is_num(arg0) {
+            //println!("dup-num");
             inc_cost(mem);
             subst(mem, ask_arg(mem, term, 0), arg0);
             subst(mem, ask_arg(mem, term, 1), arg0);
@@ -489,35 +898,17 @@ pub fn reduce(
               link(mem, host, done);
             }
           }
+          if shared {
+            dup_unlock(mem, get_loc(term, 0));
+          }
         }
         OP2 => {
           let arg0 = ask_arg(mem, term, 0);
           let arg1 = ask_arg(mem, term, 1);
-          if get_tag(arg0) == U32 && get_tag(arg1) == U32 {
-            //println!("op2-u32");
+          if is_num(arg0) && is_num(arg1) {
+            //println!("op2-num");
             inc_cost(mem);
-            let a = get_val(arg0);
-            let b = get_val(arg1);
-            let c = match get_ext(term) {
-              ADD => (a + b) & 0xFFFFFFFF,
-              SUB => (a - b) & 0xFFFFFFFF,
-              MUL => (a * b) & 0xFFFFFFFF,
-              DIV => (a / b) & 0xFFFFFFFF,
-              MOD => (a % b) & 0xFFFFFFFF,
-              AND => (a & b) & 0xFFFFFFFF,
-              OR => (a | b) & 0xFFFFFFFF,
-              XOR => (a ^ b) & 0xFFFFFFFF,
-              SHL => (a << b) & 0xFFFFFFFF,
-              SHR => (a >> b) & 0xFFFFFFFF,
-              LTN => u64::from(a < b),
-              LTE => u64::from(a <= b),
-              EQL => u64::from(a == b),
-              GTE => u64::from(a >= b),
-              GTN => u64::from(a > b),
-              NEQ => u64::from(a != b),
-              _ => 0,
-            };
-            let done = U_32(c);
+            let done = op2_num(get_ext(term), arg0, arg1);
             clear(mem, get_loc(term, 0), 2);
             link(mem, host, done);
           } else if get_tag(arg0) == PAR {
@@ -589,48 +980,73 @@ pub fn get_bit(bits: &[u64], bit: u64) -> bool {
   (((bits[bit as usize >> 6] >> (bit & 0x3f)) as u8) & 1) == 1
 }
 
+// Marks a location as visited, returning true if it already was. This is an
+// atomic test-and-set, so, in parallel, each location is normalized only once.
+pub fn normal_seen(seen: &[AtomicU64], host: u64) -> bool {
+  let mask = 1 << (host & 0x3f);
+  seen[host as usize >> 6].fetch_or(mask, Ordering::Relaxed) & mask != 0
+}
+
+// The locations normal() must visit after `term` was reduced to weak head
+// normal form. With a split budget over 1, those of an OP2, too.
+pub fn normal_rec_locs(term: Lnk, slen: u64) -> Vec<u64> {
+  let mut rec_locs = Vec::with_capacity(16);
+  match get_tag(term) {
+    LAM => {
+      rec_locs.push(get_loc(term, 1));
+    }
+    APP => {
+      rec_locs.push(get_loc(term, 0));
+      rec_locs.push(get_loc(term, 1));
+    }
+    PAR => {
+      rec_locs.push(get_loc(term, 0));
+      rec_locs.push(get_loc(term, 1));
+    }
+    DP0 => {
+      rec_locs.push(get_loc(term, 2));
+    }
+    DP1 => {
+      rec_locs.push(get_loc(term, 2));
+    }
+    OP2 if slen > 1 => {
+      rec_locs.push(get_loc(term, 0));
+      rec_locs.push(get_loc(term, 1));
+    }
+    CTR | CAL => {
+      let arity = get_ari(term);
+      for i in 0..arity {
+        rec_locs.push(get_loc(term, i));
+      }
+    }
+    _ => {}
+  }
+  rec_locs
+}
+
+// Split budget of each subterm, when a term with `rec_size` subterms has `slen`
+pub fn normal_rec_slen(rec_size: u64, slen: u64) -> u64 {
+  if rec_size >= 2 && slen >= rec_size {
+    slen / rec_size
+  } else {
+    slen
+  }
+}
+
 pub fn normal_go(
   mem: &mut Worker,
   funcs: &[Option<Function>],
   host: u64,
-  seen: &mut [u64],
+  seen: &[AtomicU64],
   opt_id_to_name: Option<&HashMap<u64, String>>,
   debug: bool,
 ) -> Lnk {
   let term = ask_lnk(mem, host);
-  if get_bit(seen, host) {
+  if normal_seen(seen, host) {
     term
   } else {
-    let term = reduce(mem, funcs, host, opt_id_to_name, debug);
-    set_bit(seen, host);
-    let mut rec_locs = Vec::with_capacity(16);
-    match get_tag(term) {
-      LAM => {
-        rec_locs.push(get_loc(term, 1));
-      }
-      APP => {
-        rec_locs.push(get_loc(term, 0));
-        rec_locs.push(get_loc(term, 1));
-      }
-      PAR => {
-        rec_locs.push(get_loc(term, 0));
-        rec_locs.push(get_loc(term, 1));
-      }
-      DP0 => {
-        rec_locs.push(get_loc(term, 2));
-      }
-      DP1 => {
-        rec_locs.push(get_loc(term, 2));
-      }
-      CTR | CAL => {
-        let arity = get_ari(term);
-        for i in 0..arity {
-          rec_locs.push(get_loc(term, i));
-        }
-      }
-      _ => {}
-    }
-    for loc in rec_locs {
+    let term = reduce(mem, funcs, host, 1, opt_id_to_name, debug);
+    for loc in normal_rec_locs(term, 1) {
       let lnk: Lnk = normal_go(mem, funcs, loc, seen, opt_id_to_name, debug);
       link(mem, loc, lnk);
     }
@@ -645,8 +1061,146 @@ pub fn normal(
   opt_id_to_name: Option<&HashMap<u64, String>>,
   debug: bool,
 ) -> Lnk {
-  let mut seen = vec![0; 4194304];
-  normal_go(mem, funcs, host, &mut seen, opt_id_to_name, debug)
+  let seen = zeroed_atomics(SEEN_SIZE).expect("Out of memory.");
+  normal_go(mem, funcs, host, &seen, opt_id_to_name, debug)
+}
+
+// Parallel Normalization
+// ----------------------
+// Like in the C runtime, a parallel normal() splits the term into independent
+// subterms, which workers on the same heap normalize. Each subterm is a task:
+// a location plus a split budget, which is divided among its own subterms.
+// Tasks are only pushed while there is budget left; below that, a worker
+// normalizes its subterm sequentially. Workers pop tasks from the back of their
+// own deque and steal from the front of the others'.
+
+// How many tasks a parallel normal() may split a term into, per worker
+pub const NORMAL_SPLIT_FACTOR: u64 = 8;
+
+// Spins of an idle worker before it starts yielding its thread
+const SPIN_LIMIT: u64 = 0x400;
+
+// Stack of each extra worker thread, in bytes. Only the pages used are
+// committed. normal_go() and collect() recurse as deep as the term.
+const WORKER_STACK_SIZE: usize = 0x4000000;
+
+// A task is a location to normalize, plus the split budget it was given
+pub fn Task(host: u64, slen: u64) -> u64 {
+  (slen << 48) | host
+}
+
+struct Pool {
+  deques: Vec<Mutex<VecDeque<u64>>>,
+  pending: AtomicU64, // tasks not finished yet
+}
+
+impl Pool {
+  fn push(&self, tid: usize, task: u64) {
+    self.pending.fetch_add(1, Ordering::Relaxed);
+    self.deques[tid].lock().unwrap().push_back(task);
+  }
+
+  fn take(&self, tid: usize) -> Option<u64> {
+    if let Some(task) = self.deques[tid].lock().unwrap().pop_back() {
+      return Some(task);
+    }
+    let size = self.deques.len();
+    (1..size).find_map(|i| self.deques[(tid + i) % size].lock().unwrap().pop_front())
+  }
+}
+
+// Normalizes the term at `host`, reducing its first subterm right away. The
+// others are pushed as tasks, while the budget allows.
+fn normal_task(
+  mem: &mut Worker,
+  funcs: &[Option<Function>],
+  pool: &Pool,
+  seen: &[AtomicU64],
+  tid: usize,
+  mut host: u64,
+  mut slen: u64,
+) {
+  while !normal_seen(seen, host) {
+    let term = reduce(mem, funcs, host, slen, None, false);
+    let rec_locs = normal_rec_locs(term, slen);
+    if rec_locs.is_empty() {
+      return;
+    }
+    let rec_slen = normal_rec_slen(rec_locs.len() as u64, slen);
+    for &loc in rec_locs[1..].iter().rev() {
+      if rec_slen > 1 {
+        pool.push(tid, Task(loc, rec_slen));
+      } else {
+        let lnk = normal_go(mem, funcs, loc, seen, None, false);
+        link(mem, loc, lnk);
+      }
+    }
+    host = rec_locs[0];
+    slen = rec_slen;
+  }
+}
+
+// Runs tasks until none is left. Workers only stop when every deque is empty,
+// instead of when their own subterm is done.
+fn normal_work(
+  mem: &mut Worker,
+  funcs: &[Option<Function>],
+  pool: &Pool,
+  seen: &[AtomicU64],
+  tid: usize,
+) {
+  let mut idle = 0;
+  while pool.pending.load(Ordering::Acquire) > 0 {
+    if let Some(task) = pool.take(tid) {
+      idle = 0;
+      normal_task(mem, funcs, pool, seen, tid, task & 0xFFFFFFFFFFFF, task >> 48);
+      pool.pending.fetch_sub(1, Ordering::Release);
+    } else if idle < SPIN_LIMIT {
+      idle += 1;
+      std::hint::spin_loop();
+    } else {
+      std::thread::yield_now();
+    }
+  }
+}
+
+/// Normalizes the term at `host` with `threads` workers sharing the heap. As
+/// OP2s near the root are split too, leaving them unreduced, this finishes with
+/// a sequential normal(), which also is all that runs in debug mode, with a
+/// single thread, or if the heap can't be reserved.
+pub fn normal_par(
+  mem: &mut Worker,
+  host: u64,
+  funcs: &[Option<Function>],
+  threads: usize,
+  opt_id_to_name: Option<&HashMap<u64, String>>,
+  debug: bool,
+) -> Lnk {
+  if threads > 1 && !debug && heap_reserve(mem) {
+    let seen = zeroed_atomics(SEEN_SIZE).expect("Out of memory.");
+    let pool = Pool {
+      deques: (0..threads).map(|_| Mutex::new(VecDeque::new())).collect(),
+      pending: AtomicU64::new(0),
+    };
+    pool.push(0, Task(host, threads as u64 * NORMAL_SPLIT_FACTOR));
+    let mut forks: Vec<Worker> = (1..threads).map(|_| fork_worker(mem)).collect();
+    mem.shared = true;
+    std::thread::scope(|scope| {
+      for (i, fork) in forks.iter_mut().enumerate() {
+        let (pool, seen) = (&pool, &seen);
+        std::thread::Builder::new()
+          .stack_size(WORKER_STACK_SIZE)
+          .spawn_scoped(scope, move || normal_work(fork, funcs, pool, seen, i + 1))
+          .expect("Couldn't start a worker thread.");
+      }
+      normal_work(mem, funcs, &pool, &seen, 0);
+    });
+    for fork in forks {
+      join_worker(mem, fork);
+    }
+    mem.shared = false;
+  }
+  normal(mem, host, funcs, opt_id_to_name, debug)
 }
 
 // Debug
@@ -678,6 +1232,7 @@ pub fn show_lnk(x: Lnk) -> String {
       OP2 => "OP2",
       U32 => "U32",
       F32 => "F32",
+      U60 => "U60",
       OUT => "OUT",
       NIL => "NIL",
       _ => "???",
@@ -691,7 +1246,7 @@ pub fn show_mem(worker: &Worker) -> String {
   for i in 0..48 {
     // pushes to the string
     s.push_str(&format!("{:x} | ", i));
-    s.push_str(&show_lnk(worker.node[i]));
+    s.push_str(&show_lnk(ask_lnk(worker, i)));
     s.push('\n');
   }
   s
@@ -820,6 +1375,10 @@ pub fn show_term(
       U32 => {
         format!("{}", get_val(term))
       }
+      F32 => lang::show_f32(get_f32(term)),
+      U60 => {
+        format!("{}u", get_num(term))
+      }
       CTR | CAL => {
         let func = get_ext(term);
         let arit = get_ari(term);
@@ -865,3 +1424,43 @@ pub fn show_term(
   }
   text
 }
+
+#[cfg(test)]
+mod tests {
+  use super::*;
+
+  #[test]
+  fn snapshot_roundtrip() {
+    let mut mem = new_worker();
+    let pair = alloc(&mut mem, 2);
+    let lam = alloc(&mut mem, 2);
+    let junk = alloc(&mut mem, 2);
+    let cell = alloc(&mut mem, 3);
+    link(&mut mem, lam + 0, Era());
+    link(&mut mem, lam + 1, U_32(7));
+    link(&mut mem, pair + 0, Lam(lam));
+    link(&mut mem, pair + 1, U_32(8));
+    clear(&mut mem, junk, 2);
+    clear(&mut mem, cell, 3);
+    let root = alloc(&mut mem, 1);
+    link(&mut mem, root, Ctr(2, 0, pair));
+    let path = std::env::temp_dir().join(format!("hvm-snapshot-{}", std::process::id()));
+    let path = path.to_str().unwrap();
+    save_snapshot(&mut mem, root, 42, path).unwrap();
+    assert!(load_snapshot(path, 43).is_err());
+    let (mut back, host) = load_snapshot(path, 42).unwrap();
+    let bytes = std::fs::read(path).unwrap();
+    std::fs::write(path, &bytes[..bytes.len() - 8]).unwrap();
+    assert!(load_snapshot(path, 42).is_err());
+    std::fs::remove_file(path).unwrap();
+    assert_eq!(host, root);
+    assert_eq!(heap_used(&back), heap_used(&mem));
+    assert_eq!(heap_used(&back), 10);
+    assert_eq!(ask_lnk(&back, host), Ctr(2, 0, pair));
+    assert_eq!(ask_arg(&back, ask_lnk(&back, pair + 0), 1), U_32(7));
+    assert_eq!(back.free[2], vec![junk]);
+    assert_eq!(back.free[3], vec![cell]);
+    assert_eq!(alloc(&mut back, 3), cell);
+    assert!(load_snapshot("/nonexistent/hvm-snapshot", 42).is_err());
+  }
+}